@@ -0,0 +1,132 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Black box recorder.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "blackbox.h"
+#include "roof_clock.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static MonotonicClock monotonic;
+
+const char BlackBox::MAGIC[8] = { 'I', 'K', 'R', 'B', 'B', 'O', 'X', 0 };
+
+const char *BlackBox::getEventName(Event event)
+{
+    switch (event)
+    {
+        case EVENT_OPEN:            return "OPEN";
+        case EVENT_INPUT_SAMPLE:    return "INPUT_SAMPLE";
+        case EVENT_LIMIT_SWITCH:    return "LIMIT_SWITCH";
+        case EVENT_STOP_TRIGGER:    return "STOP_TRIGGER";
+        case EVENT_RELAY_COMMAND:   return "RELAY_COMMAND";
+        case EVENT_RELAY_RESPONSE:  return "RELAY_RESPONSE";
+        case EVENT_RELAY_FAILED:    return "RELAY_FAILED";
+        case EVENT_RELAY_CANCELLED: return "RELAY_CANCELLED";
+        case EVENT_MOTION_REQUEST:  return "MOTION_REQUEST";
+        case EVENT_STATE:           return "STATE";
+        case EVENT_WEATHER:         return "WEATHER";
+        case EVENT_COUNT:           break;
+    }
+    return "UNKNOWN";
+}
+
+BlackBox::BlackBox() : header(nullptr), records(nullptr), capacity(0), mappedSize(0)
+{
+}
+
+BlackBox::~BlackBox()
+{
+    close();
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+bool BlackBox::open(const char *path, uint64_t count)
+{
+    close();
+
+    if (count == 0)
+        return false;
+
+    int fd = ::open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+
+    size_t size = sizeof(Header) + count * sizeof(Record);
+
+    // Keep the records of a previous run if the layout matches, start over otherwise.
+    Header existing;
+    struct stat st;
+    bool reuse = fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) == size &&
+                 pread(fd, &existing, sizeof(existing), 0) == static_cast<ssize_t>(sizeof(existing)) &&
+                 memcmp(existing.magic, MAGIC, sizeof(MAGIC)) == 0 && existing.version == VERSION &&
+                 existing.recordSize == sizeof(Record) && existing.capacity == count;
+
+    if (reuse == false && (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0))
+    {
+        ::close(fd);
+        return false;
+    }
+
+    void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED)
+        return false;
+
+    header = static_cast<Header *>(map);
+    if (reuse == false)
+    {
+        memcpy(header->magic, MAGIC, sizeof(MAGIC));
+        header->version    = VERSION;
+        header->recordSize = sizeof(Record);
+        header->capacity   = count;
+        __atomic_store_n(&header->next, 0, __ATOMIC_RELEASE);
+    }
+
+    mappedSize = size;
+    capacity   = count;
+    records    = reinterpret_cast<Record *>(static_cast<char *>(map) + sizeof(Header));
+
+    // Anchor for converting the monotonic record times of this run to wall clock time.
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    header->openMonotonic = monotonic.now();
+    header->openWall      = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    record(header->openMonotonic, EVENT_OPEN, NO_ROOF, 0, static_cast<uint32_t>(now.tv_sec), static_cast<uint32_t>(now.tv_nsec));
+    return true;
+}
+
+void BlackBox::close()
+{
+    if (header)
+        munmap(header, mappedSize);
+    header     = nullptr;
+    records    = nullptr;
+    capacity   = 0;
+    mappedSize = 0;
+}
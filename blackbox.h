@@ -0,0 +1,156 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Black box recorder. Fixed size binary event records are written into a ring
+ in a memory mapped file, so the last events survive a driver crash and can be
+ decoded afterwards with ikarus_blackbox_dump. Recording takes one atomic
+ increment and a 24 byte store: no locks, no formatting and no system calls,
+ so it stays on permanently even for every raw limit switch sample change.
+
+ Any thread may record. Each writer reserves a slot by incrementing the write
+ counter in the file header and publishes the record by storing its sequence
+ number last. A reader skips slots whose sequence does not match, which are
+ being overwritten.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef BLACKBOX_H
+#define BLACKBOX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+class BlackBox
+{
+    public:
+
+        enum Event
+        {
+            // Recorder opened. arg1:arg2 wall clock seconds and nanoseconds at time.
+            EVENT_OPEN,
+            // Raw limit switch level changed. arg0 sampler input, arg1 level.
+            EVENT_INPUT_SAMPLE,
+            // Debounce filter accepted a level. arg0 sampler input, arg1 level, arg2 debounce in us.
+            EVENT_LIMIT_SWITCH,
+            // Sampler fired an armed emergency stop. arg0 sampler input.
+            EVENT_STOP_TRIGGER,
+            // Relay command queued. arg0 priority, arg1 command id (0 if answered from the outlet cache), arg2 outlet set | clear << 8.
+            EVENT_RELAY_COMMAND,
+            // Relay answered. arg0 HTTP code, arg1 command id, arg2 round trip in us.
+            EVENT_RELAY_RESPONSE,
+            // Relay request failed. arg0 CURLcode, arg1 command id.
+            EVENT_RELAY_FAILED,
+            // Relay command dropped before it was sent. arg1 command id.
+            EVENT_RELAY_CANCELLED,
+            // Client asked for motion. arg0 direction (0 open, 1 close), arg1 operation (0 start, 1 stop).
+            EVENT_MOTION_REQUEST,
+            // Roof state changed. arg0 dome state, arg1 park (0 unknown, 1 parked, 2 unparked),
+            // arg2 full open | full closed << 1 | motion property state << 4 | park property state << 8
+            // | roof state machine state << 12.
+            EVENT_STATE,
+            // Weather state changed. arg0 IPState.
+            EVENT_WEATHER,
+            EVENT_COUNT
+        };
+
+        // Events not tied to a roof, e.g. sampler inputs
+        static const uint8_t NO_ROOF = 0xFF;
+
+        static const uint32_t VERSION = 1;
+        static const uint64_t DEFAULT_CAPACITY = 65536;
+
+        // Native byte order, 24 bytes
+        struct Record
+        {
+            // Monotonic nanoseconds
+            uint64_t time;
+            // Low 32 bits of the record index + 1, stored last
+            uint32_t sequence;
+            uint8_t event;
+            uint8_t roof;
+            uint16_t arg0;
+            uint32_t arg1;
+            uint32_t arg2;
+        };
+
+        struct Header
+        {
+            char magic[8];
+            uint32_t version;
+            uint32_t recordSize;
+            uint64_t capacity;
+            // Records written since the file was created. Only accessed with atomic builtins.
+            uint64_t next;
+            // Monotonic and wall clock nanoseconds when the current run opened the file
+            uint64_t openMonotonic;
+            uint64_t openWall;
+            uint8_t reserved[16];
+        };
+
+        static const char MAGIC[8];
+
+        static const char *getEventName(Event event);
+
+        BlackBox();
+        ~BlackBox();
+
+        /**
+         * @brief open Map the ring file, creating or resetting it if it does not hold
+         * capacity records of this version. Existing records are kept otherwise.
+         */
+        bool open(const char *path, uint64_t capacity = DEFAULT_CAPACITY);
+        /**
+         * @brief close Unmap the file. No thread may be recording.
+         */
+        void close();
+        bool isOpen() const { return records != nullptr; }
+
+        /**
+         * @brief record Append one event. Lock-free, safe from any thread, does nothing if closed.
+         * @param roof roof slot, or NO_ROOF.
+         */
+        void record(uint64_t time, Event event, int roof, uint16_t arg0 = 0, uint32_t arg1 = 0, uint32_t arg2 = 0)
+        {
+            if (records == nullptr)
+                return;
+
+            uint64_t index = __atomic_fetch_add(&header->next, 1, __ATOMIC_RELAXED);
+            Record &slot = records[index % capacity];
+
+            __atomic_store_n(&slot.sequence, 0, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            slot.time  = time;
+            slot.event = static_cast<uint8_t>(event);
+            slot.roof  = static_cast<uint8_t>(roof);
+            slot.arg0  = arg0;
+            slot.arg1  = arg1;
+            slot.arg2  = arg2;
+            __atomic_store_n(&slot.sequence, static_cast<uint32_t>(index + 1), __ATOMIC_RELEASE);
+        }
+
+    private:
+        Header *header;
+        Record *records;
+        uint64_t capacity;
+        size_t mappedSize;
+};
+
+static_assert(sizeof(BlackBox::Record) == 24, "Black box record layout changed");
+static_assert(sizeof(BlackBox::Header) == 64, "Black box header layout changed");
+
+#endif
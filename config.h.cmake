@@ -4,6 +4,18 @@
 /* Define INDI Data Dir */
 #cmakedefine INDI_DATA_DIR "@INDI_DATA_DIR@"
 
+/* Define if libgpiod is available */
+#cmakedefine HAVE_GPIOD 1
+
+/* Define if libgpiod provides the v2 API */
+#cmakedefine HAVE_GPIOD_V2 1
+
+/* Define if wiringPi is available */
+#cmakedefine HAVE_WIRINGPI 1
+
+/* Define if libmodbus is available */
+#cmakedefine HAVE_MODBUS 1
+
 /* Define Driver version */
 #define INDI_IKARUSROOF_VERSION_MAJOR @INDI_IKARUSROOF_VERSION_MAJOR@
 #define INDI_IKARUSROOF_VERSION_MINOR @INDI_IKARUSROOF_VERSION_MINOR@
@@ -0,0 +1,101 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Integrator debounce filter for one digital input. Every sample moves a counter
+ one step toward the sampled level; the stable level only flips once the counter
+ reaches the end of the window. Shared by the limit switch sampler thread and
+ the accelerated roof simulator so both filter exactly the same way.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef DEBOUNCEFILTER_H
+#define DEBOUNCEFILTER_H
+
+#include <stdint.h>
+
+class DebounceFilter
+{
+    public:
+
+        enum Result
+        {
+            // Input agrees with the stable level
+            STABLE,
+            // Input is moving, not decided yet
+            SETTLING,
+            // Stable level flipped on this sample
+            CHANGED,
+            // Input went back to the stable level before the window filled up
+            REJECTED
+        };
+
+        DebounceFilter() : level(0), integrator(0), window(1), firstChange(0), changeStart(0) {}
+
+        void reset(int initialLevel, int samples)
+        {
+            window      = samples > 0 ? samples : 1;
+            level       = initialLevel ? 1 : 0;
+            integrator  = level ? window : 0;
+            firstChange = 0;
+            changeStart = 0;
+        }
+
+        Result update(int sample, uint64_t now)
+        {
+            if (sample)
+                integrator = (integrator < window) ? integrator + 1 : window;
+            else
+                integrator = (integrator > 0) ? integrator - 1 : 0;
+
+            // Remember when the raw level first started to move away from the stable one.
+            if ((sample ? 1 : 0) != level && firstChange == 0)
+                firstChange = now;
+
+            if (integrator != 0 && integrator != window)
+                return SETTLING;
+
+            int settled = integrator ? 1 : 0;
+            Result result = STABLE;
+            if (settled != level)
+            {
+                level  = settled;
+                result = CHANGED;
+                changeStart = firstChange ? firstChange : now;
+            }
+            else if (firstChange != 0)
+                result = REJECTED;
+
+            firstChange = 0;
+            return result;
+        }
+
+        int getLevel() const { return level; }
+        bool isSettling() const { return integrator != 0 && integrator != window; }
+
+        // After CHANGED: time of the first raw sample at the new level
+        uint64_t getChangeStart() const { return changeStart; }
+
+    private:
+        int level;
+        int integrator;
+        int window;
+        uint64_t firstChange;
+        uint64_t changeStart;
+};
+
+#endif
@@ -0,0 +1,472 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Emergency stop path.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "emergency_stop.h"
+#include "roof_clock.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <mutex>
+
+// Longest wait for the relay to acknowledge STOP
+#define ACK_TIMEOUT_MS   2000
+// Retry interval while the relay cannot be reached
+#define RECONNECT_MS     1000
+
+const double EmergencyStop::BUCKET_LIMITS[EmergencyStop::BUCKET_COUNT - 1] = { 1, 2, 5, 10, 20, 50, 100, 200, 500 };
+
+static MonotonicClock monotonic;
+
+// mlockall is process wide. Memory stays locked until the last real-time stop thread stopped.
+static std::mutex memoryLockMutex;
+static int memoryLockCount = 0;
+
+static bool lockMemory()
+{
+    std::lock_guard<std::mutex> guard(memoryLockMutex);
+    if (memoryLockCount == 0 && mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+        return false;
+    memoryLockCount++;
+    return true;
+}
+
+static void unlockMemory()
+{
+    std::lock_guard<std::mutex> guard(memoryLockMutex);
+    if (memoryLockCount > 0 && --memoryLockCount == 0)
+        munlockall();
+}
+
+// Milliseconds left until deadline for poll, rounded up, 0 once it passed
+static int remainingMs(uint64_t deadline)
+{
+    uint64_t now = monotonic.now();
+    return (now >= deadline) ? 0 : static_cast<int>((deadline - now) / 1000000) + 1;
+}
+
+static std::string base64(const std::string &in)
+{
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    size_t i = 0;
+    for (; i + 2 < in.size(); i += 3)
+    {
+        uint32_t v = (uint8_t)in[i] << 16 | (uint8_t)in[i + 1] << 8 | (uint8_t)in[i + 2];
+        out += table[v >> 18];
+        out += table[(v >> 12) & 63];
+        out += table[(v >> 6) & 63];
+        out += table[v & 63];
+    }
+    if (i < in.size())
+    {
+        uint32_t v = (uint8_t)in[i] << 16 | ((i + 1 < in.size()) ? (uint8_t)in[i + 1] << 8 : 0);
+        out += table[v >> 18];
+        out += table[(v >> 12) & 63];
+        out += (i + 1 < in.size()) ? table[(v >> 6) & 63] : '=';
+        out += '=';
+    }
+    return out;
+}
+
+EmergencyStop::EmergencyStop() : addressCount(0), transport(nullptr), priority(0), socketFD(-1), triggerFD(-1), pendingTrigger(0), running(false),
+    realTime(false), memoryLocked(false), maxLatencyNs(0)
+{
+    resultPipe[0] = resultPipe[1] = -1;
+    for (int i = 0; i < BUCKET_COUNT; i++)
+        histogram[i] = 0;
+}
+
+EmergencyStop::~EmergencyStop()
+{
+    stop();
+    delete transport;
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+bool EmergencyStop::start(const RelayExecutor::Endpoint &endpoint, int threadPriority)
+{
+    if (running)
+        return true;
+
+    host = endpoint.host;
+    port = "80";
+    size_t colon = host.find(':');
+    if (colon != std::string::npos)
+    {
+        port = host.substr(colon + 1);
+        host = host.substr(0, colon);
+    }
+    pinnedIP = endpoint.pinnedIP;
+    priority = threadPriority;
+
+    request = "GET /outlet?a=OFF HTTP/1.1\r\nHost: " + endpoint.host + "\r\n";
+    if (endpoint.username.empty() == false)
+        request += "Authorization: Basic " + base64(endpoint.username + ":" + endpoint.password) + "\r\n";
+    request += "Connection: keep-alive\r\n\r\n";
+
+    delete transport;
+    transport = RelayTransport::create(endpoint.transport);
+    if (transport)
+        transport->setAddress(endpoint.host, endpoint.pinnedIP);
+
+    triggerFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (triggerFD < 0)
+        return false;
+    if (pipe2(resultPipe, O_NONBLOCK | O_CLOEXEC) != 0)
+    {
+        close(triggerFD);
+        triggerFD = -1;
+        return false;
+    }
+
+    pendingTrigger = 0;
+    realTime       = false;
+
+    // Fault in everything the stop thread will touch before it has to be fast.
+    memoryLocked = (priority > 0 && lockMemory());
+    realTime     = memoryLocked;
+
+    // Connecting may take up to ACK_TIMEOUT_MS and is left to the thread, which retries as well.
+    addressCount = 0;
+    if (transport == nullptr)
+        resolveRelay();
+
+    running = true;
+    worker  = std::thread(&EmergencyStop::stopLoop, this);
+
+    if (priority > 0)
+    {
+        struct sched_param param;
+        param.sched_priority = priority;
+        if (pthread_setschedparam(worker.native_handle(), SCHED_FIFO, &param) != 0)
+            realTime = false;
+    }
+
+    return true;
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+void EmergencyStop::stop()
+{
+    if (running == false)
+        return;
+
+    running = false;
+    uint64_t one = 1;
+    if (write(triggerFD, &one, sizeof(one)) < 0) { /* Thread wakes up on its poll timeout anyway */ }
+    worker.join();
+
+    disconnectRelay();
+    delete transport;
+    transport = nullptr;
+    close(triggerFD);
+    triggerFD = -1;
+    close(resultPipe[0]);
+    close(resultPipe[1]);
+    resultPipe[0] = resultPipe[1] = -1;
+
+    Result stale;
+    while (results.pop(stale))
+        ;
+
+    if (memoryLocked)
+        unlockMemory();
+    memoryLocked = false;
+    realTime     = false;
+}
+
+/************************************************************************************
+ * First trigger wins until the stop thread picks it up.
+* ***********************************************************************************/
+void EmergencyStop::trigger(uint64_t timestamp)
+{
+    if (running == false)
+        return;
+
+    uint64_t expected = 0;
+    pendingTrigger.compare_exchange_strong(expected, timestamp ? timestamp : 1);
+
+    uint64_t one = 1;
+    if (write(triggerFD, &one, sizeof(one)) < 0) { /* Counter saturated, a wakeup is already pending */ }
+}
+
+bool EmergencyStop::popResult(Result &result)
+{
+    char drain[64];
+    while (read(resultPipe[0], drain, sizeof(drain)) > 0)
+        ;
+
+    return results.pop(result);
+}
+
+void EmergencyStop::getHistogram(uint64_t counts[BUCKET_COUNT]) const
+{
+    for (int i = 0; i < BUCKET_COUNT; i++)
+        counts[i] = histogram[i].load(std::memory_order_relaxed);
+}
+
+/************************************************************************************
+ * Stop thread
+* ***********************************************************************************/
+void EmergencyStop::stopLoop()
+{
+    // Other transports keep their own connection, reading the outlets once has it ready.
+    if (transport)
+        connectRelay(monotonic.now() + ACK_TIMEOUT_MS * 1000000ULL);
+
+    while (running)
+    {
+        if (socketFD < 0 && transport == nullptr)
+            connectRelay(monotonic.now() + ACK_TIMEOUT_MS * 1000000ULL);
+
+        struct pollfd pfds[2];
+        pfds[0].fd     = triggerFD;
+        pfds[0].events = POLLIN;
+        pfds[1].fd     = socketFD;
+        pfds[1].events = POLLIN | POLLRDHUP;
+
+        if (poll(pfds, (socketFD >= 0) ? 2 : 1, RECONNECT_MS) <= 0)
+            continue;
+
+        if (pfds[0].revents & POLLIN)
+        {
+            uint64_t count;
+            if (read(triggerFD, &count, sizeof(count)) < 0) { /* Already drained */ }
+
+            uint64_t triggered = pendingTrigger.exchange(0);
+            if (triggered && running)
+            {
+                Result result;
+                result.triggered    = triggered;
+                result.success      = sendStop();
+                result.acknowledged = monotonic.now();
+                record(result);
+            }
+            continue;
+        }
+
+        // Nothing is expected from the relay while idle: it closed the connection. Have a fresh one ready.
+        if (socketFD >= 0 && pfds[1].revents)
+            disconnectRelay();
+    }
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+bool EmergencyStop::resolveRelay()
+{
+    struct addrinfo hints, *list = nullptr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    const char *node = pinnedIP.empty() ? host.c_str() : pinnedIP.c_str();
+    if (getaddrinfo(node, port.c_str(), &hints, &list) != 0)
+        return false;
+
+    addressCount = 0;
+    for (struct addrinfo *a = list; a != nullptr && addressCount < MAX_ADDRESSES; a = a->ai_next)
+    {
+        memcpy(&addresses[addressCount], a->ai_addr, a->ai_addrlen);
+        addressLengths[addressCount++] = a->ai_addrlen;
+    }
+
+    freeaddrinfo(list);
+    return addressCount > 0;
+}
+
+bool EmergencyStop::connectRelay(uint64_t deadline)
+{
+    // Other transports connect on their first command, reading the outlets has the connection ready.
+    if (transport)
+        return transport->execute(0, 0, remainingMs(deadline));
+
+    // Start could not resolve the relay, try again.
+    if (addressCount == 0 && resolveRelay() == false)
+        return false;
+
+    for (int i = 0; i < addressCount && socketFD < 0; i++)
+    {
+        const struct sockaddr *address = reinterpret_cast<const struct sockaddr *>(&addresses[i]);
+        int fd = socket(address->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            continue;
+
+        bool connected = (connect(fd, address, addressLengths[i]) == 0);
+        if (connected == false && errno == EINPROGRESS)
+        {
+            struct pollfd pfd;
+            pfd.fd     = fd;
+            pfd.events = POLLOUT;
+
+            int error = 0;
+            socklen_t length = sizeof(error);
+            int timeout = remainingMs(deadline);
+            connected = timeout > 0 && poll(&pfd, 1, timeout) > 0 &&
+                        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0;
+        }
+
+        if (connected)
+        {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+            socketFD = fd;
+        }
+        else
+            close(fd);
+    }
+
+    return socketFD >= 0;
+}
+
+void EmergencyStop::disconnectRelay()
+{
+    if (transport)
+        transport->disconnect();
+    if (socketFD >= 0)
+        close(socketFD);
+    socketFD = -1;
+}
+
+/************************************************************************************
+ * Send the pre-built request and wait for the status line and headers. If the kept
+ * connection turns out to be dead, reconnect once and send again. Everything, the
+ * reconnect included, shares one ACK_TIMEOUT_MS deadline.
+* ***********************************************************************************/
+bool EmergencyStop::sendStop()
+{
+    uint64_t deadline = monotonic.now() + ACK_TIMEOUT_MS * 1000000ULL;
+
+    // A dead kept connection is retried by the transport itself.
+    if (transport)
+        return transport->execute(0, 0xFF, ACK_TIMEOUT_MS);
+
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        if (socketFD < 0 && connectRelay(deadline) == false)
+            return false;
+
+        if (send(socketFD, request.data(), request.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(request.size()))
+        {
+            disconnectRelay();
+            continue;
+        }
+
+        char response[2048];
+        size_t length = 0;
+        const char *headerEnd = nullptr;
+
+        while (headerEnd == nullptr && length < sizeof(response) - 1)
+        {
+            struct pollfd pfd;
+            pfd.fd     = socketFD;
+            pfd.events = POLLIN;
+            int timeout = remainingMs(deadline);
+            if (timeout == 0 || poll(&pfd, 1, timeout) <= 0)
+                break;
+
+            ssize_t n = recv(socketFD, response + length, sizeof(response) - 1 - length, 0);
+            if (n <= 0)
+                break;
+            length += n;
+            response[length] = 0;
+            headerEnd = strstr(response, "\r\n\r\n");
+        }
+
+        if (headerEnd == nullptr)
+        {
+            // Connection was stale if nothing came back at all, try a fresh one.
+            disconnectRelay();
+            if (length == 0)
+                continue;
+            return false;
+        }
+
+        bool success = (strncmp(response, "HTTP/1.", 7) == 0 && strncmp(response + 8, " 200", 4) == 0);
+
+        // Consume the body so the next request starts on a clean connection.
+        const char *contentLength = strcasestr(response, "Content-Length:");
+        size_t body = contentLength ? strtoul(contentLength + 15, nullptr, 10) : 0;
+        size_t received = length - (headerEnd + 4 - response);
+        while (received < body)
+        {
+            char discard[512];
+            struct pollfd pfd;
+            pfd.fd     = socketFD;
+            pfd.events = POLLIN;
+            int timeout = remainingMs(deadline);
+            if (timeout == 0 || poll(&pfd, 1, timeout) <= 0)
+                break;
+            ssize_t n = recv(socketFD, discard, sizeof(discard), 0);
+            if (n <= 0)
+                break;
+            received += n;
+        }
+
+        if (received < body || contentLength == nullptr || strcasestr(response, "Connection: close"))
+            disconnectRelay();
+
+        return success;
+    }
+
+    return false;
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+void EmergencyStop::record(const Result &result)
+{
+    uint64_t latency = (result.acknowledged > result.triggered) ? result.acknowledged - result.triggered : 0;
+    double ms = latency / 1e6;
+
+    int bucket = 0;
+    while (bucket < BUCKET_COUNT - 1 && ms > BUCKET_LIMITS[bucket])
+        bucket++;
+    histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+
+    uint64_t previous = maxLatencyNs.load(std::memory_order_relaxed);
+    while (latency > previous && !maxLatencyNs.compare_exchange_weak(previous, latency, std::memory_order_relaxed))
+        ;
+
+    results.push(result);
+    if (write(resultPipe[1], "r", 1) < 0) { /* INDI thread already has a wakeup pending */ }
+}
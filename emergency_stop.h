@@ -0,0 +1,128 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Emergency stop path. A dedicated thread keeps its own connection to the DIN
+ relay open with the STOP request already encoded, and sends it the moment it
+ is triggered, either straight from the limit switch sampler thread or from
+ Abort. Nothing on this path parses XML, allocates, logs or waits for the INDI
+ event loop. The thread can optionally run with SCHED_FIFO priority and the
+ process memory locked so page faults cannot delay it.
+
+ The regular relay executor still sends its own STOP afterwards. Switching
+ all outlets off twice is harmless.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef EMERGENCYSTOP_H
+#define EMERGENCYSTOP_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+#include "relay_executor.h"
+#include "spsc_ring.h"
+
+class EmergencyStop
+{
+    public:
+
+        // Upper bounds of the trigger to acknowledgement histogram buckets in ms. The last bucket is open ended.
+        static const int BUCKET_COUNT = 10;
+        static const double BUCKET_LIMITS[BUCKET_COUNT - 1];
+
+        struct Result
+        {
+            bool success;
+            // Monotonic ns of the trigger and of the relay acknowledgement
+            uint64_t triggered;
+            uint64_t acknowledged;
+        };
+
+        EmergencyStop();
+        ~EmergencyStop();
+
+        /**
+         * @brief start Resolve the relay address and start the stop thread, which connects.
+         * Nothing here waits on the network beyond name resolution.
+         * @param priority SCHED_FIFO priority (1-99) for the thread, 0 for normal scheduling.
+         * Memory is locked with mlockall when a priority is given.
+         */
+        bool start(const RelayExecutor::Endpoint &endpoint, int priority);
+        void stop();
+        bool isRunning() const { return running; }
+
+        // True if the requested real-time priority and memory locking were granted
+        bool isRealTime() const { return realTime; }
+
+        /**
+         * @brief trigger Send STOP now. Lock-free and safe from any thread.
+         * @param timestamp monotonic ns of the event that caused the stop.
+         */
+        void trigger(uint64_t timestamp);
+
+        // Readable when results are waiting. Register with IEAddCallback.
+        int getEventFD() const { return resultPipe[0]; }
+        bool popResult(Result &result);
+
+        void getHistogram(uint64_t counts[BUCKET_COUNT]) const;
+        double getMaxLatency() const { return maxLatencyNs.load(std::memory_order_relaxed) / 1e6; }
+
+    private:
+
+        void stopLoop();
+        bool resolveRelay();
+        // Non-blocking connect to the resolved addresses, given up at deadline (monotonic ns)
+        bool connectRelay(uint64_t deadline);
+        void disconnectRelay();
+        bool sendStop();
+        void record(const Result &result);
+
+        std::string host;
+        std::string port;
+        std::string pinnedIP;
+        static const int MAX_ADDRESSES = 4;
+        struct sockaddr_storage addresses[MAX_ADDRESSES];
+        socklen_t addressLengths[MAX_ADDRESSES];
+        int addressCount;
+        // Complete HTTP request for /outlet?a=OFF, built once at start
+        std::string request;
+        // Used instead of the HTTP request and socketFD for relays that speak another transport
+        RelayTransport *transport;
+        int priority;
+
+        int socketFD;
+        int triggerFD;
+        int resultPipe[2];
+        std::atomic<uint64_t> pendingTrigger;
+
+        std::thread worker;
+        std::atomic<bool> running;
+        std::atomic<bool> realTime;
+        // Holds a reference on the process wide mlockall
+        bool memoryLocked;
+
+        std::atomic<uint64_t> histogram[BUCKET_COUNT];
+        std::atomic<uint64_t> maxLatencyNs;
+        SPSCRing<Result, 16> results;
+};
+
+#endif
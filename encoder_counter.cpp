@@ -0,0 +1,266 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Shaft encoder counter.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "encoder_counter.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+// Longest sleep on counter descriptors, bounds how long stop() waits for the thread
+#define IDLE_EDGE_TIMEOUT_MS 100
+// Edges decoded per wakeup
+#define EDGE_BATCH 256
+
+/************************************************************************************
+ * Count change from one A/B state to the next, indexed by old << 2 | new. Counting up
+ * runs 00 -> 01 -> 11 -> 10 -> 00. A single edge never changes both lines.
+* ***********************************************************************************/
+static const int QUADRATURE_STEPS[16] =
+{
+    0, +1, -1, 0,
+    -1, 0, 0, +1,
+    +1, 0, 0, -1,
+    0, -1, +1, 0
+};
+
+EncoderCounter::EncoderCounter() : gpio(nullptr), channelCount(0), running(false), dropped(0), edges(0)
+{
+    for (int i = 0; i < MAX_CHANNELS; i++)
+    {
+        channels[i].inputA = channels[i].inputB = -1;
+        counts[i]         = 0;
+        directions[i]     = 1;
+        errors[i]         = 0;
+        states[i]         = 0;
+        stopTargets[i]    = nullptr;
+        stopCounts[i]     = 0;
+        stopDirections[i] = 0;
+    }
+    for (int i = 0; i < GPIOBackend::MAX_PINS; i++)
+        pinChannels[i] = -1;
+    eventPipe[0] = eventPipe[1] = -1;
+}
+
+EncoderCounter::~EncoderCounter()
+{
+    stop();
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+bool EncoderCounter::start(GPIOBackend *backend, const Channel *setup, int count)
+{
+    if (running || backend == nullptr || count > MAX_CHANNELS)
+        return false;
+
+    int levels[GPIOBackend::MAX_PINS];
+    if (backend->readCounterLevels(levels) == false || pipe2(eventPipe, O_NONBLOCK | O_CLOEXEC) != 0)
+        return false;
+
+    gpio         = backend;
+    channelCount = count;
+    for (int i = 0; i < GPIOBackend::MAX_PINS; i++)
+        pinChannels[i] = -1;
+
+    for (int i = 0; i < channelCount; i++)
+    {
+        channels[i] = setup[i];
+        counts[i]   = 0;
+        errors[i]   = 0;
+        states[i]   = 0;
+        disarmStop(i);
+
+        if (channels[i].inputA < 0)
+            continue;
+
+        pinChannels[channels[i].inputA] = i * 2;
+        states[i] = levels[channels[i].inputA] << 1;
+        if (channels[i].inputB >= 0)
+        {
+            pinChannels[channels[i].inputB] = i * 2 + 1;
+            states[i] |= levels[channels[i].inputB];
+        }
+    }
+
+    dropped = 0;
+    edges   = 0;
+    running = true;
+    counter = std::thread(&EncoderCounter::counterLoop, this);
+    return true;
+}
+
+void EncoderCounter::stop()
+{
+    if (running == false)
+        return;
+
+    running = false;
+    counter.join();
+
+    close(eventPipe[0]);
+    close(eventPipe[1]);
+    eventPipe[0] = eventPipe[1] = -1;
+
+    Reached stale;
+    while (reached.pop(stale))
+        ;
+    gpio = nullptr;
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+void EncoderCounter::setDirection(int channel, int direction)
+{
+    directions[channel].store(direction < 0 ? -1 : 1, std::memory_order_relaxed);
+}
+
+void EncoderCounter::armStop(int channel, EmergencyStop *stop, int64_t target, int direction)
+{
+    disarmStop(channel);
+    stopTargets[channel].store(stop, std::memory_order_relaxed);
+    stopCounts[channel].store(target, std::memory_order_relaxed);
+    stopDirections[channel].store(direction < 0 ? -1 : 1, std::memory_order_release);
+}
+
+bool EncoderCounter::popReached(Reached &target)
+{
+    char drain[64];
+    while (read(eventPipe[0], drain, sizeof(drain)) > 0)
+        ;
+
+    return reached.pop(target);
+}
+
+/************************************************************************************
+ * Counter thread
+* ***********************************************************************************/
+void EncoderCounter::counterLoop()
+{
+    int fds[GPIOBackend::MAX_PINS];
+    int fdCount = gpio->getCounterFDs(fds, GPIOBackend::MAX_PINS);
+
+    struct pollfd pfds[GPIOBackend::MAX_PINS];
+    uint64_t sequences[GPIOBackend::MAX_PINS];
+    for (int i = 0; i < fdCount; i++)
+    {
+        pfds[i].fd     = fds[i];
+        pfds[i].events = POLLIN;
+        sequences[i]   = 0;
+    }
+
+    GPIOBackend::CounterEdge batch[EDGE_BATCH];
+
+    while (running)
+    {
+        if (poll(pfds, fdCount, IDLE_EDGE_TIMEOUT_MS) <= 0)
+            continue;
+
+        int count = 0;
+        for (int i = 0; i < fdCount && count < EDGE_BATCH; i++)
+        {
+            if ((pfds[i].revents & POLLIN) == 0)
+                continue;
+
+            int got = gpio->readCounterEdges(pfds[i].fd, batch + count, EDGE_BATCH - count);
+            for (int j = count; j < count + got; j++)
+            {
+                if (batch[j].sequence == 0)
+                    continue;
+                if (sequences[i] != 0 && batch[j].sequence > sequences[i] + 1)
+                    dropped.fetch_add(batch[j].sequence - sequences[i] - 1, std::memory_order_relaxed);
+                sequences[i] = batch[j].sequence;
+            }
+            count += got;
+        }
+
+        // Lines on separate descriptors were read one after the other, put their edges back in order.
+        if (fdCount > 1)
+            std::stable_sort(batch, batch + count, [](const GPIOBackend::CounterEdge & a, const GPIOBackend::CounterEdge & b)
+        {
+            return a.timestamp < b.timestamp;
+        });
+
+        for (int i = 0; i < count; i++)
+            decode(batch[i]);
+        edges.fetch_add(count, std::memory_order_relaxed);
+    }
+}
+
+void EncoderCounter::decode(const GPIOBackend::CounterEdge &edge)
+{
+    if (edge.input < 0 || edge.input >= GPIOBackend::MAX_PINS || pinChannels[edge.input] < 0)
+        return;
+
+    int channel = pinChannels[edge.input] / 2;
+    bool lineB  = pinChannels[edge.input] % 2;
+    int state   = states[channel];
+    int next    = lineB ? (state & 2) | edge.level : (edge.level << 1) | (state & 1);
+
+    // Same level twice on a line: the edge in between was lost.
+    if (next == state)
+    {
+        errors[channel].fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    states[channel] = next;
+
+    int step;
+    if (channels[channel].inputB < 0)
+        step = edge.level ? directions[channel].load(std::memory_order_relaxed) : 0;
+    else
+        step = QUADRATURE_STEPS[state << 2 | next];
+    if (step == 0)
+        return;
+
+    // Single writer, readers only need an untorn value.
+    int64_t count = counts[channel].load(std::memory_order_relaxed) + step;
+    counts[channel].store(count, std::memory_order_relaxed);
+
+    int direction = stopDirections[channel].load(std::memory_order_acquire);
+    if (direction == 0 || step != direction)
+        return;
+
+    int64_t target = stopCounts[channel].load(std::memory_order_relaxed);
+    if ((direction > 0 && count < target) || (direction < 0 && count > target))
+        return;
+
+    if (stopDirections[channel].compare_exchange_strong(direction, 0, std::memory_order_acq_rel) == false)
+        return;
+
+    // Stop the motor before anything else, the INDI thread only hears about it afterwards.
+    EmergencyStop *stop = stopTargets[channel].load(std::memory_order_relaxed);
+    if (stop)
+        stop->trigger(edge.timestamp);
+
+    Reached hit;
+    hit.channel   = channel;
+    hit.count     = count;
+    hit.timestamp = edge.timestamp;
+    reached.push(hit);
+
+    if (write(eventPipe[1], "r", 1) < 0) { /* INDI thread already has a wakeup pending */ }
+}
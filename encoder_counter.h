@@ -0,0 +1,148 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Shaft encoder counter. A quadrature (A/B) or single channel step encoder on
+ the roof drive gives the roof position in counts between the limit switches.
+ The pins are claimed as counter pins, whose edges the backend queues in order
+ with kernel timestamps, and a dedicated thread decodes them in batches. At
+ thousands of pulses per second polling levels would miss pulses, and every
+ edge passing through the INDI event loop would starve it.
+
+ Each channel's count has a single writer, the counter thread, and is read by
+ anyone without locking. Lost edges are accounted for rather than hidden: the
+ backend sequence numbers reveal edges the kernel dropped, and a quadrature
+ edge that does not move the A/B state by one step reveals an edge missed in
+ between.
+
+ Like the limit switch sampler, a target count can be armed to trigger the
+ emergency stop from the counter thread itself, and the INDI thread is told
+ afterwards through an SPSC ring and a notification pipe.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef ENCODERCOUNTER_H
+#define ENCODERCOUNTER_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <thread>
+
+#include "emergency_stop.h"
+#include "gpio_backend.h"
+#include "spsc_ring.h"
+
+class EncoderCounter
+{
+    public:
+
+        static const int MAX_CHANNELS = GPIOBackend::MAX_PINS / 2;
+
+        struct Channel
+        {
+            // Backend counter pin indices. inputA < 0 leaves the channel unused, inputB < 0
+            // makes it a step encoder counting rising edges on A in the set direction.
+            int inputA;
+            int inputB;
+        };
+
+        // An armed target was reached
+        struct Reached
+        {
+            int channel;
+            // Count when the stop was triggered
+            int64_t count;
+            // Monotonic ns of the edge that reached the target
+            uint64_t timestamp;
+        };
+
+        EncoderCounter();
+        ~EncoderCounter();
+
+        /**
+         * @brief start Start counting from zero.
+         * @param gpio backend with the counter pins already set up. The counter thread owns
+         * counter edge reads while running.
+         */
+        bool start(GPIOBackend *gpio, const Channel *channels, int count);
+        void stop();
+        bool isRunning() const { return running; }
+
+        int64_t getCount(int channel) const { return counts[channel].load(std::memory_order_relaxed); }
+
+        /**
+         * @brief setDirection Sign of the edges to come on a step encoder, +1 or -1.
+         * Quadrature channels ignore it.
+         */
+        void setDirection(int channel, int direction);
+
+        /**
+         * @brief armStop Trigger an emergency stop from the counter thread once the count
+         * reaches target while moving in direction (+1 up, -1 down). Fires once, then
+         * disarms itself, and is reported through popReached() even without a stop.
+         */
+        void armStop(int channel, EmergencyStop *stop, int64_t target, int direction);
+        void disarmStop(int channel) { stopDirections[channel].store(0, std::memory_order_release); }
+
+        // Readable when reached targets are waiting. Register with IEAddCallback.
+        int getEventFD() const { return eventPipe[0]; }
+
+        /**
+         * @brief popReached Consumer side, INDI thread only. Also drains the notification pipe.
+         */
+        bool popReached(Reached &reached);
+
+        // Quadrature steps skipped on the channel, each one an edge that was missed
+        uint64_t getErrors(int channel) const { return errors[channel].load(std::memory_order_relaxed); }
+        // Edges the backend dropped before they were read
+        uint64_t getDropped() const { return dropped.load(std::memory_order_relaxed); }
+        uint64_t getEdges() const { return edges.load(std::memory_order_relaxed); }
+
+    private:
+
+        void counterLoop();
+        void decode(const GPIOBackend::CounterEdge &edge);
+
+        GPIOBackend *gpio;
+        Channel channels[MAX_CHANNELS];
+        int channelCount;
+
+        std::thread counter;
+        std::atomic<bool> running;
+
+        std::atomic<int64_t> counts[MAX_CHANNELS];
+        std::atomic<int> directions[MAX_CHANNELS];
+        std::atomic<uint64_t> errors[MAX_CHANNELS];
+        std::atomic<uint64_t> dropped;
+        std::atomic<uint64_t> edges;
+
+        // Counter thread only: last A/B levels per channel as A << 1 | B, and per pin the
+        // channel it feeds times two, plus one for B. -1 for unused pins.
+        int states[MAX_CHANNELS];
+        int pinChannels[GPIOBackend::MAX_PINS];
+
+        std::atomic<EmergencyStop *> stopTargets[MAX_CHANNELS];
+        std::atomic<int64_t> stopCounts[MAX_CHANNELS];
+        // 0 when disarmed. Published last by armStop() and cleared by whoever fires.
+        std::atomic<int> stopDirections[MAX_CHANNELS];
+
+        SPSCRing<Reached, 16> reached;
+        int eventPipe[2];
+};
+
+#endif
@@ -0,0 +1,90 @@
+/*
+ INDI Ikarus Roof driver.
+
+ GPIO backend factory.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "gpio_backend.h"
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+GPIOBackend *GPIOBackend::create(Type type)
+{
+    switch (type)
+    {
+#ifdef HAVE_GPIOD
+        case BACKEND_GPIOD:
+            return new GPIODBackend();
+#endif
+        case BACKEND_SYSFS:
+            return new SysfsBackend();
+#ifdef HAVE_WIRINGPI
+        case BACKEND_WIRINGPI:
+            return new WiringPiBackend();
+#endif
+        case BACKEND_SIMULATOR:
+            return new SimulatorBackend();
+        default:
+            return nullptr;
+    }
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+const char *GPIOBackend::getTypeName(Type type)
+{
+    switch (type)
+    {
+        case BACKEND_GPIOD:
+            return "gpiod";
+        case BACKEND_SYSFS:
+            return "sysfs";
+        case BACKEND_WIRINGPI:
+            return "wiringPi";
+        case BACKEND_SIMULATOR:
+            return "Simulator";
+        default:
+            return "Unknown";
+    }
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+bool GPIOBackend::isAvailable(Type type)
+{
+    switch (type)
+    {
+#ifdef HAVE_GPIOD
+        case BACKEND_GPIOD:
+            return true;
+#endif
+#ifdef HAVE_WIRINGPI
+        case BACKEND_WIRINGPI:
+            return true;
+#endif
+        case BACKEND_SYSFS:
+        case BACKEND_SIMULATOR:
+            return true;
+        default:
+            return false;
+    }
+}
@@ -0,0 +1,294 @@
+/*
+ INDI Ikarus Roof driver.
+
+ GPIO backends. The driver talks to the limit switch and AC pins only through
+ GPIOBackend, which is picked at runtime:
+
+ + GPIOD: Linux GPIO character device through libgpiod (v1 or v2 API). Supports
+   edge events, and with v2 all inputs are read with a single ioctl.
+ + SYSFS: legacy /sys/class/gpio interface. Polling only.
+ + WIRINGPI: wiringPi in BCM numbering. Polling only.
+ + SIMULATOR: in-memory pins, for simulation and development without hardware.
+
+ Inputs are always read as one snapshot through readInputs() so the driver never
+ sees the two limit switches at different instants from separate calls.
+
+ Counter pins carry encoder pulses. They are claimed apart from the limit switch
+ inputs and every edge on them is queued with its level and kernel timestamp, so
+ pulses can be decoded in order even when they come faster than they are read.
+ Only GPIOD and SIMULATOR support them.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef GPIOBACKEND_H
+#define GPIOBACKEND_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+
+#include "config.h"
+#include "spsc_ring.h"
+
+class GPIOBackend
+{
+    public:
+
+        enum Type
+        {
+            BACKEND_GPIOD,
+            BACKEND_SYSFS,
+            BACKEND_WIRINGPI,
+            BACKEND_SIMULATOR,
+            BACKEND_COUNT
+        };
+
+        static const int MAX_PINS = 16;
+
+        /**
+         * @brief create Instantiate a backend.
+         * @return nullptr if the backend was not compiled in.
+         */
+        static GPIOBackend *create(Type type);
+        static const char *getTypeName(Type type);
+        static bool isAvailable(Type type);
+
+        virtual ~GPIOBackend() {}
+
+        /**
+         * @brief open Open the GPIO controller.
+         * @param chip chip name (e.g. gpiochip0). Ignored by backends that do not use chips.
+         */
+        virtual bool open(const char *chip) = 0;
+        virtual void close() = 0;
+
+        /**
+         * @brief setupInputs Claim input pins, in the order readInputs() reports them.
+         * @param edges request edge events on these pins if the backend supports them.
+         */
+        virtual bool setupInputs(const int *pins, int count, bool edges) = 0;
+        virtual bool setupOutputs(const int *pins, int count) = 0;
+
+        /**
+         * @brief readInputs Read all input pins as one snapshot.
+         * @param values receives one level (0 or 1) per input pin, in setup order.
+         */
+        virtual bool readInputs(int *values) = 0;
+
+        virtual bool writeOutput(int index, int value) = 0;
+        virtual bool readOutput(int index, int *value) = 0;
+
+        /**
+         * @brief getEventFDs Descriptors that become readable on input edges.
+         * @return number of descriptors, 0 if edges are unsupported or were not requested.
+         */
+        virtual int getEventFDs(int *fds, int max) { (void)fds; (void)max; return 0; }
+
+        /**
+         * @brief readEvents Consume all pending edge events on fd.
+         * @return number of edges read.
+         */
+        virtual int readEvents(int fd) { (void)fd; return 0; }
+
+        // Monotonic timestamp of the most recent edge in nanoseconds
+        uint64_t getLastEventTime() const { return lastEventTime; }
+
+        // One edge on a counter pin
+        struct CounterEdge
+        {
+            // Index of the pin in setupCounters() order
+            int input;
+            // Level after the edge
+            int level;
+            // Monotonic nanoseconds
+            uint64_t timestamp;
+            // Consecutive per descriptor, a gap means edges were dropped. 0 if the backend has none.
+            uint64_t sequence;
+        };
+
+        /**
+         * @brief setupCounters Claim pins for pulse counting, with edge events on both edges.
+         * @return false if the backend cannot queue counter edges.
+         */
+        virtual bool setupCounters(const int *pins, int count) { (void)pins; (void)count; return false; }
+
+        // Current level of each counter pin, in setup order
+        virtual bool readCounterLevels(int *values) { (void)values; return false; }
+
+        // Descriptors that become readable on counter edges
+        virtual int getCounterFDs(int *fds, int max) { (void)fds; (void)max; return 0; }
+
+        /**
+         * @brief readCounterEdges Read queued counter edges on fd, oldest first, without blocking.
+         * @return number of edges stored, at most max.
+         */
+        virtual int readCounterEdges(int fd, CounterEdge *edges, int max) { (void)fd; (void)edges; (void)max; return 0; }
+
+    protected:
+
+        GPIOBackend() : inputCount(0), outputCount(0), counterCount(0), lastEventTime(0) {}
+
+        int inputPins[MAX_PINS];
+        int inputCount;
+        int outputPins[MAX_PINS];
+        int outputCount;
+        int counterPins[MAX_PINS];
+        int counterCount;
+        uint64_t lastEventTime;
+};
+
+#ifdef HAVE_GPIOD
+
+#ifdef HAVE_GPIOD_V2
+struct gpiod_chip;
+struct gpiod_line_request;
+struct gpiod_edge_event_buffer;
+#else
+struct gpiod_chip;
+struct gpiod_line;
+#endif
+
+class GPIODBackend : public GPIOBackend
+{
+    public:
+        GPIODBackend();
+        ~GPIODBackend();
+
+        bool open(const char *chip) override;
+        void close() override;
+        bool setupInputs(const int *pins, int count, bool edges) override;
+        bool setupOutputs(const int *pins, int count) override;
+        bool readInputs(int *values) override;
+        bool writeOutput(int index, int value) override;
+        bool readOutput(int index, int *value) override;
+        int getEventFDs(int *fds, int max) override;
+        int readEvents(int fd) override;
+        bool setupCounters(const int *pins, int count) override;
+        bool readCounterLevels(int *values) override;
+        int getCounterFDs(int *fds, int max) override;
+        int readCounterEdges(int fd, CounterEdge *edges, int max) override;
+
+    private:
+        struct gpiod_chip *chip;
+#ifdef HAVE_GPIOD_V2
+        // One request holds all inputs, so values come from one ioctl and edges from one fd.
+        struct gpiod_line_request *inputRequest;
+        struct gpiod_line_request *outputRequest;
+        struct gpiod_edge_event_buffer *eventBuffer;
+        // Counter pins share one request too, so their edges come in kernel order.
+        struct gpiod_line_request *counterRequest;
+        struct gpiod_edge_event_buffer *counterBuffer;
+#else
+        // v1 event requests are per line, each with its own fd.
+        struct gpiod_line *inputLines[MAX_PINS];
+        struct gpiod_line *outputLines[MAX_PINS];
+        struct gpiod_line *counterLines[MAX_PINS];
+        bool edgesRequested;
+#endif
+};
+
+#endif
+
+class SysfsBackend : public GPIOBackend
+{
+    public:
+        SysfsBackend();
+        ~SysfsBackend();
+
+        bool open(const char *chip) override;
+        void close() override;
+        bool setupInputs(const int *pins, int count, bool edges) override;
+        bool setupOutputs(const int *pins, int count) override;
+        bool readInputs(int *values) override;
+        bool writeOutput(int index, int value) override;
+        bool readOutput(int index, int *value) override;
+
+    private:
+        int exportPin(int pin, const char *direction);
+        void unexportPin(int pin);
+
+        // Kernel GPIO number of line 0 of the chip
+        int base;
+        int inputFDs[MAX_PINS];
+        int outputFDs[MAX_PINS];
+};
+
+#ifdef HAVE_WIRINGPI
+class WiringPiBackend : public GPIOBackend
+{
+    public:
+        bool open(const char *chip) override;
+        void close() override;
+        bool setupInputs(const int *pins, int count, bool edges) override;
+        bool setupOutputs(const int *pins, int count) override;
+        bool readInputs(int *values) override;
+        bool writeOutput(int index, int value) override;
+        bool readOutput(int index, int *value) override;
+};
+#endif
+
+class SimulatorBackend : public GPIOBackend
+{
+    public:
+        SimulatorBackend();
+        ~SimulatorBackend();
+
+        bool open(const char *chip) override;
+        void close() override;
+        bool setupInputs(const int *pins, int count, bool edges) override;
+        bool setupOutputs(const int *pins, int count) override;
+        bool readInputs(int *values) override;
+        bool writeOutput(int index, int value) override;
+        bool readOutput(int index, int *value) override;
+        int getEventFDs(int *fds, int max) override;
+        int readEvents(int fd) override;
+        bool setupCounters(const int *pins, int count) override;
+        bool readCounterLevels(int *values) override;
+        int getCounterFDs(int *fds, int max) override;
+        int readCounterEdges(int fd, CounterEdge *edges, int max) override;
+
+        /**
+         * @brief setLevel Drive a simulated pin. Safe to call from any thread.
+         * An edge event is raised if the level changed on an input with edges enabled,
+         * and queued if the pin is a counter pin.
+         */
+        void setLevel(int pin, int value);
+        int getLevel(int pin) const;
+
+        // Counter edges lost because the queue was full
+        uint64_t getCounterOverruns() const { return counterOverruns.load(std::memory_order_relaxed); }
+
+    private:
+        void setCounterLevel(int index, int value);
+
+        // One bit per BCM pin so readInputs() is a single atomic load
+        std::atomic<uint64_t> levels;
+        bool edgesEnabled;
+        int eventPipe[2];
+
+        // Stands in for the kernel's edge event FIFO of a counter request
+        SPSCRing<CounterEdge, 4096> counterEdges;
+        // setLevel() may be called from several threads, the ring takes one producer
+        std::mutex counterLock;
+        uint64_t counterSequence;
+        std::atomic<uint64_t> counterOverruns;
+        int counterPipe[2];
+};
+
+#endif
@@ -0,0 +1,511 @@
+/*
+ INDI Ikarus Roof driver.
+
+ libgpiod GPIO backend, for both the v1 and v2 library API.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "gpio_backend.h"
+
+#ifdef HAVE_GPIOD
+
+#include <poll.h>
+#include <string.h>
+
+#include <string>
+
+#include <gpiod.h>
+
+#define CONSUMER "indi_ikarusroof"
+
+// Counter edges held by the kernel between reads. The uAPI caps a request at 16 per line.
+#define COUNTER_KERNEL_EDGES 1024
+#define COUNTER_READ_EDGES   64
+
+#ifdef HAVE_GPIOD_V2
+
+/************************************************************************************
+ * libgpiod v2
+* ***********************************************************************************/
+GPIODBackend::GPIODBackend() : chip(nullptr), inputRequest(nullptr), outputRequest(nullptr), eventBuffer(nullptr),
+    counterRequest(nullptr), counterBuffer(nullptr)
+{
+}
+
+GPIODBackend::~GPIODBackend()
+{
+    close();
+}
+
+bool GPIODBackend::open(const char *chipName)
+{
+    std::string path = chipName;
+    if (path.find('/') == std::string::npos)
+        path = "/dev/" + path;
+
+    chip = gpiod_chip_open(path.c_str());
+    return chip != nullptr;
+}
+
+void GPIODBackend::close()
+{
+    if (inputRequest)
+        gpiod_line_request_release(inputRequest);
+    if (outputRequest)
+        gpiod_line_request_release(outputRequest);
+    if (eventBuffer)
+        gpiod_edge_event_buffer_free(eventBuffer);
+    if (counterRequest)
+        gpiod_line_request_release(counterRequest);
+    if (counterBuffer)
+        gpiod_edge_event_buffer_free(counterBuffer);
+    if (chip)
+        gpiod_chip_close(chip);
+
+    inputRequest   = nullptr;
+    outputRequest  = nullptr;
+    eventBuffer    = nullptr;
+    counterRequest = nullptr;
+    counterBuffer  = nullptr;
+    chip           = nullptr;
+    inputCount = outputCount = counterCount = 0;
+}
+
+static struct gpiod_line_request *requestLines(struct gpiod_chip *chip, const int *pins, int count,
+        enum gpiod_line_direction direction, bool edges, size_t eventBufferSize = 0)
+{
+    unsigned int offsets[GPIOBackend::MAX_PINS];
+    for (int i = 0; i < count; i++)
+        offsets[i] = pins[i];
+
+    struct gpiod_line_settings *settings = gpiod_line_settings_new();
+    struct gpiod_line_config *lineConfig = gpiod_line_config_new();
+    struct gpiod_request_config *requestConfig = gpiod_request_config_new();
+    struct gpiod_line_request *request = nullptr;
+
+    if (settings && lineConfig && requestConfig)
+    {
+        gpiod_line_settings_set_direction(settings, direction);
+        if (edges)
+            gpiod_line_settings_set_edge_detection(settings, GPIOD_LINE_EDGE_BOTH);
+        gpiod_request_config_set_consumer(requestConfig, CONSUMER);
+        if (eventBufferSize > 0)
+            gpiod_request_config_set_event_buffer_size(requestConfig, eventBufferSize);
+
+        if (gpiod_line_config_add_line_settings(lineConfig, offsets, count, settings) == 0)
+            request = gpiod_chip_request_lines(chip, requestConfig, lineConfig);
+    }
+
+    gpiod_request_config_free(requestConfig);
+    gpiod_line_config_free(lineConfig);
+    gpiod_line_settings_free(settings);
+
+    return request;
+}
+
+bool GPIODBackend::setupInputs(const int *pins, int count, bool edges)
+{
+    if (chip == nullptr || count > MAX_PINS)
+        return false;
+
+    inputRequest = requestLines(chip, pins, count, GPIOD_LINE_DIRECTION_INPUT, edges);
+    if (inputRequest == nullptr)
+        return false;
+
+    if (edges)
+        eventBuffer = gpiod_edge_event_buffer_new(16);
+
+    memcpy(inputPins, pins, count * sizeof(int));
+    inputCount = count;
+    return true;
+}
+
+bool GPIODBackend::setupOutputs(const int *pins, int count)
+{
+    if (chip == nullptr || count > MAX_PINS)
+        return false;
+
+    outputRequest = requestLines(chip, pins, count, GPIOD_LINE_DIRECTION_OUTPUT, false);
+    if (outputRequest == nullptr)
+        return false;
+
+    memcpy(outputPins, pins, count * sizeof(int));
+    outputCount = count;
+    return true;
+}
+
+bool GPIODBackend::readInputs(int *values)
+{
+    enum gpiod_line_value levels[MAX_PINS];
+
+    // Single GPIO_V2_LINE_GET_VALUES_IOCTL for all requested lines
+    if (inputRequest == nullptr || gpiod_line_request_get_values(inputRequest, levels) < 0)
+        return false;
+
+    for (int i = 0; i < inputCount; i++)
+        values[i] = (levels[i] == GPIOD_LINE_VALUE_ACTIVE) ? 1 : 0;
+    return true;
+}
+
+bool GPIODBackend::writeOutput(int index, int value)
+{
+    if (outputRequest == nullptr || index >= outputCount)
+        return false;
+    return gpiod_line_request_set_value(outputRequest, outputPins[index],
+                                        value ? GPIOD_LINE_VALUE_ACTIVE : GPIOD_LINE_VALUE_INACTIVE) == 0;
+}
+
+bool GPIODBackend::readOutput(int index, int *value)
+{
+    if (outputRequest == nullptr || index >= outputCount)
+        return false;
+
+    enum gpiod_line_value level = gpiod_line_request_get_value(outputRequest, outputPins[index]);
+    if (level == GPIOD_LINE_VALUE_ERROR)
+        return false;
+    *value = (level == GPIOD_LINE_VALUE_ACTIVE) ? 1 : 0;
+    return true;
+}
+
+int GPIODBackend::getEventFDs(int *fds, int max)
+{
+    if (eventBuffer == nullptr || max < 1)
+        return 0;
+    fds[0] = gpiod_line_request_get_fd(inputRequest);
+    return 1;
+}
+
+int GPIODBackend::readEvents(int fd)
+{
+    int edges = 0;
+    struct pollfd pfd = { fd, POLLIN, 0 };
+
+    // Contact bounce can queue several edges; consume them all in one go.
+    while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN))
+    {
+        int count = gpiod_line_request_read_edge_events(inputRequest, eventBuffer, 16);
+        if (count <= 0)
+            break;
+
+        struct gpiod_edge_event *event = gpiod_edge_event_buffer_get_event(eventBuffer, count - 1);
+        // Kernel timestamps edge events with CLOCK_MONOTONIC by default
+        lastEventTime = gpiod_edge_event_get_timestamp_ns(event);
+        edges += count;
+    }
+
+    return edges;
+}
+
+bool GPIODBackend::setupCounters(const int *pins, int count)
+{
+    if (chip == nullptr || count > MAX_PINS)
+        return false;
+
+    counterRequest = requestLines(chip, pins, count, GPIOD_LINE_DIRECTION_INPUT, true, COUNTER_KERNEL_EDGES);
+    if (counterRequest == nullptr)
+        return false;
+
+    counterBuffer = gpiod_edge_event_buffer_new(COUNTER_READ_EDGES);
+    if (counterBuffer == nullptr)
+        return false;
+
+    memcpy(counterPins, pins, count * sizeof(int));
+    counterCount = count;
+    return true;
+}
+
+bool GPIODBackend::readCounterLevels(int *values)
+{
+    enum gpiod_line_value levels[MAX_PINS];
+
+    if (counterRequest == nullptr || gpiod_line_request_get_values(counterRequest, levels) < 0)
+        return false;
+
+    for (int i = 0; i < counterCount; i++)
+        values[i] = (levels[i] == GPIOD_LINE_VALUE_ACTIVE) ? 1 : 0;
+    return true;
+}
+
+int GPIODBackend::getCounterFDs(int *fds, int max)
+{
+    if (counterRequest == nullptr || max < 1)
+        return 0;
+    fds[0] = gpiod_line_request_get_fd(counterRequest);
+    return 1;
+}
+
+int GPIODBackend::readCounterEdges(int fd, CounterEdge *edges, int max)
+{
+    struct pollfd pfd = { fd, POLLIN, 0 };
+
+    // read_edge_events() blocks on an empty queue
+    if (poll(&pfd, 1, 0) <= 0 || (pfd.revents & POLLIN) == 0)
+        return 0;
+
+    int count = gpiod_line_request_read_edge_events(counterRequest, counterBuffer,
+                max < COUNTER_READ_EDGES ? max : COUNTER_READ_EDGES);
+    if (count <= 0)
+        return 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        struct gpiod_edge_event *event = gpiod_edge_event_buffer_get_event(counterBuffer, i);
+        unsigned int offset = gpiod_edge_event_get_line_offset(event);
+
+        edges[i].input = 0;
+        for (int j = 0; j < counterCount; j++)
+        {
+            if (counterPins[j] == static_cast<int>(offset))
+                edges[i].input = j;
+        }
+        edges[i].level     = gpiod_edge_event_get_event_type(event) == GPIOD_EDGE_EVENT_RISING_EDGE ? 1 : 0;
+        edges[i].timestamp = gpiod_edge_event_get_timestamp_ns(event);
+        // Numbered across all lines of the request, the kernel skips numbers it had to drop
+        edges[i].sequence  = gpiod_edge_event_get_global_seqno(event);
+    }
+
+    return count;
+}
+
+#else
+
+/************************************************************************************
+ * libgpiod v1
+* ***********************************************************************************/
+static uint64_t timespecToNs(const struct timespec &ts)
+{
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+GPIODBackend::GPIODBackend() : chip(nullptr), edgesRequested(false)
+{
+    for (int i = 0; i < MAX_PINS; i++)
+        inputLines[i] = outputLines[i] = counterLines[i] = nullptr;
+}
+
+GPIODBackend::~GPIODBackend()
+{
+    close();
+}
+
+bool GPIODBackend::open(const char *chipName)
+{
+    chip = gpiod_chip_open_lookup(chipName);
+    return chip != nullptr;
+}
+
+void GPIODBackend::close()
+{
+    for (int i = 0; i < MAX_PINS; i++)
+    {
+        if (inputLines[i])
+            gpiod_line_release(inputLines[i]);
+        if (outputLines[i])
+            gpiod_line_release(outputLines[i]);
+        if (counterLines[i])
+            gpiod_line_release(counterLines[i]);
+        inputLines[i] = outputLines[i] = counterLines[i] = nullptr;
+    }
+
+    if (chip)
+        gpiod_chip_close(chip);
+    chip = nullptr;
+    edgesRequested = false;
+    inputCount = outputCount = counterCount = 0;
+}
+
+bool GPIODBackend::setupInputs(const int *pins, int count, bool edges)
+{
+    if (chip == nullptr || count > MAX_PINS)
+        return false;
+
+    for (int i = 0; i < count; i++)
+    {
+        struct gpiod_line *line = gpiod_chip_get_line(chip, pins[i]);
+        int rc = -1;
+        if (line)
+            rc = edges ? gpiod_line_request_both_edges_events(line, CONSUMER) : gpiod_line_request_input(line, CONSUMER);
+        if (rc < 0)
+            return false;
+
+        inputLines[i] = line;
+        inputPins[i]  = pins[i];
+        inputCount    = i + 1;
+    }
+
+    edgesRequested = edges;
+    return true;
+}
+
+bool GPIODBackend::setupOutputs(const int *pins, int count)
+{
+    if (chip == nullptr || count > MAX_PINS)
+        return false;
+
+    for (int i = 0; i < count; i++)
+    {
+        struct gpiod_line *line = gpiod_chip_get_line(chip, pins[i]);
+        if (line == nullptr || gpiod_line_request_output(line, CONSUMER, 0) < 0)
+            return false;
+
+        outputLines[i] = line;
+        outputPins[i]  = pins[i];
+        outputCount    = i + 1;
+    }
+
+    return true;
+}
+
+bool GPIODBackend::readInputs(int *values)
+{
+    // The v1 uAPI hands out one descriptor per event line, so lines are read back to
+    // back. The gap is a few microseconds, far below the sensor response time.
+    for (int i = 0; i < inputCount; i++)
+    {
+        int level = gpiod_line_get_value(inputLines[i]);
+        if (level < 0)
+            return false;
+        values[i] = level;
+    }
+    return true;
+}
+
+bool GPIODBackend::writeOutput(int index, int value)
+{
+    if (index >= outputCount)
+        return false;
+    return gpiod_line_set_value(outputLines[index], value ? 1 : 0) == 0;
+}
+
+bool GPIODBackend::readOutput(int index, int *value)
+{
+    if (index >= outputCount)
+        return false;
+    int level = gpiod_line_get_value(outputLines[index]);
+    if (level < 0)
+        return false;
+    *value = level;
+    return true;
+}
+
+int GPIODBackend::getEventFDs(int *fds, int max)
+{
+    if (edgesRequested == false)
+        return 0;
+
+    int count = 0;
+    for (int i = 0; i < inputCount && count < max; i++)
+        fds[count++] = gpiod_line_event_get_fd(inputLines[i]);
+    return count;
+}
+
+int GPIODBackend::readEvents(int fd)
+{
+    int edges = 0;
+    struct pollfd pfd = { fd, POLLIN, 0 };
+
+    // Contact bounce can queue several edges; consume them all in one go.
+    while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN))
+    {
+        struct gpiod_line_event event;
+        if (gpiod_line_event_read_fd(fd, &event) < 0)
+            break;
+
+        // Kernel timestamps edge events with CLOCK_MONOTONIC
+        lastEventTime = timespecToNs(event.ts);
+        edges++;
+    }
+
+    return edges;
+}
+
+bool GPIODBackend::setupCounters(const int *pins, int count)
+{
+    if (chip == nullptr || count > MAX_PINS)
+        return false;
+
+    for (int i = 0; i < count; i++)
+    {
+        struct gpiod_line *line = gpiod_chip_get_line(chip, pins[i]);
+        if (line == nullptr || gpiod_line_request_both_edges_events(line, CONSUMER) < 0)
+            return false;
+
+        counterLines[i] = line;
+        counterPins[i]  = pins[i];
+        counterCount    = i + 1;
+    }
+
+    return true;
+}
+
+bool GPIODBackend::readCounterLevels(int *values)
+{
+    for (int i = 0; i < counterCount; i++)
+    {
+        int level = gpiod_line_get_value(counterLines[i]);
+        if (level < 0)
+            return false;
+        values[i] = level;
+    }
+    return true;
+}
+
+int GPIODBackend::getCounterFDs(int *fds, int max)
+{
+    int count = 0;
+    for (int i = 0; i < counterCount && count < max; i++)
+        fds[count++] = gpiod_line_event_get_fd(counterLines[i]);
+    return count;
+}
+
+/************************************************************************************
+ * v1 events carry no sequence number, and edges of different lines arrive on
+ * different descriptors. The reader restores their order from the timestamps.
+* ***********************************************************************************/
+int GPIODBackend::readCounterEdges(int fd, CounterEdge *edges, int max)
+{
+    int input = -1;
+    for (int i = 0; i < counterCount; i++)
+    {
+        if (gpiod_line_event_get_fd(counterLines[i]) == fd)
+            input = i;
+    }
+    if (input < 0)
+        return 0;
+
+    int count = 0;
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    while (count < max && poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN))
+    {
+        struct gpiod_line_event event;
+        if (gpiod_line_event_read_fd(fd, &event) < 0)
+            break;
+
+        edges[count].input     = input;
+        edges[count].level     = event.event_type == GPIOD_LINE_EVENT_RISING_EDGE ? 1 : 0;
+        edges[count].timestamp = timespecToNs(event.ts);
+        edges[count].sequence  = 0;
+        count++;
+    }
+
+    return count;
+}
+
+#endif
+
+#endif
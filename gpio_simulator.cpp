@@ -0,0 +1,257 @@
+/*
+ INDI Ikarus Roof driver.
+
+ In-memory simulated GPIO backend.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "gpio_backend.h"
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+SimulatorBackend::SimulatorBackend() : levels(0), edgesEnabled(false), counterSequence(0), counterOverruns(0)
+{
+    eventPipe[0] = eventPipe[1] = -1;
+    counterPipe[0] = counterPipe[1] = -1;
+}
+
+SimulatorBackend::~SimulatorBackend()
+{
+    close();
+}
+
+bool SimulatorBackend::open(const char *chip)
+{
+    (void)chip;
+    return pipe2(eventPipe, O_NONBLOCK | O_CLOEXEC) == 0 && pipe2(counterPipe, O_NONBLOCK | O_CLOEXEC) == 0;
+}
+
+void SimulatorBackend::close()
+{
+    if (eventPipe[0] >= 0)
+    {
+        ::close(eventPipe[0]);
+        ::close(eventPipe[1]);
+    }
+    if (counterPipe[0] >= 0)
+    {
+        ::close(counterPipe[0]);
+        ::close(counterPipe[1]);
+    }
+    eventPipe[0] = eventPipe[1] = -1;
+    counterPipe[0] = counterPipe[1] = -1;
+    inputCount = outputCount = counterCount = 0;
+    edgesEnabled = false;
+
+    CounterEdge edge;
+    while (counterEdges.pop(edge))
+        ;
+}
+
+bool SimulatorBackend::setupInputs(const int *pins, int count, bool edges)
+{
+    if (count > MAX_PINS)
+        return false;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (pins[i] < 0 || pins[i] >= 64)
+            return false;
+        inputPins[i] = pins[i];
+    }
+    inputCount   = count;
+    edgesEnabled = edges;
+    return true;
+}
+
+bool SimulatorBackend::setupOutputs(const int *pins, int count)
+{
+    if (count > MAX_PINS)
+        return false;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (pins[i] < 0 || pins[i] >= 64)
+            return false;
+        outputPins[i] = pins[i];
+    }
+    outputCount = count;
+    return true;
+}
+
+bool SimulatorBackend::readInputs(int *values)
+{
+    uint64_t snapshot = levels.load(std::memory_order_acquire);
+    for (int i = 0; i < inputCount; i++)
+        values[i] = (snapshot >> inputPins[i]) & 1;
+    return true;
+}
+
+bool SimulatorBackend::writeOutput(int index, int value)
+{
+    if (index >= outputCount)
+        return false;
+    setLevel(outputPins[index], value);
+    return true;
+}
+
+bool SimulatorBackend::readOutput(int index, int *value)
+{
+    if (index >= outputCount)
+        return false;
+    *value = getLevel(outputPins[index]);
+    return true;
+}
+
+int SimulatorBackend::getEventFDs(int *fds, int max)
+{
+    if (edgesEnabled == false || max < 1 || eventPipe[0] < 0)
+        return 0;
+    fds[0] = eventPipe[0];
+    return 1;
+}
+
+int SimulatorBackend::readEvents(int fd)
+{
+    char drain[64];
+    int edges = 0, n = 0;
+    while ((n = read(fd, drain, sizeof(drain))) > 0)
+        edges += n;
+    return edges;
+}
+
+bool SimulatorBackend::setupCounters(const int *pins, int count)
+{
+    if (count > MAX_PINS || counterPipe[0] < 0)
+        return false;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (pins[i] < 0 || pins[i] >= 64)
+            return false;
+        counterPins[i] = pins[i];
+    }
+    counterCount = count;
+    return true;
+}
+
+bool SimulatorBackend::readCounterLevels(int *values)
+{
+    uint64_t snapshot = levels.load(std::memory_order_acquire);
+    for (int i = 0; i < counterCount; i++)
+        values[i] = (snapshot >> counterPins[i]) & 1;
+    return true;
+}
+
+int SimulatorBackend::getCounterFDs(int *fds, int max)
+{
+    if (counterCount == 0 || max < 1 || counterPipe[0] < 0)
+        return 0;
+    fds[0] = counterPipe[0];
+    return 1;
+}
+
+/************************************************************************************
+ * The pipe is drained before the queue so an edge queued meanwhile leaves its byte
+ * behind. If max stops the read early the pipe is made readable again for the rest.
+* ***********************************************************************************/
+int SimulatorBackend::readCounterEdges(int fd, CounterEdge *edges, int max)
+{
+    char drain[256];
+    while (read(fd, drain, sizeof(drain)) > 0)
+        ;
+
+    int count = 0;
+    while (count < max && counterEdges.pop(edges[count]))
+        count++;
+
+    if (counterEdges.empty() == false && write(counterPipe[1], "c", 1) < 0) { /* already readable */ }
+    return count;
+}
+
+void SimulatorBackend::setLevel(int pin, int value)
+{
+    if (pin < 0 || pin >= 64)
+        return;
+
+    for (int i = 0; i < counterCount; i++)
+    {
+        if (counterPins[i] == pin)
+        {
+            setCounterLevel(i, value);
+            return;
+        }
+    }
+
+    uint64_t mask = 1ULL << pin;
+    uint64_t previous = value ? levels.fetch_or(mask, std::memory_order_acq_rel) :
+                        levels.fetch_and(~mask, std::memory_order_acq_rel);
+
+    if (edgesEnabled == false || ((previous & mask) != 0) == (value != 0))
+        return;
+
+    for (int i = 0; i < inputCount; i++)
+    {
+        if (inputPins[i] == pin)
+        {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            lastEventTime = now.tv_sec * 1000000000ULL + now.tv_nsec;
+            if (write(eventPipe[1], "e", 1) < 0) { /* reader already has pending events */ }
+            break;
+        }
+    }
+}
+
+/************************************************************************************
+ * Level and queue change under one lock so the queued edges follow the levels in
+ * order. Like the kernel FIFO the sequence still advances when the queue is full,
+ * which is how the reader learns of the loss.
+* ***********************************************************************************/
+void SimulatorBackend::setCounterLevel(int index, int value)
+{
+    uint64_t mask = 1ULL << counterPins[index];
+    std::lock_guard<std::mutex> guard(counterLock);
+
+    uint64_t previous = value ? levels.fetch_or(mask, std::memory_order_acq_rel) :
+                        levels.fetch_and(~mask, std::memory_order_acq_rel);
+    if (((previous & mask) != 0) == (value != 0))
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    CounterEdge edge;
+    edge.input     = index;
+    edge.level     = value ? 1 : 0;
+    edge.timestamp = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    edge.sequence  = ++counterSequence;
+
+    if (counterEdges.push(edge) == false)
+        counterOverruns.fetch_add(1, std::memory_order_relaxed);
+    else if (write(counterPipe[1], "c", 1) < 0) { /* reader already has pending edges */ }
+}
+
+int SimulatorBackend::getLevel(int pin) const
+{
+    if (pin < 0 || pin >= 64)
+        return 0;
+    return (levels.load(std::memory_order_acquire) >> pin) & 1;
+}
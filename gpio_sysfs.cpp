@@ -0,0 +1,209 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Legacy sysfs (/sys/class/gpio) GPIO backend.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "gpio_backend.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SYSFS_GPIO_DIR "/sys/class/gpio"
+
+static bool writeFile(const char *path, const char *value)
+{
+    int fd = ::open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    ssize_t len = strlen(value);
+    bool rc = (write(fd, value, len) == len);
+    ::close(fd);
+    return rc;
+}
+
+static int readLevel(int fd)
+{
+    char c;
+    if (pread(fd, &c, 1, 0) != 1)
+        return -1;
+    return (c == '1') ? 1 : 0;
+}
+
+SysfsBackend::SysfsBackend() : base(0)
+{
+    for (int i = 0; i < MAX_PINS; i++)
+        inputFDs[i] = outputFDs[i] = -1;
+}
+
+SysfsBackend::~SysfsBackend()
+{
+    close();
+}
+
+/************************************************************************************
+ * sysfs numbers GPIOs globally. Find the base of the requested chip by matching the
+ * device link of each /sys/class/gpio/gpiochipN entry, newer Raspberry PI kernels
+ * no longer start at 0.
+* ***********************************************************************************/
+bool SysfsBackend::open(const char *chip)
+{
+    base = 0;
+
+    DIR *dir = opendir(SYSFS_GPIO_DIR);
+    if (dir == nullptr)
+        return false;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != nullptr)
+    {
+        if (strncmp(entry->d_name, "gpiochip", 8))
+            continue;
+
+        char path[PATH_MAX], target[PATH_MAX];
+        snprintf(path, PATH_MAX, SYSFS_GPIO_DIR "/%s/device", entry->d_name);
+        ssize_t len = readlink(path, target, PATH_MAX - 1);
+        if (len <= 0)
+            continue;
+        target[len] = 0;
+
+        if (strcmp(basename(target), chip) == 0)
+        {
+            base = atoi(entry->d_name + 8);
+            break;
+        }
+    }
+
+    closedir(dir);
+    return true;
+}
+
+void SysfsBackend::close()
+{
+    for (int i = 0; i < inputCount; i++)
+    {
+        if (inputFDs[i] >= 0)
+            ::close(inputFDs[i]);
+        inputFDs[i] = -1;
+        unexportPin(inputPins[i]);
+    }
+    for (int i = 0; i < outputCount; i++)
+    {
+        if (outputFDs[i] >= 0)
+            ::close(outputFDs[i]);
+        outputFDs[i] = -1;
+        unexportPin(outputPins[i]);
+    }
+    inputCount = outputCount = 0;
+}
+
+int SysfsBackend::exportPin(int pin, const char *direction)
+{
+    char path[PATH_MAX], number[16];
+
+    snprintf(number, sizeof(number), "%d", base + pin);
+    snprintf(path, PATH_MAX, SYSFS_GPIO_DIR "/gpio%d/value", base + pin);
+
+    // Already exported pins make the export write fail, which is fine.
+    if (access(path, F_OK) != 0)
+        writeFile(SYSFS_GPIO_DIR "/export", number);
+
+    char directionPath[PATH_MAX];
+    snprintf(directionPath, PATH_MAX, SYSFS_GPIO_DIR "/gpio%d/direction", base + pin);
+    if (writeFile(directionPath, direction) == false)
+        return -1;
+
+    return ::open(path, (strcmp(direction, "in") ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+}
+
+void SysfsBackend::unexportPin(int pin)
+{
+    char number[16];
+    snprintf(number, sizeof(number), "%d", base + pin);
+    writeFile(SYSFS_GPIO_DIR "/unexport", number);
+}
+
+bool SysfsBackend::setupInputs(const int *pins, int count, bool edges)
+{
+    (void)edges;
+
+    if (count > MAX_PINS)
+        return false;
+
+    for (int i = 0; i < count; i++)
+    {
+        inputFDs[i] = exportPin(pins[i], "in");
+        if (inputFDs[i] < 0)
+            return false;
+        inputPins[i] = pins[i];
+        inputCount   = i + 1;
+    }
+    return true;
+}
+
+bool SysfsBackend::setupOutputs(const int *pins, int count)
+{
+    if (count > MAX_PINS)
+        return false;
+
+    for (int i = 0; i < count; i++)
+    {
+        // "low" sets the direction and drives the pin low in one step, without a glitch.
+        outputFDs[i] = exportPin(pins[i], "low");
+        if (outputFDs[i] < 0)
+            return false;
+        outputPins[i] = pins[i];
+        outputCount   = i + 1;
+    }
+    return true;
+}
+
+bool SysfsBackend::readInputs(int *values)
+{
+    // Each pin is its own file, so pins are read back to back with pread on
+    // descriptors that are kept open.
+    for (int i = 0; i < inputCount; i++)
+    {
+        values[i] = readLevel(inputFDs[i]);
+        if (values[i] < 0)
+            return false;
+    }
+    return true;
+}
+
+bool SysfsBackend::writeOutput(int index, int value)
+{
+    if (index >= outputCount)
+        return false;
+    return pwrite(outputFDs[index], value ? "1" : "0", 1, 0) == 1;
+}
+
+bool SysfsBackend::readOutput(int index, int *value)
+{
+    if (index >= outputCount)
+        return false;
+    *value = readLevel(outputFDs[index]);
+    return *value >= 0;
+}
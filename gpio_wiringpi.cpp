@@ -0,0 +1,95 @@
+/*
+ INDI Ikarus Roof driver.
+
+ wiringPi GPIO backend (BCM pin numbering).
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "gpio_backend.h"
+
+#ifdef HAVE_WIRINGPI
+
+#include <wiringPi.h>
+
+bool WiringPiBackend::open(const char *chip)
+{
+    (void)chip;
+    return wiringPiSetupGpio() == 0;
+}
+
+void WiringPiBackend::close()
+{
+    inputCount = outputCount = 0;
+}
+
+bool WiringPiBackend::setupInputs(const int *pins, int count, bool edges)
+{
+    (void)edges;
+
+    if (count > MAX_PINS)
+        return false;
+
+    for (int i = 0; i < count; i++)
+    {
+        pinMode(pins[i], INPUT);
+        inputPins[i] = pins[i];
+    }
+    inputCount = count;
+    return true;
+}
+
+bool WiringPiBackend::setupOutputs(const int *pins, int count)
+{
+    if (count > MAX_PINS)
+        return false;
+
+    for (int i = 0; i < count; i++)
+    {
+        pinMode(pins[i], OUTPUT);
+        outputPins[i] = pins[i];
+    }
+    outputCount = count;
+    return true;
+}
+
+bool WiringPiBackend::readInputs(int *values)
+{
+    // wiringPi has no bulk read in BCM numbering. Each digitalRead is a single
+    // memory-mapped register load, so the pins are sampled within nanoseconds.
+    for (int i = 0; i < inputCount; i++)
+        values[i] = digitalRead(inputPins[i]);
+    return true;
+}
+
+bool WiringPiBackend::writeOutput(int index, int value)
+{
+    if (index >= outputCount)
+        return false;
+    digitalWrite(outputPins[index], value ? HIGH : LOW);
+    return true;
+}
+
+bool WiringPiBackend::readOutput(int index, int *value)
+{
+    if (index >= outputCount)
+        return false;
+    *value = digitalRead(outputPins[index]);
+    return true;
+}
+
+#endif
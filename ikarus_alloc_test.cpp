@@ -0,0 +1,277 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Allocation test. Counts heap allocations made on the INDI side of the relay and
+ limit switch path in steady state: building the outlet query, submitting the
+ command, dispatching its completion through the observer and the callback, and
+ reading the debounced limit switch levels the way getLimitSwitchStatus() does.
+ Any allocation on that thread fails the test. Allocations of the relay
+ stand-in, libcurl and the other threads are reported but not checked.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <new>
+#include <string>
+
+#include "limit_switch_sampler.h"
+#include "relay_executor.h"
+#include "relay_outlets.h"
+#include "roof_simulator.h"
+#include "roof_state_machine.h"
+
+/************************************************************************************
+ * Counting allocators. malloc and friends forward to glibc, operator new goes
+ * straight to glibc as well so every allocation is counted once.
+* ***********************************************************************************/
+extern "C"
+{
+    void *__libc_malloc(size_t size);
+    void *__libc_calloc(size_t count, size_t size);
+    void *__libc_realloc(void *pointer, size_t size);
+    void __libc_free(void *pointer);
+}
+
+static std::atomic<uint64_t> processAllocations(0);
+// Only the thread running the measured section sets this
+static __thread bool counting = false;
+static __thread uint64_t threadAllocations = 0;
+
+static inline void countAllocation()
+{
+    processAllocations.fetch_add(1, std::memory_order_relaxed);
+    if (counting)
+        threadAllocations++;
+}
+
+extern "C" void *malloc(size_t size)
+{
+    countAllocation();
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size)
+{
+    countAllocation();
+    return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *pointer, size_t size)
+{
+    countAllocation();
+    return __libc_realloc(pointer, size);
+}
+
+extern "C" void free(void *pointer)
+{
+    __libc_free(pointer);
+}
+
+void *operator new(size_t size)
+{
+    countAllocation();
+    void *pointer = __libc_malloc(size ? size : 1);
+    if (pointer == nullptr)
+        throw std::bad_alloc();
+    return pointer;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *pointer) noexcept
+{
+    __libc_free(pointer);
+}
+
+void operator delete[](void *pointer) noexcept
+{
+    __libc_free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept
+{
+    __libc_free(pointer);
+}
+
+void operator delete[](void *pointer, size_t) noexcept
+{
+    __libc_free(pointer);
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [options]\n"
+            "  -n count      measured commands (default 500)\n"
+            "  -w count      warm-up commands before measuring (default 50)\n", name);
+}
+
+struct Roof
+{
+    RelayExecutor executor;
+    RelayOutlets outlets;
+    LimitSwitchSampler sampler;
+    MonotonicClock clock;
+    int session;
+    int pressed;
+    bool done;
+    bool success;
+};
+
+/************************************************************************************
+ * One poll cycle of the driver: read the limit switches, toggle an unused outlet,
+ * and dispatch completions until the command is done.
+* ***********************************************************************************/
+static bool cycle(Roof &roof, int i)
+{
+    roof.pressed = 0;
+    for (int input = 0; input < 2; input++)
+    {
+        int level = roof.sampler.getLevel(input);
+        if (level < 0)
+            return false;
+        roof.pressed += RoofStateMachine::isPressed(level) ? 1 : 0;
+    }
+
+    // Outlet 4 is not wired in the model, the roof stays where it is.
+    char path[64] = "/outlet?";
+    if (roof.outlets.buildQuery((i & 1) ? 0x08 : 0x00, 0x08, roof.clock.now(), path + 8, sizeof(path) - 8) == 0)
+        return false;
+
+    roof.done = false;
+    Roof *r = &roof;
+    uint32_t id = roof.executor.submit(roof.session, path, RelayExecutor::PRIORITY_NORMAL, [r](const RelayExecutor::Result &result)
+    {
+        r->done    = true;
+        r->success = result.success;
+    });
+    if (id == 0)
+        return false;
+
+    while (roof.done == false)
+    {
+        struct pollfd pfd;
+        pfd.fd     = roof.executor.getEventFD();
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 5000) <= 0)
+            return false;
+        roof.executor.dispatchCompletions();
+    }
+    return roof.success;
+}
+
+int main(int argc, char *argv[])
+{
+    int count = 500, warmUp = 50;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:w:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n': count = atoi(optarg); break;
+            case 'w': warmUp = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (count <= 0 || warmUp < 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    RoofModel::Parameters parameters = RoofModel::defaultParameters();
+
+    MonotonicClock clock;
+    SimulatorBackend gpio;
+    const int inputs[2] = { parameters.fullOpenPin, parameters.fullClosedPin };
+    gpio.open(nullptr);
+    gpio.setupInputs(inputs, 2, true);
+
+    RoofModel model(&clock, &gpio);
+    model.reset(parameters, 0);
+
+    RelayStandIn relay(&model);
+    Roof roof;
+    const int windows[2] = { 4, 4 };
+    if (relay.start() == false || roof.executor.start() == false || roof.sampler.start(&gpio, 2, 1000, windows) == false)
+    {
+        fprintf(stderr, "Failed to start the relay stand-in, the executor or the sampler.\n");
+        return 1;
+    }
+
+    RelayExecutor::Endpoint endpoint;
+    endpoint.transport = RelayTransport::TRANSPORT_HTTP;
+    endpoint.host      = "127.0.0.1:" + std::to_string(relay.getPort());
+    endpoint.timeoutMs = 2000;
+    roof.session = roof.executor.openEndpoint(endpoint);
+
+    // The driver keeps its outlet cache from the executor observer.
+    RelayOutlets *outlets = &roof.outlets;
+    roof.executor.setObserver(roof.session, [outlets](const RelayExecutor::Result &result)
+    {
+        if (result.success && outlets->update(result.response, result.responseTime) == false)
+            outlets->invalidate();
+    });
+
+    // Connection, DNS and first use of every buffer happen here.
+    for (int i = 0; i < warmUp; i++)
+    {
+        if (cycle(roof, i) == false)
+        {
+            fprintf(stderr, "Warm-up command %d failed.\n", i);
+            return 1;
+        }
+    }
+
+    int failed = 0;
+    uint64_t processBefore = processAllocations.load();
+    counting = true;
+    for (int i = 0; i < count; i++)
+    {
+        if (cycle(roof, warmUp + i) == false)
+            failed++;
+    }
+    counting = false;
+    uint64_t processDuring = processAllocations.load() - processBefore;
+
+    roof.executor.closeEndpoint(roof.session);
+    roof.executor.stop();
+    roof.sampler.stop();
+    relay.stop();
+
+    printf("Commands: %d, failed: %d\n", count, failed);
+    printf("Allocations on the driver thread: %llu\n", static_cast<unsigned long long>(threadAllocations));
+    printf("Allocations in the process: %llu (%.1f per command, relay stand-in and libcurl included)\n",
+           static_cast<unsigned long long>(processDuring), static_cast<double>(processDuring) / count);
+
+    return (failed == 0 && threadAllocations == 0) ? 0 : 2;
+}
@@ -0,0 +1,229 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Black box decoder. Prints the records of a black box file from the oldest to
+ the newest, with wall clock times anchored at the OPEN record of the run that
+ wrote them.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "blackbox.h"
+#include "roof_state_machine.h"
+
+static const char *IPSTATE_NAMES[] = { "IDLE", "OK", "BUSY", "ALERT" };
+static const char *DOME_STATE_NAMES[] = { "IDLE", "MOVING", "SYNCED", "PARKING", "UNPARKING", "PARKED", "UNPARKED", "UNKNOWN", "ERROR" };
+static const char *PARK_NAMES[] = { "unknown", "parked", "unparked" };
+
+static const char *lookup(const char *const *names, size_t count, uint32_t value)
+{
+    return value < count ? names[value] : "?";
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [options] file\n"
+            "  -n count      only the last count records\n"
+            "  -m            print monotonic seconds instead of wall clock time\n", name);
+}
+
+static void printArguments(const BlackBox::Record &record)
+{
+    switch (record.event)
+    {
+        case BlackBox::EVENT_OPEN:
+            printf("wall clock %u.%09u", record.arg1, record.arg2);
+            break;
+
+        case BlackBox::EVENT_INPUT_SAMPLE:
+            printf("input %u raw %u", record.arg0, record.arg1);
+            break;
+
+        case BlackBox::EVENT_LIMIT_SWITCH:
+            printf("input %u level %u debounce %.1f ms", record.arg0, record.arg1, record.arg2 / 1000.0);
+            break;
+
+        case BlackBox::EVENT_STOP_TRIGGER:
+            printf("input %u", record.arg0);
+            break;
+
+        case BlackBox::EVENT_RELAY_COMMAND:
+        {
+            // RelayExecutor::Priority
+            static const char *priorities[] = { "normal", "urgent", "hedge" };
+            printf("#%u %s set %02x clear %02x", record.arg1, record.arg0 < 3 ? priorities[record.arg0] : "?", record.arg2 & 0xFF,
+                   (record.arg2 >> 8) & 0xFF);
+            break;
+        }
+
+        case BlackBox::EVENT_RELAY_RESPONSE:
+            printf("#%u http %u rtt %.1f ms", record.arg1, record.arg0, record.arg2 / 1000.0);
+            break;
+
+        case BlackBox::EVENT_RELAY_FAILED:
+            printf("#%u curl error %u", record.arg1, record.arg0);
+            break;
+
+        case BlackBox::EVENT_RELAY_CANCELLED:
+            printf("#%u", record.arg1);
+            break;
+
+        case BlackBox::EVENT_MOTION_REQUEST:
+            printf("%s %s", record.arg0 ? "close" : "open", record.arg1 ? "stop" : "start");
+            break;
+
+        case BlackBox::EVENT_STATE:
+            printf("roof %s dome %s park %s limits open %u closed %u motion %s park %s",
+                   RoofStateMachine::getStateName(static_cast<RoofStates::State>((record.arg2 >> 12) & 0xF)),
+                   lookup(DOME_STATE_NAMES, sizeof(DOME_STATE_NAMES) / sizeof(*DOME_STATE_NAMES), record.arg0),
+                   lookup(PARK_NAMES, sizeof(PARK_NAMES) / sizeof(*PARK_NAMES), record.arg1),
+                   record.arg2 & 1, (record.arg2 >> 1) & 1, lookup(IPSTATE_NAMES, 4, (record.arg2 >> 4) & 0xF),
+                   lookup(IPSTATE_NAMES, 4, (record.arg2 >> 8) & 0xF));
+            break;
+
+        case BlackBox::EVENT_WEATHER:
+            printf("%s", lookup(IPSTATE_NAMES, 4, record.arg0));
+            break;
+
+        default:
+            printf("%u %u %u", record.arg0, record.arg1, record.arg2);
+            break;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t last = 0;
+    bool monotonicTime = false;
+
+    int option;
+    while ((option = getopt(argc, argv, "n:mh")) != -1)
+    {
+        switch (option)
+        {
+            case 'n': last = strtoull(optarg, nullptr, 10); break;
+            case 'm': monotonicTime = true; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind >= argc)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(BlackBox::Header))
+    {
+        fprintf(stderr, "Cannot read %s\n", argv[optind]);
+        return 1;
+    }
+
+    void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "Cannot map %s\n", argv[optind]);
+        return 1;
+    }
+
+    const BlackBox::Header *header = static_cast<const BlackBox::Header *>(map);
+    if (memcmp(header->magic, BlackBox::MAGIC, sizeof(BlackBox::MAGIC)) != 0 || header->version != BlackBox::VERSION ||
+            header->recordSize != sizeof(BlackBox::Record) ||
+            sizeof(BlackBox::Header) + header->capacity * sizeof(BlackBox::Record) != static_cast<size_t>(st.st_size))
+    {
+        fprintf(stderr, "%s is not a version %u black box file\n", argv[optind], BlackBox::VERSION);
+        return 1;
+    }
+
+    const BlackBox::Record *records = reinterpret_cast<const BlackBox::Record *>(header + 1);
+    uint64_t next  = __atomic_load_n(&header->next, __ATOMIC_ACQUIRE);
+    uint64_t first = next > header->capacity ? next - header->capacity : 0;
+    if (last && next - first > last)
+        first = next - last;
+
+    // Wall clock anchor of the run that wrote the records. Without an OPEN record in the ring
+    // all of them come from the current run. Before the first OPEN record the anchor is lost.
+    uint64_t anchorMonotonic = header->openMonotonic, anchorWall = header->openWall;
+    for (uint64_t index = first; index < next; index++)
+    {
+        if (records[index % header->capacity].event == BlackBox::EVENT_OPEN)
+        {
+            anchorMonotonic = anchorWall = 0;
+            break;
+        }
+    }
+    uint64_t skipped = 0;
+
+    for (uint64_t index = first; index < next; index++)
+    {
+        BlackBox::Record record = records[index % header->capacity];
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (record.sequence != static_cast<uint32_t>(index + 1))
+        {
+            skipped++;
+            continue;
+        }
+
+        if (record.event == BlackBox::EVENT_OPEN)
+        {
+            anchorMonotonic = record.time;
+            anchorWall      = record.arg1 * 1000000000ULL + record.arg2;
+        }
+
+        if (monotonicTime || anchorWall == 0)
+            printf("%14.6f ", record.time / 1e9);
+        else
+        {
+            uint64_t wall = anchorWall + (record.time - anchorMonotonic);
+            time_t seconds = wall / 1000000000ULL;
+            struct tm local;
+            char stamp[32];
+            localtime_r(&seconds, &local);
+            strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &local);
+            printf("%s.%06u ", stamp, static_cast<unsigned>((wall % 1000000000ULL) / 1000));
+        }
+
+        if (record.roof == BlackBox::NO_ROOF)
+            printf("   - ");
+        else
+            printf("%4u ", record.roof);
+
+        printf("%-16s ", BlackBox::getEventName(static_cast<BlackBox::Event>(record.event)));
+        printArguments(record);
+        printf("\n");
+    }
+
+    if (skipped)
+        fprintf(stderr, "%llu records were being written and were skipped\n", static_cast<unsigned long long>(skipped));
+
+    munmap(map, st.st_size);
+    return 0;
+}
@@ -0,0 +1,189 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Encoder counter benchmark. Drives quadrature or step pulses on the simulated
+ GPIO at a fixed rate, back and forth in runs of random length, while the
+ encoder counter decodes them on its own thread. Each run arms a stop halfway
+ through. Reports whether the final count, every reached target and the edge
+ accounting match what was driven.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <random>
+
+#include "encoder_counter.h"
+
+#define PIN_A 20
+#define PIN_B 21
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [options]\n"
+            "  -r counts     counts per second (default 20000)\n"
+            "  -d seconds    duration (default 5)\n"
+            "  -l counts     longest run in one direction (default 5000)\n"
+            "  -1            step encoder on one pin instead of quadrature\n"
+            "  -s seed       random seed (default 1)\n", name);
+}
+
+static void sleepUntil(struct timespec &next, long ns)
+{
+    next.tv_nsec += ns;
+    while (next.tv_nsec >= 1000000000)
+    {
+        next.tv_nsec -= 1000000000;
+        next.tv_sec++;
+    }
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, nullptr);
+}
+
+int main(int argc, char *argv[])
+{
+    int rate = 20000, longest = 5000;
+    double duration = 5;
+    bool step = false;
+    unsigned int seed = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:d:l:1s:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'r': rate = atoi(optarg); break;
+            case 'd': duration = atof(optarg); break;
+            case 'l': longest = atoi(optarg); break;
+            case '1': step = true; break;
+            case 's': seed = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (rate <= 0 || duration <= 0 || longest < 2)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    SimulatorBackend gpio;
+    const int pins[2] = { PIN_A, PIN_B };
+    if (gpio.open(nullptr) == false || gpio.setupCounters(pins, step ? 1 : 2) == false)
+    {
+        fprintf(stderr, "Failed to set up the simulated counter pins.\n");
+        return 1;
+    }
+
+    EncoderCounter counter;
+    EncoderCounter::Channel channel = { 0, step ? -1 : 1 };
+    if (counter.start(&gpio, &channel, 1) == false)
+    {
+        fprintf(stderr, "Failed to start the encoder counter.\n");
+        return 1;
+    }
+
+    std::mt19937 random(seed);
+    std::uniform_int_distribution<int> runLength(2, longest);
+
+    // Pulses go out in 1 ms slices
+    const int perSlice = rate / 1000 > 0 ? rate / 1000 : 1;
+    const long sliceNs = 1000000000L / (rate / perSlice);
+    const uint64_t total = static_cast<uint64_t>(duration * rate);
+
+    int64_t count = 0;
+    uint64_t driven = 0;
+    int runs = 0, reached = 0, missed = 0, wrong = 0;
+
+    struct timespec start, next;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    next = start;
+
+    while (driven < total)
+    {
+        int direction = (runs % 2 == 0) ? 1 : -1;
+        int length    = runLength(random);
+        int64_t target = count + direction * (length / 2);
+        runs++;
+
+        counter.setDirection(0, direction);
+        counter.armStop(0, nullptr, target, direction);
+
+        for (int i = 0; i < length && driven < total; i++)
+        {
+            count += direction;
+            driven++;
+            if (step)
+            {
+                gpio.setLevel(PIN_A, 1);
+                gpio.setLevel(PIN_A, 0);
+            }
+            else
+            {
+                gpio.setLevel(PIN_A, (count & 3) >= 2);
+                gpio.setLevel(PIN_B, ((count + 1) & 3) >= 2);
+            }
+
+            if (driven % perSlice == 0)
+                sleepUntil(next, sliceNs);
+        }
+
+        // Give the counter the rest of the slice to catch up with the run.
+        usleep(2000);
+
+        EncoderCounter::Reached hit;
+        bool fired = false;
+        while (counter.popReached(hit))
+        {
+            fired = true;
+            reached++;
+            if (hit.count != target)
+                wrong++;
+        }
+        counter.disarmStop(0);
+        if (fired == false && (direction > 0 ? count >= target : count <= target))
+            missed++;
+    }
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    // Quadrature counts are one edge each, step counts two.
+    uint64_t edges = driven * (step ? 2 : 1);
+    for (int i = 0; i < 1000 && counter.getEdges() + gpio.getCounterOverruns() < edges; i++)
+        usleep(1000);
+
+    int64_t decoded = counter.getCount(0);
+    counter.stop();
+
+    printf("Encoder:         %s\n", step ? "step" : "quadrature");
+    printf("Counts driven:   %llu in %.2f s (%.0f counts/s, %llu edges)\n", static_cast<unsigned long long>(driven), wall,
+           driven / wall, static_cast<unsigned long long>(edges));
+    printf("Final count:     %lld decoded, %lld driven\n", static_cast<long long>(decoded), static_cast<long long>(count));
+    printf("Edges decoded:   %llu, %llu dropped, %llu quadrature errors\n",
+           static_cast<unsigned long long>(counter.getEdges()), static_cast<unsigned long long>(counter.getDropped()),
+           static_cast<unsigned long long>(counter.getErrors(0)));
+    printf("Armed stops:     %d runs, %d reached, %d off target, %d missed\n", runs, reached, wrong, missed);
+
+    return (decoded != count || wrong > 0 || missed > 0) ? 2 : 0;
+}
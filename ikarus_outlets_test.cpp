@@ -0,0 +1,92 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Relay outlet query test. Checks the queries buildQuery() writes for a fresh
+ and a stale outlet cache against the expected strings below, including the
+ order in which the relay switches the outlets: on a reversal every outlet of
+ the old direction must be off before one of the new direction comes on. Each
+ query is parsed back to make sure it asks for what was meant.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "relay_outlets.h"
+
+struct Expected
+{
+    const char *name;
+    // Outlet state in the cache, negative for a stale cache
+    int cached;
+    uint8_t target;
+    uint8_t mask;
+    const char *query;
+};
+
+// Outlet 1 opens, outlets 2 and 3 close, as the driver wires them.
+static const Expected EXPECTED[] =
+{
+    { "reverse closing to opening", 0x06, 0x01, 0x07, "2=OFF&3=OFF&1=ON" },
+    { "reverse opening to closing", 0x01, 0x06, 0x07, "1=OFF&2=ON&3=ON" },
+    { "reverse, stale cache", -1, 0x01, 0x07, "2=OFF&3=OFF&1=ON" },
+    { "start from stopped", 0x00, 0x06, 0x07, "2=ON&3=ON" },
+    { "stop while closing", 0x06, 0x00, 0x07, "2=OFF&3=OFF" },
+    { "already there", 0x06, 0x06, 0x07, "" },
+    { "outlets outside the mask", 0x86, 0x01, 0x07, "2=OFF&3=OFF&1=ON" },
+    { "all off, stale cache", -1, 0x00, 0xFF, "a=OFF" },
+    { "all on, stale cache", -1, 0xFF, 0xFF, "a=ON" },
+    { "all outlets mixed", -1, 0x81, 0xFF, "2=OFF&3=OFF&4=OFF&5=OFF&6=OFF&7=OFF&1=ON&8=ON" },
+};
+
+int main()
+{
+    int failed = 0, checked = 0;
+    const uint64_t now = 1000000000ULL;
+
+    for (const Expected &expected : EXPECTED)
+    {
+        RelayOutlets outlets;
+        if (expected.cached >= 0)
+            outlets.apply(static_cast<uint8_t>(expected.cached), static_cast<uint8_t>(~expected.cached), now);
+
+        char query[48];
+        size_t length = outlets.buildQuery(expected.target, expected.mask, now, query, sizeof(query));
+        checked++;
+
+        if (strcmp(query, expected.query) != 0 || length != strlen(expected.query))
+        {
+            printf("FAIL %s: got \"%s\", expected \"%s\"\n", expected.name, query, expected.query);
+            failed++;
+            continue;
+        }
+
+        // The query must bring every listed outlet to the target and touch nothing else.
+        uint8_t setMask, clearMask;
+        RelayOutlets::parseQuery(query, setMask, clearMask);
+        uint8_t changes = setMask | clearMask;
+        if ((setMask & ~expected.target) || (clearMask & expected.target) || (changes & ~expected.mask))
+        {
+            printf("FAIL %s: \"%s\" sets %02x and clears %02x\n", expected.name, query, setMask, clearMask);
+            failed++;
+        }
+    }
+
+    printf("%d queries checked, %d failed\n", checked, failed);
+    return failed ? 1 : 0;
+}
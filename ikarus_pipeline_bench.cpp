@@ -0,0 +1,310 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Motion start benchmark. Times an unpark from the request to the relay
+ acknowledging the START against the local relay stand-in, the way the driver
+ did it before the motion pipeline (checks, command, AC off, one after the other)
+ and through the pipeline, with the relay answering recently and with a fresh
+ relay session that has to be warmed up first. The driver used to refuse the
+ latter outright. Outlet 4 stands in for the motor outlets so the model roof
+ stays closed between runs.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "motion_pipeline.h"
+#include "relay_executor.h"
+#include "roof_simulator.h"
+
+// Same stages as the driver
+enum { STAGE_CHECKS, STAGE_WARMUP, STAGE_COMMAND, STAGE_AC, STAGE_COUNT };
+
+static const char *STAGE_NAMES[STAGE_COUNT] = { "checks", "warm-up", "command", "AC" };
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [options]\n"
+            "  -n count      unparks per mode (default 200)\n"
+            "  -l ms         relay latency of the stand-in (default 50)\n", name);
+}
+
+static double percentile(std::vector<double> &values, double p)
+{
+    if (values.empty())
+        return 0;
+    size_t index = std::min(values.size() - 1, static_cast<size_t>(p * values.size()));
+    std::nth_element(values.begin(), values.begin() + index, values.end());
+    return values[index];
+}
+
+struct Bench
+{
+    MonotonicClock clock;
+    SimulatorBackend gpio;
+    RelayExecutor executor;
+    RelayExecutor::Endpoint endpoint;
+    int session;
+    int toggle;
+};
+
+struct Timings
+{
+    std::vector<double> total;
+    double stages[STAGE_COUNT];
+    int failed;
+};
+
+static bool waitFor(Bench &bench, const bool &done)
+{
+    while (done == false)
+    {
+        struct pollfd pfd;
+        pfd.fd     = bench.executor.getEventFD();
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 5000) <= 0)
+            return false;
+        bench.executor.dispatchCompletions();
+    }
+    return true;
+}
+
+static bool checks(Bench &bench)
+{
+    int levels[2];
+    // The roof is closed: nothing refuses an opening.
+    return bench.gpio.readInputs(levels) && !(levels[0] == 0 && levels[1] == 0);
+}
+
+static const char *command(Bench &bench)
+{
+    return (bench.toggle++ & 1) ? "/outlet?4=OFF" : "/outlet?4=ON";
+}
+
+/************************************************************************************
+ * UnPark before the pipeline: the checks and the command from INDI::Dome::Move(), then
+ * the AC, then nothing until the relay answers.
+* ***********************************************************************************/
+static bool unparkSequential(Bench &bench, Timings &timings)
+{
+    uint64_t start = bench.clock.now();
+    if (checks(bench) == false)
+        return false;
+    uint64_t checked = bench.clock.now();
+
+    bool done = false, success = false;
+    uint64_t acknowledged = 0;
+    uint32_t id = bench.executor.submit(bench.session, command(bench), RelayExecutor::PRIORITY_NORMAL,
+                                        [&](const RelayExecutor::Result &result)
+    {
+        acknowledged = bench.clock.now();
+        success      = result.success;
+        done         = true;
+    });
+    if (id == 0)
+        return false;
+    uint64_t sent = bench.clock.now();
+
+    bench.gpio.writeOutput(0, 1);
+    uint64_t acOff = bench.clock.now();
+
+    if (waitFor(bench, done) == false || success == false)
+        return false;
+
+    timings.stages[STAGE_CHECKS]  += (checked - start) / 1e6;
+    timings.stages[STAGE_COMMAND] += (acknowledged - checked) / 1e6;
+    timings.stages[STAGE_AC]      += (acOff - sent) / 1e6;
+    timings.total.push_back((acknowledged - start) / 1e6);
+    return true;
+}
+
+/************************************************************************************
+ * UnPark through the pipeline, as startPipeline() builds it.
+* ***********************************************************************************/
+static bool unparkPipeline(Bench &bench, MotionPipeline &pipeline, bool warmUp, Timings &timings)
+{
+    bool done = false, success = false;
+    pipeline.begin([&](bool result)
+    {
+        success = result;
+        done    = true;
+    });
+
+    pipeline.add(STAGE_CHECKS, 0, [&]()
+    {
+        if (checks(bench) == false)
+            return false;
+        pipeline.complete(STAGE_CHECKS, true);
+        return true;
+    });
+
+    pipeline.add(STAGE_WARMUP, 0, [&]()
+    {
+        if (warmUp == false)
+        {
+            pipeline.skip(STAGE_WARMUP);
+            return true;
+        }
+        return bench.executor.warmUp(bench.session, [&](const RelayExecutor::Result &result)
+        {
+            pipeline.complete(STAGE_WARMUP, result.success);
+        }) != 0;
+    });
+
+    pipeline.add(STAGE_COMMAND, (1U << STAGE_CHECKS) | (1U << STAGE_WARMUP), [&]()
+    {
+        return bench.executor.submit(bench.session, command(bench), RelayExecutor::PRIORITY_NORMAL, [&](const RelayExecutor::Result &result)
+        {
+            pipeline.complete(STAGE_COMMAND, result.success);
+        }) != 0;
+    });
+
+    pipeline.add(STAGE_AC, (1U << STAGE_CHECKS) | (1U << STAGE_WARMUP), [&]()
+    {
+        bench.gpio.writeOutput(0, 1);
+        pipeline.complete(STAGE_AC, true);
+        return true;
+    });
+
+    pipeline.run();
+    if (waitFor(bench, done) == false || success == false)
+        return false;
+
+    for (int i = 0; i < STAGE_COUNT; i++)
+        timings.stages[i] += pipeline.getDuration(i);
+    timings.total.push_back(pipeline.getElapsed());
+    return true;
+}
+
+static void report(const char *mode, Timings &timings, int count)
+{
+    int done = static_cast<int>(timings.total.size());
+    printf("%-22s %4d %4d  %7.2f %7.2f  ", mode, count, timings.failed, percentile(timings.total, 0.5),
+           percentile(timings.total, 0.99));
+    for (int i = 0; i < STAGE_COUNT; i++)
+        printf(" %7.2f", done ? timings.stages[i] / done : 0);
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int count = 200;
+    double latency = 0.05;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:l:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n': count = atoi(optarg); break;
+            case 'l': latency = atof(optarg) / 1000; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (count <= 0 || latency < 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    RoofModel::Parameters parameters = RoofModel::defaultParameters();
+    parameters.relayLatency = latency;
+
+    Bench bench;
+    const int inputs[2] = { parameters.fullOpenPin, parameters.fullClosedPin };
+    // The AC relay
+    const int outputs[1] = { 21 };
+    bench.gpio.open(nullptr);
+    bench.gpio.setupInputs(inputs, 2, false);
+    bench.gpio.setupOutputs(outputs, 1);
+    bench.toggle = 0;
+
+    RoofModel model(&bench.clock, &bench.gpio);
+    model.reset(parameters, 0);
+
+    RelayStandIn relay(&model);
+    if (relay.start() == false || bench.executor.start() == false)
+    {
+        fprintf(stderr, "Failed to start the relay stand-in or the executor.\n");
+        return 1;
+    }
+
+    bench.endpoint.transport = RelayTransport::TRANSPORT_HTTP;
+    bench.endpoint.host      = "127.0.0.1:" + std::to_string(relay.getPort());
+    bench.endpoint.timeoutMs = 2000;
+
+    MotionPipeline pipeline(&bench.clock);
+    Timings sequential = {}, ready = {}, cold = {};
+
+    printf("Relay latency %.f ms, request to START acknowledged\n\n", latency * 1000);
+    printf("%-22s %4s %4s  %7s %7s  ", "Mode (ms)", "Runs", "Fail", "p50", "p99");
+    for (int i = 0; i < STAGE_COUNT; i++)
+        printf(" %7s", STAGE_NAMES[i]);
+    printf("\n");
+
+    // Relay answered recently: a kept connection and no warm-up.
+    bench.session = bench.executor.openEndpoint(bench.endpoint);
+    bool ok = bench.session >= 0 && unparkSequential(bench, sequential);
+    sequential.total.clear();
+    for (int i = 0; i < STAGE_COUNT; i++)
+        sequential.stages[i] = 0;
+
+    for (int i = 0; i < count && ok; i++)
+    {
+        if (unparkSequential(bench, sequential) == false)
+            sequential.failed++;
+        if (unparkPipeline(bench, pipeline, false, ready) == false)
+            ready.failed++;
+    }
+    bench.executor.closeEndpoint(bench.session);
+
+    // Fresh session after connecting: the warm-up opens the connection before the command.
+    for (int i = 0; i < count && ok; i++)
+    {
+        bench.session = bench.executor.openEndpoint(bench.endpoint);
+        if (bench.session < 0 || unparkPipeline(bench, pipeline, true, cold) == false)
+            cold.failed++;
+        bench.executor.closeEndpoint(bench.session);
+    }
+
+    bench.executor.stop();
+    relay.stop();
+
+    if (ok == false)
+    {
+        fprintf(stderr, "Relay stand-in is not reachable.\n");
+        return 1;
+    }
+
+    report("sequential, ready", sequential, count);
+    report("pipeline, ready", ready, count);
+    printf("%-22s %4d %4s  refused, the relay had not answered yet\n", "sequential, fresh", count, "-");
+    report("pipeline, fresh", cold, count);
+
+    return (sequential.failed || ready.failed || cold.failed) ? 2 : 0;
+}
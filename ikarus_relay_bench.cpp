@@ -0,0 +1,219 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Relay transport benchmark. Runs the same outlet commands through the relay
+ executor against a local relay stand-in for every transport in the build,
+ and reports command latency, submission to completion as the driver sees
+ it, so the transports a relay supports can be compared before moving STOP
+ onto one of them. With -f every command is sent as a hedge, on a connection
+ of its own, which adds the connection setup a hedged STOP pays.
+
+ Every completion is also recorded in a RelayHealth the way the driver does,
+ and a transport whose relay does not end up ready fails the run, since the
+ driver would refuse to park or unpark through it.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "relay_executor.h"
+#include "relay_health.h"
+#include "roof_simulator.h"
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [options]\n"
+            "  -n count      commands per transport (default 1000)\n"
+            "  -l ms         relay latency of the stand-in (default 0)\n"
+            "  -t transport  only this transport: http, modbus, tcp or udp (default all in the build)\n"
+            "  -f            send every command on a fresh connection, like a hedged STOP\n", name);
+}
+
+static double percentile(std::vector<double> &values, double p)
+{
+    if (values.empty())
+        return 0;
+    size_t index = std::min(values.size() - 1, static_cast<size_t>(p * values.size()));
+    std::nth_element(values.begin(), values.begin() + index, values.end());
+    return values[index];
+}
+
+/************************************************************************************
+ * Submit one command and dispatch completions until it is done. The outcome goes to
+ * health as in IkarusRoof::updateRelayHealth().
+* ***********************************************************************************/
+static bool runCommand(RelayExecutor &executor, int endpoint, const char *path, RelayExecutor::Priority priority,
+                       RelayExecutor::Result &result, RelayHealth &health)
+{
+    bool done = false;
+    uint32_t id = executor.submit(endpoint, path, priority, [&](const RelayExecutor::Result &completed)
+    {
+        result = completed;
+        done   = true;
+    });
+    if (id == 0)
+        return false;
+
+    while (done == false)
+    {
+        struct pollfd pfd;
+        pfd.fd     = executor.getEventFD();
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 5000) <= 0)
+            return false;
+        executor.dispatchCompletions();
+    }
+
+    if (result.success)
+        health.success(result.responseTime);
+    else
+        health.failure(result.responseTime);
+    return true;
+}
+
+static bool benchmark(RelayTransport::Type transport, int count, double latency, bool fresh)
+{
+    const char *name = RelayTransport::getTypeName(transport);
+
+    RoofModel::Parameters parameters = RoofModel::defaultParameters();
+    parameters.relayLatency = latency;
+
+    MonotonicClock clock;
+    SimulatorBackend gpio;
+    const int inputs[2] = { parameters.fullOpenPin, parameters.fullClosedPin };
+    gpio.open(nullptr);
+    gpio.setupInputs(inputs, 2, false);
+
+    RoofModel model(&clock, &gpio);
+    model.reset(parameters, 0);
+
+    RelayStandIn relay(&model);
+    RelayExecutor executor;
+    if (relay.start(transport) == false || executor.start() == false)
+    {
+        fprintf(stderr, "%s: failed to start the relay stand-in or the executor.\n", name);
+        return false;
+    }
+
+    RelayExecutor::Endpoint endpoint;
+    endpoint.transport = transport;
+    endpoint.host      = "127.0.0.1:" + std::to_string(relay.getPort());
+    endpoint.timeoutMs = 2000;
+    int session = executor.openEndpoint(endpoint);
+
+    RelayExecutor::Result result;
+    RelayHealth health;
+    if (session < 0 || runCommand(executor, session, "/", RelayExecutor::PRIORITY_NORMAL, result, health) == false ||
+            result.success == false)
+    {
+        fprintf(stderr, "%s: relay stand-in is not reachable.\n", name);
+        return false;
+    }
+
+    std::vector<double> latencies;
+    latencies.reserve(count);
+    int failed = 0;
+    RelayExecutor::Priority priority = fresh ? RelayExecutor::PRIORITY_HEDGE : RelayExecutor::PRIORITY_NORMAL;
+
+    for (int i = 0; i < count; i++)
+    {
+        // Toggle the open outlet so every command changes something on the relay.
+        const char *path = (i & 1) ? "/outlet?1=OFF" : "/outlet?1=ON";
+        if (runCommand(executor, session, path, priority, result, health) == false || result.success == false)
+            failed++;
+        else
+            latencies.push_back(result.latency);
+    }
+
+    runCommand(executor, session, "/outlet?a=OFF", RelayExecutor::PRIORITY_URGENT, result, health);
+    executor.closeEndpoint(session);
+    executor.stop();
+    relay.stop();
+
+    RelayHealth::State state = health.getState();
+    printf("%-11s %6d %6d  %8.3f %8.3f %8.3f %8.3f  %s\n", name, count, failed, percentile(latencies, 0),
+           percentile(latencies, 0.5), percentile(latencies, 0.99), percentile(latencies, 1), RelayHealth::getStateName(state));
+    return failed == 0 && state == RelayHealth::STATE_READY;
+}
+
+int main(int argc, char *argv[])
+{
+    int count = 1000;
+    double latency = 0;
+    bool fresh = false;
+    int only = -1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:l:t:fh")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n': count = atoi(optarg); break;
+            case 'l': latency = atof(optarg) / 1000; break;
+            case 'f': fresh = true; break;
+            case 't':
+                for (int i = 0; i < RelayTransport::TRANSPORT_COUNT; i++)
+                {
+                    const char *name = RelayTransport::getTypeName(static_cast<RelayTransport::Type>(i));
+                    if (strncasecmp(optarg, name, strlen(optarg)) == 0)
+                        only = i;
+                }
+                if (only < 0)
+                {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (count <= 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    printf("Transport   Commands Failed  Latency (ms): min      p50      p99      max  Relay\n");
+
+    bool ok = true;
+    for (int i = 0; i < RelayTransport::TRANSPORT_COUNT; i++)
+    {
+        RelayTransport::Type transport = static_cast<RelayTransport::Type>(i);
+        if (only >= 0 && i != only)
+            continue;
+        if (RelayTransport::isAvailable(transport) == false)
+        {
+            printf("%-11s not in this build\n", RelayTransport::getTypeName(transport));
+            continue;
+        }
+        ok = benchmark(transport, count, latency, fresh) && ok;
+    }
+
+    return ok ? 0 : 2;
+}
@@ -32,18 +32,44 @@
 #include <math.h>
 #include <sys/time.h>
 
-class IkarusRoof : public INDI::Dome
+#include "relay_executor.h"
+#include "gpio_backend.h"
+#include "limit_switch_sampler.h"
+#include "roof_simulator.h"
+#include "motion_history.h"
+#include "poll_scheduler.h"
+#include "travel_model.h"
+#include "emergency_stop.h"
+#include "relay_outlets.h"
+#include "relay_health.h"
+#include "roof_hub.h"
+#include "roof_state_machine.h"
+#include "blackbox.h"
+#include "property_publisher.h"
+#include "motion_pipeline.h"
+
+#include <memory>
+
+class IkarusRoof : public INDI::Dome, public RoofHub::Listener
 {
 
     public:
-        IkarusRoof();
+        /**
+         * @param hub shared GPIO, sampler and relay executor of all roofs in the process.
+         * @param name device name, nullptr for the default name.
+         */
+        IkarusRoof(RoofHub &hub, const char *name = nullptr);
         virtual ~IkarusRoof();
 
         virtual bool initProperties();
         const char *getDefaultName();
         bool updateProperties();
+        virtual void ISGetProperties(const char *dev);
         
         virtual bool ISNewSwitch(const char *dev, const char *name, ISState *states, char *names[], int n);
+        virtual bool ISNewText(const char *dev, const char *name, char *texts[], char *names[], int n);
+        virtual bool ISNewNumber(const char *dev, const char *name, double values[], char *names[], int n);
+        virtual bool ISSnoopDevice(XMLEle *root);
 
       protected:
 
@@ -56,11 +82,17 @@ class IkarusRoof : public INDI::Dome
         virtual IPState UnPark();                
         virtual bool Abort();
 
+        virtual bool saveConfigItems(FILE *fp);
+
         virtual bool getLimitSwitchStatus();
         virtual bool getFullOpenedLimitSwitch();
         virtual bool getFullClosedLimitSwitch();
 
-        virtual bool sendRelayCommand(DomeDirection dir, DomeMotionCommand operation);
+        /**
+         * @param urgent send ahead of queued commands and drop them, as STOP always does.
+         */
+        virtual bool sendRelayCommand(DomeDirection dir, DomeMotionCommand operation, RelayExecutor::Callback callback = nullptr,
+                                      bool urgent = false);
 
     private:
 
@@ -69,13 +101,304 @@ class IkarusRoof : public INDI::Dome
         
         ISwitch ACControlS[2];
         ISwitchVectorProperty ACControlSP;
+
+        // Relay address, credentials and optional pinned IP
+        IText RelaySettingsT[4] {};
+        ITextVectorProperty RelaySettingsTP;
+        enum { RELAY_HOST, RELAY_USER, RELAY_PASSWORD, RELAY_PINNED_IP };
+
+        // Relay protocol, one switch per RelayTransport::Type
+        ISwitch RelayTransportS[RelayTransport::TRANSPORT_COUNT];
+        ISwitchVectorProperty RelayTransportSP;
+
+        // GPIO chip
+        IText GPIOSettingsT[1] {};
+        ITextVectorProperty GPIOSettingsTP;
+
+        // GPIO backend, one switch per GPIOBackend::Type
+        ISwitch GPIOBackendS[GPIOBackend::BACKEND_COUNT];
+        ISwitchVectorProperty GPIOBackendSP;
+
+        // Limit switch and AC pin numbers
+        INumber GPIOPinsN[3];
+        INumberVectorProperty GPIOPinsNP;
+        enum { PIN_FULL_OPEN, PIN_FULL_CLOSED, PIN_AC };
+
+        // Limit switch sample rate and debounce window
+        INumber SamplerN[2];
+        INumberVectorProperty SamplerNP;
+        enum { SAMPLER_RATE, SAMPLER_WINDOW };
+
+        // Simulated roof travel time, switch bounce and relay latency
+        INumber SimulationN[3];
+        INumberVectorProperty SimulationNP;
+        enum { SIM_TRAVEL_TIME, SIM_BOUNCE, SIM_RELAY_LATENCY };
+
+        // Phase breakdown of the last motion cycle
+        INumber MotionPhasesN[6];
+        INumberVectorProperty MotionPhasesNP;
+        enum { PHASE_COMMAND, PHASE_RELAY, PHASE_TRAVEL, PHASE_DEBOUNCE, PHASE_STOP, PHASE_TOTAL };
+
+        // Motion history and travel model files, empty to disable
+        IText MotionHistoryT[2] {};
+        ITextVectorProperty MotionHistoryTP;
+        enum { HISTORY_FILE, HISTORY_TRAVEL_MODEL };
+
+        // Estimated roof position and time to the limit
+        INumber RoofPositionN[2];
+        INumberVectorProperty RoofPositionNP;
+        enum { POSITION_PERCENT, POSITION_ETA };
+
+        // Learned open and close travel times
+        INumber TravelModelN[4];
+        INumberVectorProperty TravelModelNP;
+        enum { TRAVEL_OPEN, TRAVEL_OPEN_STDDEV, TRAVEL_CLOSE, TRAVEL_CLOSE_STDDEV };
+
+        // Relay is cut when travel exceeds the learned time plus MARGIN, or MAX_TRAVEL until learned
+        INumber TravelWatchdogN[2];
+        INumberVectorProperty TravelWatchdogNP;
+        enum { WATCHDOG_MARGIN, WATCHDOG_MAX_TRAVEL };
+
+        // Current poll timer interval, sample rate and wakeups
+        INumber PollSchedulerN[3];
+        INumberVectorProperty PollSchedulerNP;
+        enum { POLL_INTERVAL, POLL_SAMPLE_RATE, POLL_WAKEUPS };
+
+        // Real-time priority of the emergency stop thread, 0 for normal scheduling
+        INumber EmergencyStopN[1];
+        INumberVectorProperty EmergencyStopNP;
+
+        // Emergency stop trigger to relay acknowledgement histogram
+        INumber StopLatencyN[EmergencyStop::BUCKET_COUNT + 1];
+        INumberVectorProperty StopLatencyNP;
+        char StopLatencyNames[EmergencyStop::BUCKET_COUNT][2][MAXINDINAME];
+
+        // Cached relay outlet states
+        ILight RelayOutletsL[RelayOutlets::OUTLET_COUNT];
+        ILightVectorProperty RelayOutletsLP;
+
+        // How long the cached outlet states are trusted
+        INumber OutletCacheN[1];
+        INumberVectorProperty OutletCacheNP;
+
+        // Relay command deadline, delay before a STOP is duplicated and longest interval between STOP retries
+        INumber RelayDeadlineN[3];
+        INumberVectorProperty RelayDeadlineNP;
+        enum { DEADLINE_COMMAND, DEADLINE_STOP_HEDGE, DEADLINE_STOP_RETRY_MAX };
+
+        // Attempts and acknowledgement latency of the last STOP, and the worst latency so far
+        INumber StopAckN[3];
+        INumberVectorProperty StopAckNP;
+        enum { STOP_ACK_ATTEMPTS, STOP_ACK_LAST, STOP_ACK_WORST };
+
+        // Measured relay round-trip time
+        INumber RelayRTTN[2];
+        INumberVectorProperty RelayRTTNP;
+        enum { RELAY_RTT_LAST, RELAY_RTT_AVERAGE };
+
+        // Relay reachability from the outcome of every relay command
+        ILight RelayHealthL[1];
+        ILightVectorProperty RelayHealthLP;
+
+        // Idle time before the relay is probed and failures in a row that make it unreachable
+        INumber RelayProbeN[2];
+        INumberVectorProperty RelayProbeNP;
+        enum { PROBE_INTERVAL, PROBE_FAILURES };
+
+        // Close the roof on its own when the snooped weather goes to alert
+        ISwitch WeatherCloseS[2];
+        ISwitchVectorProperty WeatherCloseSP;
+        enum { WEATHER_CLOSE_ENABLE, WEATHER_CLOSE_DISABLE };
+
+        // Weather alert to CLOSE sent, acknowledged and roof closed, for the last weather close
+        INumber WeatherLatencyN[3];
+        INumberVectorProperty WeatherLatencyNP;
+        enum { WEATHER_TO_SENT, WEATHER_TO_ACK, WEATHER_TO_CLOSED };
+
+        // Connect duration, connect to the first roof state, and driver launch to the first roof state
+        INumber StartupN[3];
+        INumberVectorProperty StartupNP;
+        enum { STARTUP_CONNECT, STARTUP_STATE, STARTUP_LAUNCH };
+
+        // Shaft encoder pins, -1 for none. Without B the encoder is a step encoder on A.
+        INumber EncoderPinsN[2];
+        INumberVectorProperty EncoderPinsNP;
+        enum { ENCODER_PIN_A, ENCODER_PIN_B };
+
+        // Encoder counts from closed to open, learned on a full opening, and counts before a target that STOP is sent
+        INumber EncoderN[2];
+        INumberVectorProperty EncoderNP;
+        enum { ENCODER_TRAVEL, ENCODER_LEAD };
+
+        // Encoder count since connecting and quadrature errors
+        INumber EncoderStatusN[2];
+        INumberVectorProperty EncoderStatusNP;
+        enum { ENCODER_COUNT, ENCODER_ERRORS };
+
+        // Open the roof part way, needs a calibrated encoder
+        INumber RoofTargetN[1];
+        INumberVectorProperty RoofTargetNP;
+
+        // Stage times of the last Park/UnPark and the request to motor running
+        INumber MotionPipelineN[5];
+        INumberVectorProperty MotionPipelineNP;
+        enum { PIPE_CHECKS, PIPE_WARMUP, PIPE_COMMAND, PIPE_AC, PIPE_TOTAL };
         
         bool open_dir_change, close_dir_change;
 
         double MotionRequest;
 
         bool SetupParms();
+
+        // GPIO, limit switch sampler and relay executor are shared with the other roofs of the process.
+        RoofHub &hub;
+        int hubSlot;
+        // Exported by the hub's metrics endpoint, updated with relaxed atomics only
+        RoofMetrics *metrics;
+        // Monotonic ns when Connect() started and how long it took
+        uint64_t connectStart = 0;
+        uint64_t connectTime = 0;
+        bool acquireIO();
+        void releaseIO();
+        void configureHub();
+        void limitSwitchTransition(const LimitSwitchSampler::Transition &transition) override;
+        void limitSwitchesChanged(bool overflow) override;
+        void encoderTargetReached(const EncoderCounter::Reached &reached) override;
+
+        // Relay commands run asynchronously on this roof's relay session, completions are dispatched on the INDI thread.
+        RelayExecutor &relayExecutor;
+        int relayEndpoint = -1;
+        void relayCommandCompleted(DomeMotionCommand operation, const RelayExecutor::Result &result);
+        void updateRelayRTT(const RelayExecutor::Result &result);
+
+        // An unacknowledged STOP is repeated on fresh connections, with backoff, until the relay confirms one.
+        bool stopPending = false;
+        uint32_t stopGeneration = 0;
+        int stopAttempts = 0;
+        uint64_t stopSent = 0;
+        int stopRetryMs = 0;
+        int stopHedgeTimerID = -1;
+        RelayExecutor::Callback stopCallback;
+        RelayExecutor::Callback beginStopHedge(const RelayExecutor::Callback &callback);
+        void endStopHedge();
+        void sendStopAttempt();
+        void stopAttemptCompleted(uint32_t generation, const RelayExecutor::Result &result);
+        static void stopHedgeHelper(void *context);
+
+        // Outlet state from the relay status pages, commands are sent as the difference to it.
+        RelayOutlets relayOutlets;
+        bool outletRefreshPending = false;
+        void updateRelayOutlets(const RelayExecutor::Result &result);
+        void refreshRelayOutlets();
+        void publishRelayOutlets();
+
+        // A status request goes out whenever the relay was quiet for the probe interval while idle.
+        RelayHealth relayHealth;
+        int probeTimerID = -1;
+        void updateRelayHealth(const RelayExecutor::Result &result);
+        void publishRelayHealth();
+        void armRelayProbe();
+        static void relayProbeHelper(void *context);
+        // Motion is refused right away while the relay is not known to answer, unless forced.
+        bool checkRelayReady(const char *action, bool force);
+
+        // In simulation the roof model drives the simulated GPIO and serves the relay on localhost.
+        RoofSimulator roofSimulator;
+        bool startRoofSimulator();
+
+        // Timestamps of the motion in progress, appended to the history once STOP is acknowledged.
+        MotionHistory motionHistory;
+        MotionHistory::Cycle motionCycle;
+        bool motionCycleActive = false;
+        time_t motionCycleStart = 0;
+        void beginMotionCycle(DomeDirection dir);
+        void markMotionPhase(MotionHistory::Phase phase, uint64_t timestamp);
+        void endMotionCycle(MotionHistory::Outcome outcome);
+
+        // Poll slowly while parked and faster as the roof nears its limit.
+        PollScheduler pollScheduler;
+        int pollTimerID = -1;
+        uint64_t timerWakeups = 0;
+        // Monotonic ns the poll timer is due, for its jitter
+        uint64_t pollDue = 0;
+        uint64_t lastWakeupCount = 0;
+        uint64_t lastWakeupTime = 0;
+        void reschedulePoll();
+        void updateWakeupRate();
+
+        // Limit switch edges and Abort stop the motor through here without waiting for the INDI loop.
+        EmergencyStop emergencyStop;
+        int emergencyStopCallbackID = -1;
+        static void emergencyStopHelper(int fd, void *context);
+        void publishStopLatency();
+
+        // Learned travel times drive the position estimate and the overrun watchdog.
+        TravelModel travelModel;
+        // 0 closed to 1 open, negative if unknown
+        double roofPosition = -1;
+        double motionStartPosition = -1;
+        uint64_t motorStartTime = 0;
+        int watchdogTimerID = -1;
+        bool motionOverrun = false;
+        double estimateRoofPosition(uint64_t now);
+        void updateRoofPosition();
+        void publishTravelModel();
+        void armTravelWatchdog();
+        void disarmTravelWatchdog();
+        static void travelWatchdogHelper(void *context);
+
+        // The encoder count at the closed limit, known once the roof rested at a limit since connecting.
+        bool encoderHomed = false;
+        int64_t encoderZero = 0;
+        // A partial move is under way, its stop is armed on the counter thread.
+        bool targetMoveActive = false;
+        // 0 closed to 1 open from the encoder, negative if not homed or calibrated
+        double encoderPosition();
+        void homeEncoder();
+        void publishEncoder();
+        IPState moveToTarget(double target);
+        // Arm the counter thread to stop a move started toward target
+        void armTargetStop(DomeDirection dir, double target);
+
+        // Last state written to the black box, so only changes are recorded.
+        uint32_t recordedState[3] = { 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF };
+        int recordedWeather = -1;
+        void recordEvent(BlackBox::Event event, uint16_t arg0 = 0, uint32_t arg1 = 0, uint32_t arg2 = 0);
+        void recordState();
+
+        // Limit switches and requests drive the roof state, INDI properties follow its transitions.
+        RoofStateMachine roofState;
+        void checkRoofState();
+        void roofStateChanged(RoofStates::State previous);
+
+        // Weather alerts close the roof straight from the snoop, without waiting for a poll.
+        IPState snoopedWeather = IPS_IDLE;
+        uint64_t weatherAlertTime = 0;
+        bool weatherClosing = false;
+        bool urgentMotion = false;
+        void weatherClose(uint64_t alertTime);
+        void endWeatherClose(bool closed);
+
+        // Park, UnPark and moves to a target run as staged pipelines, independent stages overlap.
+        MotionPipeline motionPipeline;
+        DomeDirection pipelineDirection = DOME_CW;
+        // Target of a move to a position, negative for Park and UnPark
+        double pipelineTarget = -1;
+        bool pipelineStarting = false;
+        bool startPipeline(DomeDirection dir, double target = -1);
+        void cancelPipeline();
+        // Command stage: starts the motor without the base class Move()
+        bool startMotion(DomeDirection dir);
+        bool warmUpRelay(bool urgent);
+        void pipelineFinished(bool success);
+        // After a Park or UnPark failed on its own, set the park state from the limit switches
+        void restoreParkState();
+        // Refuses motion toward a pressed limit switch and opening in bad weather
+        bool checkMotionAllowed(DomeDirection dir);
         
+        // Status vectors only the driver updates go out through here, once per callback and only when changed.
+        PropertyPublisher publisher;
+
         // Turn on/off observatory AC
         void setAC(bool enable);
 };
@@ -0,0 +1,603 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Trace replay harness. Feeds a recorded timeline of limit switch levels, motion
+ requests, relay responses and weather states through the driver's roof logic
+ on a virtual clock and prints the resulting state transitions and relay
+ commands, optionally diffing them against an expected output. The trace is
+ either a text file or a black box file written by the driver.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "blackbox.h"
+#include "roof_state_machine.h"
+
+enum { INPUT_FULL_OPEN, INPUT_FULL_CLOSED };
+// IPState values as recorded by the driver
+enum { WEATHER_IDLE, WEATHER_OK, WEATHER_BUSY, WEATHER_ALERT };
+
+struct TraceEvent
+{
+    enum Type
+    {
+        // arg0 input, arg1 debounced level (0 pressed)
+        TYPE_LEVEL,
+        // arg0 command
+        TYPE_MOVE,
+        // Oldest outstanding relay command completed, arg0 result
+        TYPE_RELAY,
+        // arg0 weather state
+        TYPE_WEATHER
+    };
+
+    uint64_t time;
+    uint8_t type;
+    uint8_t arg0;
+    uint8_t arg1;
+};
+
+struct InitialState
+{
+    int levels[2];
+    // WEATHER_AUTO_CLOSE of the driver
+    bool weatherClose;
+};
+
+/*
+ Stands in for the driver around RoofStateMachine: polls the limit switches after
+ every event, as a limit switch transition or poll timer would, guards openings
+ against bad weather, closes the roof on a weather alert and queues relay commands. Like the driver, the roof starts
+ in the unknown state and finds its limit switches on the first poll.
+ */
+class RoofReplay
+{
+    public:
+
+        enum Command { COMMAND_OPEN, COMMAND_CLOSE, COMMAND_STOP };
+        enum RelayResult { RELAY_OK, RELAY_FAILED, RELAY_CANCELLED };
+        enum Refusal { REFUSED_ALREADY_OPEN, REFUSED_ALREADY_CLOSED, REFUSED_WEATHER };
+        enum OutputType { OUTPUT_RELAY, OUTPUT_RELAY_FAILED, OUTPUT_REFUSED, OUTPUT_STATE, OUTPUT_AC };
+
+        struct Output
+        {
+            uint64_t time;
+            uint8_t type;
+            uint8_t arg;
+        };
+
+        void reset(const InitialState &initial, std::vector<Output> *sink)
+        {
+            outputs      = sink;
+            levels[0]    = initial.levels[0];
+            levels[1]    = initial.levels[1];
+            weatherAlert = false;
+            weatherClose = initial.weatherClose;
+            pendingHead  = pendingCount = 0;
+            roofState.reset();
+            poll(0);
+        }
+
+        void handle(const TraceEvent &event)
+        {
+            uint64_t now = event.time;
+
+            switch (event.type)
+            {
+                case TraceEvent::TYPE_LEVEL:
+                    levels[event.arg0 & 1] = event.arg1;
+                    break;
+
+                case TraceEvent::TYPE_MOVE:
+                    if (event.arg0 == COMMAND_STOP)
+                        dispatch(now, RoofStates::EVENT_ABORT);
+                    else
+                        move(now, event.arg0 == COMMAND_OPEN);
+                    break;
+
+                case TraceEvent::TYPE_RELAY:
+                    relayCompleted(now, static_cast<RelayResult>(event.arg0));
+                    break;
+
+                case TraceEvent::TYPE_WEATHER:
+                {
+                    bool alert = (event.arg0 == WEATHER_ALERT);
+                    if (alert && weatherAlert == false && weatherClose && roofState.getState() != RoofStates::STATE_CLOSED &&
+                            roofState.getState() != RoofStates::STATE_CLOSING)
+                        move(now, false);
+                    weatherAlert = alert;
+                    break;
+                }
+            }
+
+            poll(now);
+        }
+
+    private:
+
+        // Same as the relay executor command pool. Older commands are taken as acknowledged.
+        static const int MAX_PENDING = 32;
+
+        void poll(uint64_t now)
+        {
+            dispatch(now, RoofStateMachine::limitEvent(RoofStateMachine::isPressed(levels[INPUT_FULL_OPEN]),
+                                                       RoofStateMachine::isPressed(levels[INPUT_FULL_CLOSED])));
+        }
+
+        void move(uint64_t now, bool open)
+        {
+            RoofStates::Event event = open ? RoofStates::EVENT_OPEN_REQUEST : RoofStates::EVENT_CLOSE_REQUEST;
+            if (RoofStates::lookup(roofState.getState(), event).action == RoofStates::ACTION_REFUSE)
+                emit(now, OUTPUT_REFUSED, open ? REFUSED_ALREADY_OPEN : REFUSED_ALREADY_CLOSED);
+            else if (open && weatherAlert)
+                emit(now, OUTPUT_REFUSED, REFUSED_WEATHER);
+            else
+                dispatch(now, event);
+        }
+
+        void dispatch(uint64_t now, RoofStates::Event event)
+        {
+            RoofStates::State previous = roofState.getState();
+            RoofStates::Transition transition = roofState.dispatch(event);
+
+            switch (transition.action)
+            {
+                case RoofStates::ACTION_START_OPEN:
+                    sendRelay(now, COMMAND_OPEN);
+                    break;
+                case RoofStates::ACTION_START_CLOSE:
+                    sendRelay(now, COMMAND_CLOSE);
+                    break;
+                case RoofStates::ACTION_STOP:
+                    sendRelay(now, COMMAND_STOP);
+                    break;
+                default:
+                    break;
+            }
+
+            if (transition.next == previous)
+                return;
+
+            emit(now, OUTPUT_STATE, transition.next);
+            if (previous == RoofStates::STATE_CLOSING && transition.next == RoofStates::STATE_CLOSED)
+                emit(now, OUTPUT_AC, 1);
+        }
+
+        void relayCompleted(uint64_t now, RelayResult result)
+        {
+            if (pendingCount == 0)
+                return;
+
+            Command command = pending[pendingHead];
+            pendingHead = (pendingHead + 1) % MAX_PENDING;
+            pendingCount--;
+
+            if (result != RELAY_FAILED)
+                return;
+
+            emit(now, OUTPUT_RELAY_FAILED, command);
+            // A failed STOP changes nothing, the winch may still be running.
+            if (command != COMMAND_STOP)
+                dispatch(now, RoofStates::EVENT_RELAY_FAILED);
+        }
+
+        void sendRelay(uint64_t now, Command command)
+        {
+            if (pendingCount == MAX_PENDING)
+            {
+                pendingHead = (pendingHead + 1) % MAX_PENDING;
+                pendingCount--;
+            }
+            pending[(pendingHead + pendingCount) % MAX_PENDING] = command;
+            pendingCount++;
+            emit(now, OUTPUT_RELAY, command);
+        }
+
+        void emit(uint64_t now, OutputType type, int arg)
+        {
+            Output output;
+            output.time = now;
+            output.type = type;
+            output.arg  = arg;
+            outputs->push_back(output);
+        }
+
+        std::vector<Output> *outputs;
+        RoofStateMachine roofState;
+        int levels[2];
+        bool weatherAlert;
+        bool weatherClose;
+        Command pending[MAX_PENDING];
+        int pendingHead, pendingCount;
+};
+
+static const char *COMMAND_NAMES[] = { "START open", "START close", "STOP" };
+static const char *REFUSAL_NAMES[] = { "already open", "already closed", "weather alert" };
+
+static void formatOutput(const RoofReplay::Output &output, char *line, size_t size)
+{
+    int length = snprintf(line, size, "%.6f ", output.time / 1e9);
+    line += length;
+    size -= length;
+
+    switch (output.type)
+    {
+        case RoofReplay::OUTPUT_RELAY:
+            snprintf(line, size, "relay %s", COMMAND_NAMES[output.arg]);
+            break;
+        case RoofReplay::OUTPUT_RELAY_FAILED:
+            snprintf(line, size, "relay failed %s", COMMAND_NAMES[output.arg]);
+            break;
+        case RoofReplay::OUTPUT_REFUSED:
+            snprintf(line, size, "refused %s", REFUSAL_NAMES[output.arg]);
+            break;
+        case RoofReplay::OUTPUT_STATE:
+            snprintf(line, size, "state %s", RoofStateMachine::getStateName(static_cast<RoofStates::State>(output.arg)));
+            break;
+        case RoofReplay::OUTPUT_AC:
+            snprintf(line, size, "ac on");
+            break;
+    }
+}
+
+static int findName(const char *const *names, int count, const char *name)
+{
+    for (int i = 0; i < count; i++)
+        if (strcmp(names[i], name) == 0)
+            return i;
+    return -1;
+}
+
+/************************************************************************************
+ * Text trace, one event per line: seconds event argument
+ *   open|closed LEVEL           debounced limit switch line level, 0 is pressed
+ *   move open|close|stop        client motion request, stop is Abort
+ *   relay ok|failed|cancelled   oldest outstanding relay command completed
+ *   weather idle|ok|busy|alert  weather state
+* ***********************************************************************************/
+static bool loadText(FILE *file, const char *path, std::vector<TraceEvent> &events)
+{
+    static const char *INPUTS[]   = { "open", "closed" };
+    static const char *MOVES[]    = { "open", "close", "stop" };
+    static const char *RELAYS[]   = { "ok", "failed", "cancelled" };
+    static const char *WEATHERS[] = { "idle", "ok", "busy", "alert" };
+
+    char line[256];
+    int number = 0;
+    while (fgets(line, sizeof(line), file))
+    {
+        number++;
+        char name[32], argument[32];
+        double seconds;
+        int fields = sscanf(line, "%lf %31s %31s", &seconds, name, argument);
+        if (fields <= 0 || line[strspn(line, " \t")] == '#')
+            continue;
+
+        TraceEvent event;
+        event.time = static_cast<uint64_t>(seconds * 1e9 + 0.5);
+        event.arg0 = event.arg1 = 0;
+        int value = -1;
+
+        if (fields == 3 && (value = findName(INPUTS, 2, name)) >= 0)
+        {
+            event.type = TraceEvent::TYPE_LEVEL;
+            event.arg0 = value;
+            value = (strcmp(argument, "0") == 0 || strcmp(argument, "1") == 0) ? atoi(argument) : -1;
+            event.arg1 = value;
+        }
+        else if (fields == 3 && strcmp(name, "move") == 0)
+        {
+            event.type = TraceEvent::TYPE_MOVE;
+            event.arg0 = value = findName(MOVES, 3, argument);
+        }
+        else if (fields == 3 && strcmp(name, "relay") == 0)
+        {
+            event.type = TraceEvent::TYPE_RELAY;
+            event.arg0 = value = findName(RELAYS, 3, argument);
+        }
+        else if (fields == 3 && strcmp(name, "weather") == 0)
+        {
+            event.type = TraceEvent::TYPE_WEATHER;
+            event.arg0 = value = findName(WEATHERS, 4, argument);
+        }
+
+        if (value < 0 || seconds < 0 || (events.empty() == false && event.time < events.back().time))
+        {
+            fprintf(stderr, "%s:%d: invalid event\n", path, number);
+            return false;
+        }
+        events.push_back(event);
+    }
+
+    return true;
+}
+
+/************************************************************************************
+ * Black box file of the driver. Only relay responses to motion commands are replayed,
+ * commands answered from the outlet cache complete without one.
+* ***********************************************************************************/
+static bool loadBlackBox(FILE *file, const char *path, int roof, std::vector<TraceEvent> &events, InitialState &initial,
+                         bool seedInitial)
+{
+    BlackBox::Header header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.version != BlackBox::VERSION ||
+            header.recordSize != sizeof(BlackBox::Record) || header.capacity == 0)
+    {
+        fprintf(stderr, "%s is not a version %u black box file\n", path, BlackBox::VERSION);
+        return false;
+    }
+
+    std::vector<BlackBox::Record> records(header.capacity);
+    if (fread(records.data(), sizeof(BlackBox::Record), header.capacity, file) != header.capacity)
+    {
+        fprintf(stderr, "%s is truncated\n", path);
+        return false;
+    }
+
+    // Ids of motion commands sent to the relay, to pick their responses from the refreshes.
+    std::vector<uint32_t> motionCommands;
+    uint64_t first = header.next > header.capacity ? header.next - header.capacity : 0;
+
+    for (uint64_t index = first; index < header.next; index++)
+    {
+        const BlackBox::Record &record = records[index % header.capacity];
+        if (record.sequence != static_cast<uint32_t>(index + 1))
+            continue;
+
+        TraceEvent event;
+        event.time = record.time;
+        event.arg0 = event.arg1 = 0;
+
+        switch (record.event)
+        {
+            case BlackBox::EVENT_LIMIT_SWITCH:
+                if (record.arg0 / 2 != roof)
+                    continue;
+                event.type = TraceEvent::TYPE_LEVEL;
+                event.arg0 = record.arg0 % 2;
+                event.arg1 = record.arg1 ? 1 : 0;
+                break;
+
+            case BlackBox::EVENT_MOTION_REQUEST:
+                if (record.roof != roof)
+                    continue;
+                event.type = TraceEvent::TYPE_MOVE;
+                event.arg0 = record.arg1 ? RoofReplay::COMMAND_STOP : (record.arg0 ? RoofReplay::COMMAND_CLOSE : RoofReplay::COMMAND_OPEN);
+                break;
+
+            case BlackBox::EVENT_RELAY_COMMAND:
+                if (record.roof == roof && record.arg1 && record.arg2)
+                    motionCommands.push_back(record.arg1);
+                continue;
+
+            case BlackBox::EVENT_RELAY_RESPONSE:
+            case BlackBox::EVENT_RELAY_FAILED:
+            case BlackBox::EVENT_RELAY_CANCELLED:
+            {
+                if (record.roof != roof)
+                    continue;
+                bool found = false;
+                for (size_t i = 0; i < motionCommands.size() && found == false; i++)
+                {
+                    if (motionCommands[i] == record.arg1)
+                    {
+                        motionCommands.erase(motionCommands.begin() + i);
+                        found = true;
+                    }
+                }
+                if (found == false)
+                    continue;
+                event.type = TraceEvent::TYPE_RELAY;
+                event.arg0 = record.event == BlackBox::EVENT_RELAY_RESPONSE ? RoofReplay::RELAY_OK :
+                             record.event == BlackBox::EVENT_RELAY_FAILED ? RoofReplay::RELAY_FAILED : RoofReplay::RELAY_CANCELLED;
+                break;
+            }
+
+            case BlackBox::EVENT_WEATHER:
+                if (record.roof != roof)
+                    continue;
+                event.type = TraceEvent::TYPE_WEATHER;
+                event.arg0 = record.arg0;
+                break;
+
+            case BlackBox::EVENT_STATE:
+                // Limit switches as the driver saw them before the first replayed event
+                if (record.roof == roof && seedInitial && events.empty())
+                {
+                    initial.levels[INPUT_FULL_OPEN]   = (record.arg2 & 1) ? 0 : 1;
+                    initial.levels[INPUT_FULL_CLOSED] = (record.arg2 & 2) ? 0 : 1;
+                }
+                continue;
+
+            default:
+                continue;
+        }
+
+        // A reboot restarts the monotonic clock, keep the trace in order.
+        if (events.empty() == false && event.time < events.back().time)
+            event.time = events.back().time;
+        events.push_back(event);
+    }
+
+    return true;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [options] trace\n"
+            "  -e file       expected output, exit with status 1 on any difference\n"
+            "  -r roof       roof to replay from a black box file (default 0)\n"
+            "  -l levels     initial full open and full closed levels, e.g. 10 for a closed roof\n"
+            "                (default 11, or the first recorded state of a black box file)\n"
+            "  -W            do not close the roof on a weather alert\n"
+            "  -n repeat     replay the trace repeat times and report throughput (default 1)\n"
+            "  -q            do not print the output\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *expectedPath = nullptr;
+    int roof = 0, repeat = 1;
+    bool quiet = false, seedInitial = true;
+    InitialState initial;
+    initial.levels[0] = initial.levels[1] = 1;
+    initial.weatherClose = true;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "e:r:l:Wn:qh")) != -1)
+    {
+        switch (opt)
+        {
+            case 'e': expectedPath = optarg; break;
+            case 'r': roof = atoi(optarg); break;
+            case 'l':
+                if (strlen(optarg) != 2 || strspn(optarg, "01") != 2)
+                {
+                    usage(argv[0]);
+                    return 1;
+                }
+                initial.levels[INPUT_FULL_OPEN]   = optarg[0] - '0';
+                initial.levels[INPUT_FULL_CLOSED] = optarg[1] - '0';
+                seedInitial = false;
+                break;
+            case 'W': initial.weatherClose = false; break;
+            case 'n': repeat = atoi(optarg); break;
+            case 'q': quiet = true; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind >= argc || repeat <= 0 || roof < 0 || roof >= BlackBox::NO_ROOF)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char *path = argv[optind];
+    FILE *file = fopen(path, "rb");
+    if (file == nullptr)
+    {
+        fprintf(stderr, "Cannot read %s\n", path);
+        return 1;
+    }
+
+    std::vector<TraceEvent> events;
+    char magic[sizeof(BlackBox::MAGIC)];
+    bool blackBox = fread(magic, sizeof(magic), 1, file) == 1 && memcmp(magic, BlackBox::MAGIC, sizeof(magic)) == 0;
+    rewind(file);
+    bool loaded = blackBox ? loadBlackBox(file, path, roof, events, initial, seedInitial) : loadText(file, path, events);
+    fclose(file);
+    if (loaded == false)
+        return 1;
+
+    // Times are printed from the start of the trace.
+    uint64_t origin = events.empty() ? 0 : events.front().time;
+    for (TraceEvent &event : events)
+        event.time -= origin;
+
+    std::vector<RoofReplay::Output> outputs;
+    outputs.reserve(events.size() * 2 + 16);
+    RoofReplay replay;
+
+    auto wallStart = std::chrono::steady_clock::now();
+    for (int run = 0; run < repeat; run++)
+    {
+        outputs.clear();
+        replay.reset(initial, &outputs);
+        for (const TraceEvent &event : events)
+            replay.handle(event);
+    }
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+
+    char line[128];
+    if (quiet == false)
+    {
+        for (const RoofReplay::Output &output : outputs)
+        {
+            formatOutput(output, line, sizeof(line));
+            printf("%s\n", line);
+        }
+    }
+
+    if (repeat > 1)
+    {
+        double total = static_cast<double>(events.size()) * repeat;
+        fprintf(stderr, "Replayed %zu events %d times in %.3f s: %.0f events/s, %.1f ns/event\n", events.size(), repeat,
+                wall, total / wall, wall * 1e9 / total);
+    }
+
+    if (expectedPath == nullptr)
+        return 0;
+
+    FILE *expected = fopen(expectedPath, "r");
+    if (expected == nullptr)
+    {
+        fprintf(stderr, "Cannot read %s\n", expectedPath);
+        return 1;
+    }
+
+    // Blank lines and comments in the expected output are ignored.
+    std::vector<std::string> lines;
+    char text[256];
+    while (fgets(text, sizeof(text), expected))
+    {
+        text[strcspn(text, "\r\n")] = '\0';
+        const char *start = text + strspn(text, " \t");
+        if (*start && *start != '#')
+            lines.push_back(start);
+    }
+    fclose(expected);
+
+    int differences = 0;
+    size_t count = std::max(lines.size(), outputs.size());
+    for (size_t i = 0; i < count; i++)
+    {
+        const char *want = i < lines.size() ? lines[i].c_str() : "(nothing)";
+        const char *got  = "(nothing)";
+        if (i < outputs.size())
+        {
+            formatOutput(outputs[i], line, sizeof(line));
+            got = line;
+        }
+        if (strcmp(want, got) == 0)
+            continue;
+
+        if (differences++ < 10)
+            fprintf(stderr, "Output %zu differs:\n- %s\n+ %s\n", i + 1, want, got);
+    }
+
+    if (differences)
+    {
+        fprintf(stderr, "%d of %zu outputs differ from %s\n", differences, count, expectedPath);
+        return 1;
+    }
+
+    fprintf(stderr, "Output matches %s\n", expectedPath);
+    return 0;
+}
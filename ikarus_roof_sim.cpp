@@ -0,0 +1,254 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Accelerated roof simulation benchmark. Runs park/unpark cycles of the roof
+ model in virtual time, sampling the simulated limit switches through the same
+ debounce filter as the driver, and reports limit-to-stop latency together with
+ the outcome of injected manual openings and stuck limit switches.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+
+#include "debounce_filter.h"
+#include "roof_simulator.h"
+
+enum { INPUT_FULL_OPEN, INPUT_FULL_CLOSED };
+enum RoofState { ROOF_CLOSED, ROOF_OPENING, ROOF_OPEN, ROOF_CLOSING, ROOF_UNKNOWN };
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [options]\n"
+            "  -n cycles     park/unpark cycles to run (default 10000)\n"
+            "  -t seconds    roof travel time (default 20)\n"
+            "  -b ms         limit switch bounce time (default 20)\n"
+            "  -c count      limit switch bounce edges (default 4)\n"
+            "  -l ms         relay latency (default 50)\n"
+            "  -r hz         limit switch sample rate (default 200)\n"
+            "  -w samples    debounce window (default 5)\n"
+            "  -m percent    chance of a manual opening while parked (default 0)\n"
+            "  -f percent    chance of both limit switches sticking while open (default 0)\n"
+            "  -s seed       random seed (default 1)\n", name);
+}
+
+static double percentile(std::vector<uint64_t> &values, double p)
+{
+    if (values.empty())
+        return 0;
+    size_t index = std::min(values.size() - 1, static_cast<size_t>(p * values.size()));
+    std::nth_element(values.begin(), values.begin() + index, values.end());
+    return values[index] / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    RoofModel::Parameters parameters = RoofModel::defaultParameters();
+    int cycles = 10000, rate = 200, window = 5;
+    double manualChance = 0, faultChance = 0;
+    unsigned int seed = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:t:b:c:l:r:w:m:f:s:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n': cycles = atoi(optarg); break;
+            case 't': parameters.travelTime = atof(optarg); break;
+            case 'b': parameters.bounceTime = atof(optarg) / 1000; break;
+            case 'c': parameters.bounceCount = atoi(optarg); break;
+            case 'l': parameters.relayLatency = atof(optarg) / 1000; break;
+            case 'r': rate = atoi(optarg); break;
+            case 'w': window = atoi(optarg); break;
+            case 'm': manualChance = atof(optarg) / 100; break;
+            case 'f': faultChance = atof(optarg) / 100; break;
+            case 's': seed = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (cycles <= 0 || rate <= 0 || window <= 0 || parameters.travelTime <= 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    VirtualClock clock;
+    SimulatorBackend gpio;
+    const int inputs[2] = { parameters.fullOpenPin, parameters.fullClosedPin };
+    gpio.open(nullptr);
+    gpio.setupInputs(inputs, 2, false);
+
+    RoofModel model(&clock, &gpio);
+    model.reset(parameters, 0);
+
+    int levels[2];
+    gpio.readInputs(levels);
+    DebounceFilter filters[2];
+    for (int i = 0; i < 2; i++)
+        filters[i].reset(levels[i], window);
+
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<double> chance(0, 1);
+
+    const uint64_t period = 1000000000ULL / rate;
+    const uint64_t dwell  = 1000000000ULL;
+
+    RoofState state     = ROOF_CLOSED;
+    uint64_t nextAction = clock.now() + dwell;
+    uint64_t injectionEnd = UINT64_MAX;
+    int halfCycles = 0;
+    int manualInjected = 0, manualDetected = 0, faultsInjected = 0, faultsDetected = 0, rejected = 0;
+    uint64_t iterations = 0;
+    std::vector<uint64_t> stopLatencies;
+    stopLatencies.reserve(cycles * 2);
+
+    auto wallStart = std::chrono::steady_clock::now();
+
+    while (halfCycles < cycles * 2)
+    {
+        uint64_t now = clock.now();
+        iterations++;
+
+        if (now >= injectionEnd)
+        {
+            model.setManualVelocity(0);
+            model.setStuckSwitches(false);
+            injectionEnd = UINT64_MAX;
+        }
+
+        model.update();
+        gpio.readInputs(levels);
+
+        // Sample again next period while anything settles or right after the model was disturbed.
+        bool settling = false, changed = false;
+        for (int i = 0; i < 2; i++)
+        {
+            switch (filters[i].update(levels[i], now))
+            {
+                case DebounceFilter::SETTLING: settling = true; break;
+                case DebounceFilter::CHANGED: changed = true; break;
+                case DebounceFilter::REJECTED: rejected++; break;
+                case DebounceFilter::STABLE: break;
+            }
+        }
+
+        if (changed)
+        {
+            // Limit switch is pressed when its charger is off (LOW)
+            bool openPressed   = filters[INPUT_FULL_OPEN].getLevel() == 0;
+            bool closedPressed = filters[INPUT_FULL_CLOSED].getLevel() == 0;
+
+            if (openPressed && closedPressed)
+                faultsDetected++;
+            else if (state == ROOF_OPENING && openPressed)
+            {
+                uint64_t ack = model.relayCommand("a=OFF");
+                stopLatencies.push_back(ack - model.getEndReachedTime());
+                state      = ROOF_OPEN;
+                nextAction = ack + dwell;
+                halfCycles++;
+            }
+            else if (state == ROOF_CLOSING && closedPressed)
+            {
+                uint64_t ack = model.relayCommand("a=OFF");
+                stopLatencies.push_back(ack - model.getEndReachedTime());
+                state      = ROOF_CLOSED;
+                nextAction = ack + dwell;
+                halfCycles++;
+            }
+            else if ((state == ROOF_CLOSED && !closedPressed) || (state == ROOF_OPEN && !openPressed))
+            {
+                // Roof was opened manually. Park state unknown.
+                manualDetected++;
+                state = ROOF_UNKNOWN;
+            }
+        }
+
+        // Idle roof: inject faults, then start the next motion once the dwell is over.
+        if (now >= nextAction && injectionEnd == UINT64_MAX && settling == false)
+        {
+            if (state == ROOF_CLOSED && chance(random) < manualChance)
+            {
+                model.setManualVelocity(0.5);
+                injectionEnd = now + static_cast<uint64_t>(parameters.travelTime * 0.1e9);
+                nextAction   = injectionEnd + dwell;
+                settling     = true;
+                manualInjected++;
+            }
+            else if (state == ROOF_OPEN && chance(random) < faultChance)
+            {
+                model.setStuckSwitches(true);
+                injectionEnd = now + dwell;
+                nextAction   = injectionEnd + dwell;
+                settling     = true;
+                faultsInjected++;
+            }
+            else if (state == ROOF_CLOSED)
+            {
+                model.relayCommand("1=ON");
+                state      = ROOF_OPENING;
+                nextAction = UINT64_MAX;
+            }
+            else if (state == ROOF_OPEN || state == ROOF_UNKNOWN)
+            {
+                model.relayCommand("2=ON&3=ON");
+                state      = ROOF_CLOSING;
+                nextAction = UINT64_MAX;
+            }
+        }
+
+        // Otherwise jump straight to the next event, rounded up to the sample grid.
+        uint64_t next = now + period;
+        if (settling == false)
+        {
+            uint64_t event = std::min(std::min(model.nextEventTime(), nextAction), injectionEnd);
+            if (event == UINT64_MAX)
+            {
+                fprintf(stderr, "Simulation stalled at %.3f s.\n", now / 1e9);
+                return 1;
+            }
+            if (event > next)
+                next = now + ((event - now + period - 1) / period) * period;
+        }
+        clock.advanceTo(next);
+    }
+
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+
+    printf("Cycles:              %d (%llu iterations, %.1f virtual hours)\n", cycles,
+           static_cast<unsigned long long>(iterations), clock.now() / 3.6e12);
+    printf("Wall time:           %.3f s (%.0f cycles/s)\n", wall, cycles / wall);
+    printf("Limit to stop (ms):  min %.1f  p50 %.1f  p99 %.1f  max %.1f\n",
+           percentile(stopLatencies, 0), percentile(stopLatencies, 0.5), percentile(stopLatencies, 0.99),
+           percentile(stopLatencies, 1));
+    printf("Debounce rejections: %d\n", rejected);
+    printf("Manual openings:     %d injected, %d detected\n", manualInjected, manualDetected);
+    printf("Stuck switches:      %d injected, %d detected\n", faultsInjected, faultsDetected);
+
+    return (manualDetected < manualInjected || faultsDetected < faultsInjected) ? 2 : 0;
+}
@@ -0,0 +1,208 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Roof state machine test. Every (state, event) pair of the transition table is
+ dispatched and checked against the expected next state and action below, which
+ are written out separately from the table on purpose. Moving states are reached
+ the way the driver reaches them, from a resting state, so a failed start can be
+ checked to return there. A few sequences check when that resting state is
+ forgotten.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+
+#include "roof_state_machine.h"
+
+using namespace RoofStates;
+
+struct Expected
+{
+    State state;
+    Event event;
+    State next;
+    Action action;
+};
+
+static const Expected EXPECTED[] =
+{
+    { STATE_CLOSED, EVENT_LIMITS_NONE, STATE_UNKNOWN, ACTION_NONE },
+    { STATE_CLOSED, EVENT_LIMIT_OPEN, STATE_OPEN, ACTION_NONE },
+    { STATE_CLOSED, EVENT_LIMIT_CLOSED, STATE_CLOSED, ACTION_NONE },
+    { STATE_CLOSED, EVENT_LIMITS_BOTH, STATE_FAULT, ACTION_NONE },
+    { STATE_CLOSED, EVENT_OPEN_REQUEST, STATE_OPENING, ACTION_START_OPEN },
+    { STATE_CLOSED, EVENT_CLOSE_REQUEST, STATE_CLOSED, ACTION_REFUSE },
+    { STATE_CLOSED, EVENT_ABORT, STATE_CLOSED, ACTION_STOP },
+    { STATE_CLOSED, EVENT_RELAY_FAILED, STATE_CLOSED, ACTION_NONE },
+    { STATE_CLOSED, EVENT_OVERRUN, STATE_CLOSED, ACTION_NONE },
+    { STATE_CLOSED, EVENT_TARGET_REACHED, STATE_CLOSED, ACTION_NONE },
+
+    // Opening from closed
+    { STATE_OPENING, EVENT_LIMITS_NONE, STATE_OPENING, ACTION_NONE },
+    { STATE_OPENING, EVENT_LIMIT_OPEN, STATE_OPEN, ACTION_STOP },
+    { STATE_OPENING, EVENT_LIMIT_CLOSED, STATE_OPENING, ACTION_NONE },
+    { STATE_OPENING, EVENT_LIMITS_BOTH, STATE_FAULT, ACTION_STOP },
+    { STATE_OPENING, EVENT_OPEN_REQUEST, STATE_OPENING, ACTION_START_OPEN },
+    { STATE_OPENING, EVENT_CLOSE_REQUEST, STATE_CLOSING, ACTION_START_CLOSE },
+    { STATE_OPENING, EVENT_ABORT, STATE_UNKNOWN, ACTION_STOP },
+    { STATE_OPENING, EVENT_RELAY_FAILED, STATE_CLOSED, ACTION_NONE },
+    { STATE_OPENING, EVENT_OVERRUN, STATE_FAULT, ACTION_STOP },
+    { STATE_OPENING, EVENT_TARGET_REACHED, STATE_UNKNOWN, ACTION_STOP },
+
+    { STATE_OPEN, EVENT_LIMITS_NONE, STATE_UNKNOWN, ACTION_NONE },
+    { STATE_OPEN, EVENT_LIMIT_OPEN, STATE_OPEN, ACTION_NONE },
+    { STATE_OPEN, EVENT_LIMIT_CLOSED, STATE_CLOSED, ACTION_NONE },
+    { STATE_OPEN, EVENT_LIMITS_BOTH, STATE_FAULT, ACTION_NONE },
+    { STATE_OPEN, EVENT_OPEN_REQUEST, STATE_OPEN, ACTION_REFUSE },
+    { STATE_OPEN, EVENT_CLOSE_REQUEST, STATE_CLOSING, ACTION_START_CLOSE },
+    { STATE_OPEN, EVENT_ABORT, STATE_OPEN, ACTION_STOP },
+    { STATE_OPEN, EVENT_RELAY_FAILED, STATE_OPEN, ACTION_NONE },
+    { STATE_OPEN, EVENT_OVERRUN, STATE_OPEN, ACTION_NONE },
+    { STATE_OPEN, EVENT_TARGET_REACHED, STATE_OPEN, ACTION_NONE },
+
+    // Closing from open
+    { STATE_CLOSING, EVENT_LIMITS_NONE, STATE_CLOSING, ACTION_NONE },
+    { STATE_CLOSING, EVENT_LIMIT_OPEN, STATE_CLOSING, ACTION_NONE },
+    { STATE_CLOSING, EVENT_LIMIT_CLOSED, STATE_CLOSED, ACTION_STOP },
+    { STATE_CLOSING, EVENT_LIMITS_BOTH, STATE_FAULT, ACTION_STOP },
+    { STATE_CLOSING, EVENT_OPEN_REQUEST, STATE_OPENING, ACTION_START_OPEN },
+    { STATE_CLOSING, EVENT_CLOSE_REQUEST, STATE_CLOSING, ACTION_START_CLOSE },
+    { STATE_CLOSING, EVENT_ABORT, STATE_UNKNOWN, ACTION_STOP },
+    { STATE_CLOSING, EVENT_RELAY_FAILED, STATE_OPEN, ACTION_NONE },
+    { STATE_CLOSING, EVENT_OVERRUN, STATE_FAULT, ACTION_STOP },
+    { STATE_CLOSING, EVENT_TARGET_REACHED, STATE_UNKNOWN, ACTION_STOP },
+
+    { STATE_UNKNOWN, EVENT_LIMITS_NONE, STATE_UNKNOWN, ACTION_NONE },
+    { STATE_UNKNOWN, EVENT_LIMIT_OPEN, STATE_OPEN, ACTION_NONE },
+    { STATE_UNKNOWN, EVENT_LIMIT_CLOSED, STATE_CLOSED, ACTION_NONE },
+    { STATE_UNKNOWN, EVENT_LIMITS_BOTH, STATE_FAULT, ACTION_NONE },
+    { STATE_UNKNOWN, EVENT_OPEN_REQUEST, STATE_OPENING, ACTION_START_OPEN },
+    { STATE_UNKNOWN, EVENT_CLOSE_REQUEST, STATE_CLOSING, ACTION_START_CLOSE },
+    { STATE_UNKNOWN, EVENT_ABORT, STATE_UNKNOWN, ACTION_STOP },
+    { STATE_UNKNOWN, EVENT_RELAY_FAILED, STATE_UNKNOWN, ACTION_NONE },
+    { STATE_UNKNOWN, EVENT_OVERRUN, STATE_UNKNOWN, ACTION_NONE },
+    { STATE_UNKNOWN, EVENT_TARGET_REACHED, STATE_UNKNOWN, ACTION_NONE },
+
+    { STATE_FAULT, EVENT_LIMITS_NONE, STATE_FAULT, ACTION_NONE },
+    { STATE_FAULT, EVENT_LIMIT_OPEN, STATE_OPEN, ACTION_NONE },
+    { STATE_FAULT, EVENT_LIMIT_CLOSED, STATE_CLOSED, ACTION_NONE },
+    { STATE_FAULT, EVENT_LIMITS_BOTH, STATE_FAULT, ACTION_NONE },
+    { STATE_FAULT, EVENT_OPEN_REQUEST, STATE_OPENING, ACTION_START_OPEN },
+    { STATE_FAULT, EVENT_CLOSE_REQUEST, STATE_CLOSING, ACTION_START_CLOSE },
+    { STATE_FAULT, EVENT_ABORT, STATE_FAULT, ACTION_STOP },
+    { STATE_FAULT, EVENT_RELAY_FAILED, STATE_FAULT, ACTION_NONE },
+    { STATE_FAULT, EVENT_OVERRUN, STATE_FAULT, ACTION_NONE },
+    { STATE_FAULT, EVENT_TARGET_REACHED, STATE_FAULT, ACTION_NONE }
+};
+
+static const char *EVENT_NAMES[EVENT_COUNT] =
+{
+    "limits none", "limit open", "limit closed", "limits both", "open request", "close request", "abort", "relay failed",
+    "overrun", "target reached"
+};
+
+static const char *ACTION_NAMES[] = { "none", "start open", "start close", "stop", "refuse" };
+
+/************************************************************************************
+ * Put the machine in state the way the driver gets there.
+* ***********************************************************************************/
+static void enter(RoofStateMachine &machine, State state)
+{
+    if (state == STATE_OPENING)
+    {
+        machine.reset(STATE_CLOSED);
+        machine.dispatch(EVENT_OPEN_REQUEST);
+    }
+    else if (state == STATE_CLOSING)
+    {
+        machine.reset(STATE_OPEN);
+        machine.dispatch(EVENT_CLOSE_REQUEST);
+    }
+    else
+        machine.reset(state);
+}
+
+/************************************************************************************
+ * Dispatch events in order from start and check where the machine ends up.
+* ***********************************************************************************/
+static bool sequence(const char *name, State start, const Event *events, int count, State expected)
+{
+    RoofStateMachine machine;
+    machine.reset(start);
+    for (int i = 0; i < count; i++)
+        machine.dispatch(events[i]);
+
+    if (machine.getState() == expected)
+        return true;
+
+    printf("FAIL %s: ended %s, expected %s\n", name, RoofStateMachine::getStateName(machine.getState()),
+           RoofStateMachine::getStateName(expected));
+    return false;
+}
+
+int main()
+{
+    int failed = 0, checked = 0;
+    bool covered[STATE_COUNT][EVENT_COUNT] = {};
+
+    for (const Expected &expected : EXPECTED)
+    {
+        RoofStateMachine machine;
+        enter(machine, expected.state);
+        Transition transition = machine.dispatch(expected.event);
+        covered[expected.state][expected.event] = true;
+        checked++;
+
+        if (transition.next != expected.next || transition.action != expected.action || machine.getState() != expected.next)
+        {
+            printf("FAIL %s + %s: got %s / %s, expected %s / %s\n", RoofStateMachine::getStateName(expected.state),
+                   EVENT_NAMES[expected.event], RoofStateMachine::getStateName(transition.next), ACTION_NAMES[transition.action],
+                   RoofStateMachine::getStateName(expected.next), ACTION_NAMES[expected.action]);
+            failed++;
+        }
+    }
+
+    for (int s = 0; s < STATE_COUNT; s++)
+    {
+        for (int e = 0; e < EVENT_COUNT; e++)
+        {
+            if (covered[s][e] == false)
+            {
+                printf("FAIL %s + %s has no expected result\n", RoofStateMachine::getStateName(static_cast<State>(s)), EVENT_NAMES[e]);
+                failed++;
+            }
+        }
+    }
+
+    // The roof may have moved once it left the limit switch it rested on, or after a reversal.
+    const Event leftLimit[] = { EVENT_OPEN_REQUEST, EVENT_LIMIT_CLOSED, EVENT_LIMITS_NONE, EVENT_RELAY_FAILED };
+    const Event onLimit[]   = { EVENT_OPEN_REQUEST, EVENT_LIMIT_CLOSED, EVENT_LIMIT_CLOSED, EVENT_RELAY_FAILED };
+    const Event reversal[]  = { EVENT_OPEN_REQUEST, EVENT_CLOSE_REQUEST, EVENT_RELAY_FAILED };
+    const Event fromFault[] = { EVENT_CLOSE_REQUEST, EVENT_RELAY_FAILED };
+    const Event twice[]     = { EVENT_OPEN_REQUEST, EVENT_RELAY_FAILED, EVENT_OPEN_REQUEST, EVENT_RELAY_FAILED };
+
+    failed += sequence("failed open after leaving the closed limit", STATE_CLOSED, leftLimit, 4, STATE_UNKNOWN) ? 0 : 1;
+    failed += sequence("failed open still on the closed limit", STATE_CLOSED, onLimit, 4, STATE_CLOSED) ? 0 : 1;
+    failed += sequence("failed reversal", STATE_CLOSED, reversal, 3, STATE_UNKNOWN) ? 0 : 1;
+    failed += sequence("failed close from fault", STATE_FAULT, fromFault, 2, STATE_FAULT) ? 0 : 1;
+    failed += sequence("failed open retried", STATE_CLOSED, twice, 4, STATE_CLOSED) ? 0 : 1;
+    checked += 5;
+
+    printf("%d transitions and sequences checked, %d failed\n", checked, failed);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,305 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Debounced limit switch sampler.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "limit_switch_sampler.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+// Longest sleep on edge descriptors before taking a sample anyway
+#define IDLE_EDGE_TIMEOUT_MS 1000
+// An input still moving after this many windows is seeded from its last sample
+#define SETTLE_WINDOWS 4
+
+static MonotonicClock monotonic;
+
+LimitSwitchSampler::LimitSwitchSampler() : gpio(nullptr), inputCount(0), samplePeriodNs(0),
+    running(false), rejectedGlitches(0), wakeups(0), settleTime(0), overflow(false), recorder(nullptr)
+{
+    for (int i = 0; i < MAX_INPUTS; i++)
+    {
+        stableLevels[i] = -1;
+        windows[i]      = 1;
+        stopTargets[i]  = nullptr;
+        stopLevels[i]   = 0;
+    }
+    eventPipe[0] = eventPipe[1] = -1;
+}
+
+LimitSwitchSampler::~LimitSwitchSampler()
+{
+    stop();
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+bool LimitSwitchSampler::start(GPIOBackend *backend, int inputs, int rate, const int *samples)
+{
+    if (running || backend == nullptr || inputs > MAX_INPUTS || rate <= 0)
+        return false;
+
+    gpio           = backend;
+    inputCount     = inputs;
+    samplePeriodNs = 1000000000 / rate;
+    for (int i = 0; i < inputCount; i++)
+        windows[i] = samples[i] > 0 ? samples[i] : 1;
+
+    int levels[MAX_INPUTS];
+    if (settle(levels) == false || pipe2(eventPipe, O_NONBLOCK | O_CLOEXEC) != 0)
+    {
+        gpio = nullptr;
+        return false;
+    }
+
+    for (int i = 0; i < inputCount; i++)
+        stableLevels[i] = levels[i];
+
+    running = true;
+    sampler = std::thread(&LimitSwitchSampler::samplerLoop, this);
+    return true;
+}
+
+/************************************************************************************
+ * Sample until every input read the same level for its whole window, so a glitch at
+ * startup never decides the initial park state.
+* ***********************************************************************************/
+bool LimitSwitchSampler::settle(int *levels)
+{
+    uint64_t start = monotonic.now();
+
+    if (gpio->readInputs(levels) == false)
+        return false;
+
+    int runs[MAX_INPUTS], longest = 1;
+    for (int i = 0; i < inputCount; i++)
+    {
+        runs[i] = 1;
+        longest = std::max(longest, windows[i]);
+    }
+
+    int period = samplePeriodNs;
+    struct timespec sleep = { period / 1000000000, period % 1000000000 };
+
+    for (int sample = 1; sample < SETTLE_WINDOWS * longest; sample++)
+    {
+        bool settled = true;
+        for (int i = 0; i < inputCount; i++)
+            settled = settled && runs[i] >= windows[i];
+        if (settled)
+            break;
+
+        nanosleep(&sleep, nullptr);
+
+        int current[MAX_INPUTS];
+        if (gpio->readInputs(current) == false)
+            return false;
+
+        for (int i = 0; i < inputCount; i++)
+        {
+            if (current[i] == levels[i])
+                runs[i]++;
+            else
+            {
+                levels[i] = current[i];
+                runs[i]   = 1;
+                rejectedGlitches.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    settleTime = monotonic.now() - start;
+    return true;
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+void LimitSwitchSampler::stop()
+{
+    if (running == false)
+        return;
+
+    running = false;
+    sampler.join();
+
+    close(eventPipe[0]);
+    close(eventPipe[1]);
+    eventPipe[0] = eventPipe[1] = -1;
+
+    Transition stale;
+    while (transitions.pop(stale))
+        ;
+    gpio = nullptr;
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+void LimitSwitchSampler::setRate(int rate)
+{
+    if (rate > 0)
+        samplePeriodNs.store(1000000000 / rate, std::memory_order_relaxed);
+}
+
+void LimitSwitchSampler::armStop(EmergencyStop *stop, int input, int level)
+{
+    disarmStop(input);
+    stopLevels[input] = level;
+    stopTargets[input].store(stop, std::memory_order_release);
+}
+
+int LimitSwitchSampler::getRate() const
+{
+    int period = samplePeriodNs.load(std::memory_order_relaxed);
+    return period ? 1000000000 / period : 0;
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+bool LimitSwitchSampler::popTransition(Transition &transition)
+{
+    char drain[64];
+    while (read(eventPipe[0], drain, sizeof(drain)) > 0)
+        ;
+
+    return transitions.pop(transition);
+}
+
+/************************************************************************************
+ * Sampler thread
+* ***********************************************************************************/
+void LimitSwitchSampler::samplerLoop()
+{
+    DebounceFilter filters[MAX_INPUTS];
+    int rawLevels[MAX_INPUTS];
+    for (int i = 0; i < inputCount; i++)
+    {
+        filters[i].reset(stableLevels[i], windows[i]);
+        rawLevels[i] = stableLevels[i];
+    }
+
+    int edgeFDs[GPIOBackend::MAX_PINS];
+    int edgeCount = gpio->getEventFDs(edgeFDs, GPIOBackend::MAX_PINS);
+
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while (running)
+    {
+        int levels[MAX_INPUTS];
+        bool settling = false;
+
+        wakeups.fetch_add(1, std::memory_order_relaxed);
+
+        if (gpio->readInputs(levels))
+        {
+            uint64_t now = monotonic.now();
+
+            for (int i = 0; i < inputCount; i++)
+            {
+                if (recorder && levels[i] != rawLevels[i])
+                    recorder->record(now, BlackBox::EVENT_INPUT_SAMPLE, BlackBox::NO_ROOF, i, levels[i]);
+                rawLevels[i] = levels[i];
+
+                switch (filters[i].update(levels[i], now))
+                {
+                    case DebounceFilter::SETTLING:
+                        settling = true;
+                        break;
+
+                    case DebounceFilter::REJECTED:
+                        rejectedGlitches.fetch_add(1, std::memory_order_relaxed);
+                        break;
+
+                    case DebounceFilter::CHANGED:
+                    {
+                        stableLevels[i].store(filters[i].getLevel(), std::memory_order_release);
+
+                        // Stop the motor before anything else, the INDI thread only hears about it afterwards.
+                        EmergencyStop *armed = stopTargets[i].load(std::memory_order_acquire);
+                        if (armed && filters[i].getLevel() == stopLevels[i] &&
+                                stopTargets[i].compare_exchange_strong(armed, nullptr, std::memory_order_acq_rel))
+                        {
+                            armed->trigger(now);
+                            if (recorder)
+                                recorder->record(now, BlackBox::EVENT_STOP_TRIGGER, BlackBox::NO_ROOF, i);
+                        }
+
+                        Transition transition;
+                        transition.input       = i;
+                        transition.level       = filters[i].getLevel();
+                        transition.firstChange = filters[i].getChangeStart();
+                        transition.settled     = now;
+                        if (recorder)
+                            recorder->record(now, BlackBox::EVENT_LIMIT_SWITCH, BlackBox::NO_ROOF, i, transition.level,
+                                             static_cast<uint32_t>((now - transition.firstChange) / 1000));
+                        if (transitions.push(transition) == false)
+                            overflow = true;
+
+                        if (write(eventPipe[1], "t", 1) < 0) { /* INDI thread already has a wakeup pending */ }
+                        break;
+                    }
+
+                    case DebounceFilter::STABLE:
+                        break;
+                }
+            }
+        }
+
+        // Nothing in flight: sleep until an edge arrives instead of spinning at the sample rate.
+        if (settling == false && edgeCount > 0)
+        {
+            struct pollfd pfds[GPIOBackend::MAX_PINS];
+            for (int i = 0; i < edgeCount; i++)
+            {
+                pfds[i].fd     = edgeFDs[i];
+                pfds[i].events = POLLIN;
+            }
+
+            if (poll(pfds, edgeCount, IDLE_EDGE_TIMEOUT_MS) > 0)
+            {
+                for (int i = 0; i < edgeCount; i++)
+                {
+                    if (pfds[i].revents & POLLIN)
+                        gpio->readEvents(pfds[i].fd);
+                }
+            }
+
+            clock_gettime(CLOCK_MONOTONIC, &next);
+            continue;
+        }
+
+        next.tv_nsec += samplePeriodNs.load(std::memory_order_relaxed);
+        while (next.tv_nsec >= 1000000000)
+        {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, nullptr);
+    }
+}
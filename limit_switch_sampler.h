@@ -0,0 +1,152 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Debounced limit switch sampler. A dedicated thread samples the limit switch
+ inputs at a fixed rate and runs each one through an integrator filter: every
+ sample moves a counter one step toward the sampled level, and the stable level
+ only flips once the counter reaches the end of the window. A phone charger
+ that drops out for a few samples therefore never flips the park state.
+
+ Stable transitions are handed to the INDI thread through a lock-free SPSC ring,
+ with a notification pipe to wake up the INDI event loop. The current stable
+ levels are also readable at any time without locking.
+
+ When the GPIO backend supports edge events and no input is settling, the thread
+ sleeps on the edge descriptors instead of waking up at the sample rate.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef LIMITSWITCHSAMPLER_H
+#define LIMITSWITCHSAMPLER_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <thread>
+
+#include "blackbox.h"
+#include "debounce_filter.h"
+#include "emergency_stop.h"
+#include "gpio_backend.h"
+#include "roof_clock.h"
+#include "spsc_ring.h"
+
+class LimitSwitchSampler
+{
+    public:
+
+        static const int MAX_INPUTS = GPIOBackend::MAX_PINS;
+
+        struct Transition
+        {
+            int input;
+            int level;
+            // Monotonic ns of the first raw sample at the new level
+            uint64_t firstChange;
+            // Monotonic ns when the debounce filter accepted it
+            uint64_t settled;
+        };
+
+        LimitSwitchSampler();
+        ~LimitSwitchSampler();
+
+        /**
+         * @brief start Start sampling. The stable levels are seeded from a debounced snapshot:
+         * the inputs are sampled until each one held its level for a whole window, which takes
+         * one window at the sample rate unless an input is moving.
+         * @param gpio backend with inputs already set up. The sampler thread owns input reads
+         * and edge events while running.
+         * @param inputs number of inputs to sample, in backend input order.
+         * @param rate sample rate in Hz.
+         * @param windows integrator length in samples, one per input.
+         */
+        bool start(GPIOBackend *gpio, int inputs, int rate, const int *windows);
+        void stop();
+        bool isRunning() const { return running; }
+
+        /**
+         * @brief setRate Change the sample rate of a running sampler. Takes effect after the current sleep.
+         */
+        void setRate(int rate);
+        int getRate() const;
+
+        /**
+         * @brief armStop Trigger an emergency stop from the sampler thread as soon as the
+         * input is accepted at the given level. Fires once, then disarms itself. Each input
+         * can be armed independently.
+         */
+        void armStop(EmergencyStop *stop, int input, int level);
+        void disarmStop(int input) { stopTargets[input].store(nullptr, std::memory_order_release); }
+
+        /**
+         * @brief setRecorder Record raw level changes, accepted transitions and stop triggers.
+         * Set before start().
+         */
+        void setRecorder(BlackBox *blackBox) { recorder = blackBox; }
+
+        // Sampler thread wakeups since start
+        uint64_t getWakeups() const { return wakeups.load(std::memory_order_relaxed); }
+
+        // Readable when transitions are waiting. Register with IEAddCallback.
+        int getEventFD() const { return eventPipe[0]; }
+
+        /**
+         * @brief popTransition Consumer side, INDI thread only. Also drains the notification pipe.
+         */
+        bool popTransition(Transition &transition);
+
+        // Transitions were dropped because the ring was full. Reading clears it.
+        bool checkOverflow() { return overflow.exchange(false); }
+
+        int getLevel(int input) const { return stableLevels[input].load(std::memory_order_acquire); }
+
+        // Raw level changes that never made it through the filter
+        uint64_t getRejectedGlitches() const { return rejectedGlitches.load(std::memory_order_relaxed); }
+
+        // Time start() took to settle the initial levels, in nanoseconds
+        uint64_t getSettleTime() const { return settleTime; }
+
+    private:
+
+        bool settle(int *levels);
+        void samplerLoop();
+
+        GPIOBackend *gpio;
+        int inputCount;
+        std::atomic<int> samplePeriodNs;
+        int windows[MAX_INPUTS];
+
+        std::thread sampler;
+        std::atomic<bool> running;
+
+        std::atomic<int> stableLevels[MAX_INPUTS];
+        std::atomic<uint64_t> rejectedGlitches;
+        std::atomic<uint64_t> wakeups;
+        uint64_t settleTime;
+
+        std::atomic<EmergencyStop *> stopTargets[MAX_INPUTS];
+        int stopLevels[MAX_INPUTS];
+        std::atomic<bool> overflow;
+
+        BlackBox *recorder;
+
+        SPSCRing<Transition, 64> transitions;
+        int eventPipe[2];
+};
+
+#endif
@@ -0,0 +1,451 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Health metrics in the Prometheus text format.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "metrics.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <curl/curl.h>
+
+#include "relay_health.h"
+#include "roof_state_machine.h"
+
+// Bucket upper bounds in seconds
+static const double POLL_JITTER_BOUNDS[]     = { 0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1 };
+static const double RELAY_LATENCY_BOUNDS[]   = { 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 };
+static const double MOTION_DURATION_BOUNDS[] = { 5, 10, 20, 30, 45, 60, 90, 120, 180, 300 };
+
+#define BOUND_COUNT(bounds) static_cast<int>(sizeof(bounds) / sizeof(bounds[0]))
+
+// A scraper gets this long to send its request and read the response
+#define REQUEST_TIMEOUT_MS 2000
+#define REQUEST_SIZE       1024
+
+static uint64_t load(const std::atomic<uint64_t> &counter)
+{
+    return counter.load(std::memory_order_relaxed);
+}
+
+static void appendf(std::string &out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void appendf(std::string &out, const char *format, ...)
+{
+    char line[512];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    if (length > 0)
+        out.append(line, std::min(length, static_cast<int>(sizeof(line)) - 1));
+}
+
+static void appendFamily(std::string &out, const char *name, const char *type, const char *help)
+{
+    appendf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/************************************************************************************
+ * roof="name" with backslash, quote and newline escaped as the text format requires.
+* ***********************************************************************************/
+static std::string roofLabel(const char *name)
+{
+    std::string label = "roof=\"";
+    for (const char *c = name; *c; c++)
+    {
+        if (*c == '\\' || *c == '"')
+            label += '\\';
+        if (*c == '\n')
+            label += "\\n";
+        else
+            label += *c;
+    }
+    label += '"';
+    return label;
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+MetricsHistogram::MetricsHistogram(const double *bounds, int count) : bounds(bounds),
+    boundCount(std::min(count, static_cast<int>(MAX_BUCKETS))), sumMicros(0)
+{
+    for (int i = 0; i <= MAX_BUCKETS; i++)
+        buckets[i].store(0, std::memory_order_relaxed);
+}
+
+void MetricsHistogram::observe(double seconds)
+{
+    if (seconds < 0)
+        seconds = 0;
+
+    int bucket = 0;
+    while (bucket < boundCount && seconds > bounds[bucket])
+        bucket++;
+
+    buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    sumMicros.fetch_add(static_cast<uint64_t>(seconds * 1e6), std::memory_order_relaxed);
+}
+
+void MetricsHistogram::write(std::string &out, const char *name, const char *labels) const
+{
+    // Buckets are loaded one by one while observations continue, so a scrape may be off by
+    // the few observations that happened meanwhile. Each series stays monotonic.
+    uint64_t cumulative = 0;
+    for (int i = 0; i < boundCount; i++)
+    {
+        cumulative += load(buckets[i]);
+        appendf(out, "%s_bucket{%s,le=\"%g\"} %llu\n", name, labels, bounds[i], static_cast<unsigned long long>(cumulative));
+    }
+    cumulative += load(buckets[boundCount]);
+    appendf(out, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels, static_cast<unsigned long long>(cumulative));
+    appendf(out, "%s_sum{%s} %.6f\n", name, labels, load(sumMicros) / 1e6);
+    appendf(out, "%s_count{%s} %llu\n", name, labels, static_cast<unsigned long long>(cumulative));
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+RoofMetrics::RoofMetrics() : connected(0), state(RoofStates::STATE_UNKNOWN), acOn(0), relayHealth(RelayHealth::STATE_UNKNOWN),
+    pollJitter(POLL_JITTER_BOUNDS, BOUND_COUNT(POLL_JITTER_BOUNDS)), polls(0),
+    relayLatency(RELAY_LATENCY_BOUNDS, BOUND_COUNT(RELAY_LATENCY_BOUNDS)), relayCommands(0),
+    stopConfirm(RELAY_LATENCY_BOUNDS, BOUND_COUNT(RELAY_LATENCY_BOUNDS)), stopHedges(0), encoderErrors(0),
+    motionDuration{ { MOTION_DURATION_BOUNDS, BOUND_COUNT(MOTION_DURATION_BOUNDS) },
+                    { MOTION_DURATION_BOUNDS, BOUND_COUNT(MOTION_DURATION_BOUNDS) } },
+    motionStart{ { RELAY_LATENCY_BOUNDS, BOUND_COUNT(RELAY_LATENCY_BOUNDS) },
+                 { RELAY_LATENCY_BOUNDS, BOUND_COUNT(RELAY_LATENCY_BOUNDS) } }
+{
+    for (int i = 0; i < ERROR_CODES; i++)
+        relayErrors[i].store(0, std::memory_order_relaxed);
+    for (int i = 0; i < 2; i++)
+        propertyUpdates[i].store(0, std::memory_order_relaxed);
+    for (int i = 0; i < 2; i++)
+        limitTransitions[i].store(0, std::memory_order_relaxed);
+    for (int i = 0; i < OUTCOMES; i++)
+        motions[i].store(0, std::memory_order_relaxed);
+}
+
+/************************************************************************************
+ * One family at a time, so HELP and TYPE appear once however many roofs there are.
+* ***********************************************************************************/
+void RoofMetrics::write(std::string &out, const RoofMetrics *const *roofs, const char *const *names, int count)
+{
+    std::vector<std::string> labels(count);
+    for (int i = 0; i < count; i++)
+        labels[i] = roofLabel(names[i]);
+
+    appendFamily(out, "ikarusroof_connected", "gauge", "1 while the roof is connected.");
+    for (int i = 0; i < count; i++)
+        appendf(out, "ikarusroof_connected{%s} %d\n", labels[i].c_str(), roofs[i]->connected.load(std::memory_order_relaxed));
+
+    appendFamily(out, "ikarusroof_state", "gauge", "1 for the current state of the roof state machine.");
+    for (int i = 0; i < count; i++)
+    {
+        int state = roofs[i]->state.load(std::memory_order_relaxed);
+        for (int s = 0; s < RoofStates::STATE_COUNT; s++)
+            appendf(out, "ikarusroof_state{%s,state=\"%s\"} %d\n", labels[i].c_str(),
+                    RoofStateMachine::getStateName(static_cast<RoofStates::State>(s)), s == state ? 1 : 0);
+    }
+
+    appendFamily(out, "ikarusroof_ac_on", "gauge", "1 while the AC output is on.");
+    for (int i = 0; i < count; i++)
+        appendf(out, "ikarusroof_ac_on{%s} %d\n", labels[i].c_str(), roofs[i]->acOn.load(std::memory_order_relaxed));
+
+    appendFamily(out, "ikarusroof_relay_ready", "gauge", "1 while the relay answers, including after a single failed command.");
+    for (int i = 0; i < count; i++)
+    {
+        int health = roofs[i]->relayHealth.load(std::memory_order_relaxed);
+        appendf(out, "ikarusroof_relay_ready{%s} %d\n", labels[i].c_str(),
+                health == RelayHealth::STATE_READY || health == RelayHealth::STATE_DEGRADED ? 1 : 0);
+    }
+
+    appendFamily(out, "ikarusroof_polls_total", "counter", "Poll timer callbacks.");
+    for (int i = 0; i < count; i++)
+        appendf(out, "ikarusroof_polls_total{%s} %llu\n", labels[i].c_str(),
+                static_cast<unsigned long long>(load(roofs[i]->polls)));
+
+    appendFamily(out, "ikarusroof_poll_jitter_seconds", "histogram", "How late the poll timer fired after it was due.");
+    for (int i = 0; i < count; i++)
+        roofs[i]->pollJitter.write(out, "ikarusroof_poll_jitter_seconds", labels[i].c_str());
+
+    appendFamily(out, "ikarusroof_relay_commands_total", "counter", "Completed relay commands, cancelled ones excluded.");
+    for (int i = 0; i < count; i++)
+        appendf(out, "ikarusroof_relay_commands_total{%s} %llu\n", labels[i].c_str(),
+                static_cast<unsigned long long>(load(roofs[i]->relayCommands)));
+
+    appendFamily(out, "ikarusroof_relay_latency_seconds", "histogram", "Submission to response of successful relay commands.");
+    for (int i = 0; i < count; i++)
+        roofs[i]->relayLatency.write(out, "ikarusroof_relay_latency_seconds", labels[i].c_str());
+
+    // Only codes that occurred, so the common case is a single empty family.
+    appendFamily(out, "ikarusroof_relay_errors_total", "counter", "Failed relay commands by curl error code.");
+    for (int i = 0; i < count; i++)
+        for (int code = 0; code < ERROR_CODES; code++)
+        {
+            uint64_t errors = load(roofs[i]->relayErrors[code]);
+            if (errors)
+                appendf(out, "ikarusroof_relay_errors_total{%s,code=\"%d\",error=\"%s\"} %llu\n", labels[i].c_str(), code,
+                        curl_easy_strerror(static_cast<CURLcode>(code)), static_cast<unsigned long long>(errors));
+        }
+
+    appendFamily(out, "ikarusroof_stop_confirm_seconds", "histogram", "First STOP sent to the relay acknowledging any of its attempts.");
+    for (int i = 0; i < count; i++)
+        roofs[i]->stopConfirm.write(out, "ikarusroof_stop_confirm_seconds", labels[i].c_str());
+
+    appendFamily(out, "ikarusroof_stop_hedges_total", "counter", "Duplicate STOPs sent on fresh connections.");
+    for (int i = 0; i < count; i++)
+        appendf(out, "ikarusroof_stop_hedges_total{%s} %llu\n", labels[i].c_str(),
+                static_cast<unsigned long long>(load(roofs[i]->stopHedges)));
+
+    appendFamily(out, "ikarusroof_property_updates_total", "counter",
+                 "Status property updates sent to INDI clients, or suppressed as unchanged or merged into another.");
+    for (int i = 0; i < count; i++)
+    {
+        appendf(out, "ikarusroof_property_updates_total{%s,result=\"sent\"} %llu\n", labels[i].c_str(),
+                static_cast<unsigned long long>(load(roofs[i]->propertyUpdates[RoofMetrics::UPDATE_SENT])));
+        appendf(out, "ikarusroof_property_updates_total{%s,result=\"suppressed\"} %llu\n", labels[i].c_str(),
+                static_cast<unsigned long long>(load(roofs[i]->propertyUpdates[RoofMetrics::UPDATE_SUPPRESSED])));
+    }
+
+    appendFamily(out, "ikarusroof_encoder_errors_total", "counter", "Encoder steps skipped, each one a missed edge.");
+    for (int i = 0; i < count; i++)
+        appendf(out, "ikarusroof_encoder_errors_total{%s} %llu\n", labels[i].c_str(),
+                static_cast<unsigned long long>(load(roofs[i]->encoderErrors)));
+
+    appendFamily(out, "ikarusroof_limit_switch_transitions_total", "counter", "Debounced limit switch transitions.");
+    for (int i = 0; i < count; i++)
+    {
+        appendf(out, "ikarusroof_limit_switch_transitions_total{%s,input=\"full_open\"} %llu\n", labels[i].c_str(),
+                static_cast<unsigned long long>(load(roofs[i]->limitTransitions[0])));
+        appendf(out, "ikarusroof_limit_switch_transitions_total{%s,input=\"full_closed\"} %llu\n", labels[i].c_str(),
+                static_cast<unsigned long long>(load(roofs[i]->limitTransitions[1])));
+    }
+
+    appendFamily(out, "ikarusroof_motion_duration_seconds", "histogram", "Motion cycles from request to end, by direction.");
+    for (int i = 0; i < count; i++)
+    {
+        roofs[i]->motionDuration[DIRECTION_OPEN].write(out, "ikarusroof_motion_duration_seconds",
+                                                       (labels[i] + ",direction=\"open\"").c_str());
+        roofs[i]->motionDuration[DIRECTION_CLOSE].write(out, "ikarusroof_motion_duration_seconds",
+                                                        (labels[i] + ",direction=\"close\"").c_str());
+    }
+
+    appendFamily(out, "ikarusroof_motion_start_seconds", "histogram", "Park and UnPark request to the relay starting the motor, by direction.");
+    for (int i = 0; i < count; i++)
+    {
+        roofs[i]->motionStart[DIRECTION_OPEN].write(out, "ikarusroof_motion_start_seconds", (labels[i] + ",direction=\"open\"").c_str());
+        roofs[i]->motionStart[DIRECTION_CLOSE].write(out, "ikarusroof_motion_start_seconds", (labels[i] + ",direction=\"close\"").c_str());
+    }
+
+    appendFamily(out, "ikarusroof_motions_total", "counter", "Motion cycles by outcome.");
+    for (int i = 0; i < count; i++)
+        for (int outcome = 0; outcome < OUTCOMES; outcome++)
+            appendf(out, "ikarusroof_motions_total{%s,outcome=\"%s\"} %llu\n", labels[i].c_str(),
+                    MotionHistory::getOutcomeName(static_cast<MotionHistory::Outcome>(outcome)),
+                    static_cast<unsigned long long>(load(roofs[i]->motions[outcome])));
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+MetricsServer::MetricsServer() : listenFD(-1)
+{
+    wakePipe[0] = wakePipe[1] = -1;
+}
+
+MetricsServer::~MetricsServer()
+{
+    stop();
+}
+
+bool MetricsServer::start(const char *address, const Renderer &render)
+{
+    if (listenFD >= 0)
+        return true;
+
+    std::string host = "127.0.0.1", port = address;
+    const char *colon = strrchr(address, ':');
+    if (colon)
+    {
+        host = std::string(address, colon - address);
+        port = colon + 1;
+    }
+
+    struct addrinfo hints, *addresses = nullptr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = AI_PASSIVE | AI_NUMERICSERV;
+    if (port.empty() || getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &addresses) != 0)
+        return false;
+
+    int fd = -1;
+    for (struct addrinfo *ai = addresses; ai && fd < 0; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+
+        int reuse = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) != 0 || listen(fd, 4) != 0)
+        {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+
+    if (fd < 0)
+        return false;
+
+    if (pipe2(wakePipe, O_CLOEXEC) != 0)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    renderer = render;
+    listenFD = fd;
+    server   = std::thread(&MetricsServer::serverLoop, this);
+    return true;
+}
+
+void MetricsServer::stop()
+{
+    if (listenFD < 0)
+        return;
+
+    char wake = 0;
+    if (write(wakePipe[1], &wake, 1) < 0)
+        perror("MetricsServer wake");
+    if (server.joinable())
+        server.join();
+
+    ::close(listenFD);
+    ::close(wakePipe[0]);
+    ::close(wakePipe[1]);
+    listenFD    = -1;
+    wakePipe[0] = wakePipe[1] = -1;
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+void MetricsServer::serverLoop()
+{
+    for (;;)
+    {
+        struct pollfd fds[2] = { { listenFD, POLLIN, 0 }, { wakePipe[0], POLLIN, 0 } };
+        if (poll(fds, 2, -1) < 0)
+            continue;
+        if (fds[1].revents)
+            break;
+        if ((fds[0].revents & POLLIN) == 0)
+            continue;
+
+        int fd = accept4(listenFD, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+            continue;
+
+        serve(fd);
+        ::close(fd);
+    }
+}
+
+/************************************************************************************
+ * Read one request and answer it, giving up when the scraper is too slow.
+* ***********************************************************************************/
+void MetricsServer::serve(int fd)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t deadline = now.tv_sec * 1000LL + now.tv_nsec / 1000000 + REQUEST_TIMEOUT_MS;
+
+    auto waitFor = [&](short events) -> bool
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int remaining = static_cast<int>(deadline - (now.tv_sec * 1000LL + now.tv_nsec / 1000000));
+        if (remaining <= 0)
+            return false;
+
+        struct pollfd fds[2] = { { fd, events, 0 }, { wakePipe[0], POLLIN, 0 } };
+        return poll(fds, 2, remaining) > 0 && fds[1].revents == 0 && fds[0].revents != 0;
+    };
+
+    char request[REQUEST_SIZE];
+    size_t length = 0;
+    while (length < sizeof(request) - 1)
+    {
+        ssize_t received = recv(fd, request + length, sizeof(request) - 1 - length, 0);
+        if (received > 0)
+        {
+            length += received;
+            request[length] = '\0';
+            if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+                break;
+        }
+        else if (received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            return;
+        else if (waitFor(POLLIN) == false)
+            return;
+    }
+    request[length] = '\0';
+
+    std::string body, response;
+    const char *status = "404 Not Found";
+    if (strncmp(request, "GET /metrics", 12) == 0 && (request[12] == ' ' || request[12] == '?'))
+    {
+        status = "200 OK";
+        renderer(body);
+    }
+    else
+        body = "Not found, metrics are at /metrics\n";
+
+    appendf(response, "HTTP/1.1 %s\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+            "Content-Length: %zu\r\nConnection: close\r\n\r\n", status, body.size());
+    response += body;
+
+    size_t sent = 0;
+    while (sent < response.size())
+    {
+        ssize_t written = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+        if (written > 0)
+            sent += written;
+        else if (written < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            return;
+        else if (waitFor(POLLOUT) == false)
+            return;
+    }
+}
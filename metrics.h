@@ -0,0 +1,158 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Health metrics in the Prometheus text format. Each roof owns a RoofMetrics
+ block of counters and histograms that the INDI thread updates with relaxed
+ atomic increments, nothing is locked and nothing allocates on the hot path.
+
+ MetricsServer answers GET /metrics on a local TCP port from its own thread.
+ A scrape only loads the atomics and formats them on the server thread, so a
+ slow or stuck scraper never delays a poll or a relay command. The server
+ handles one connection at a time with non-blocking sockets and a short
+ deadline per request.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+
+#include "motion_history.h"
+
+class MetricsHistogram
+{
+    public:
+
+        static const int MAX_BUCKETS = 12;
+
+        /**
+         * @param bounds upper bounds of the buckets in seconds, ascending, at most MAX_BUCKETS.
+         * Must outlive the histogram.
+         */
+        MetricsHistogram(const double *bounds, int count);
+
+        void observe(double seconds);
+
+        /**
+         * @brief write Append the _bucket, _sum and _count series, without HELP and TYPE.
+         * @param labels label pairs without braces, e.g. roof="North".
+         */
+        void write(std::string &out, const char *name, const char *labels) const;
+
+    private:
+        const double *bounds;
+        int boundCount;
+        // Per bucket, made cumulative when written. The last one is +Inf.
+        std::atomic<uint64_t> buckets[MAX_BUCKETS + 1];
+        std::atomic<uint64_t> sumMicros;
+};
+
+struct RoofMetrics
+{
+    enum { DIRECTION_OPEN, DIRECTION_CLOSE, DIRECTION_COUNT };
+
+    // CURLcode values fit below this, larger ones are counted as the last one.
+    static const int ERROR_CODES = 128;
+    static const int OUTCOMES    = MotionHistory::OUTCOME_OVERRUN + 1;
+
+    RoofMetrics();
+
+    static void increment(std::atomic<uint64_t> &counter) { counter.fetch_add(1, std::memory_order_relaxed); }
+
+    /**
+     * @brief write Append every metric family with one series per roof, labelled with its name.
+     * Callable from any thread.
+     */
+    static void write(std::string &out, const RoofMetrics *const *roofs, const char *const *names, int count);
+
+    std::atomic<int> connected;
+    // RoofStates::State
+    std::atomic<int> state;
+    std::atomic<int> acOn;
+    // RelayHealth::State
+    std::atomic<int> relayHealth;
+
+    // How late the poll timer fired after it was due
+    MetricsHistogram pollJitter;
+    std::atomic<uint64_t> polls;
+
+    // Submission to response of successful relay commands
+    MetricsHistogram relayLatency;
+    std::atomic<uint64_t> relayCommands;
+    // Failed relay commands by CURLcode
+    std::atomic<uint64_t> relayErrors[ERROR_CODES];
+
+    // First STOP sent to the first acknowledgement of any of its attempts
+    MetricsHistogram stopConfirm;
+    // Duplicate STOPs sent on fresh connections
+    std::atomic<uint64_t> stopHedges;
+
+    // Status property updates sent to clients, and suppressed as unchanged or merged
+    enum { UPDATE_SENT, UPDATE_SUPPRESSED };
+    std::atomic<uint64_t> propertyUpdates[2];
+
+    // Encoder steps skipped, copied from the counter on each poll
+    std::atomic<uint64_t> encoderErrors;
+
+    // Accepted transitions by RoofHub input
+    std::atomic<uint64_t> limitTransitions[2];
+
+    // Whole motion cycle, request to the end, by direction
+    MetricsHistogram motionDuration[DIRECTION_COUNT];
+    // Park/UnPark request to the relay acknowledging the motor command, by direction
+    MetricsHistogram motionStart[DIRECTION_COUNT];
+    std::atomic<uint64_t> motions[OUTCOMES];
+};
+
+class MetricsServer
+{
+    public:
+
+        // Appends the whole response body. Called on the server thread.
+        typedef std::function<void(std::string &)> Renderer;
+
+        MetricsServer();
+        ~MetricsServer();
+
+        /**
+         * @brief start Listen and serve from a new thread.
+         * @param address [host:]port, host defaults to 127.0.0.1.
+         * @return false if the address is invalid or cannot be bound.
+         */
+        bool start(const char *address, const Renderer &renderer);
+        void stop();
+        bool isRunning() const { return listenFD >= 0; }
+
+    private:
+        void serverLoop();
+        void serve(int fd);
+
+        Renderer renderer;
+        std::thread server;
+        int listenFD;
+        // Written by stop() to wake the server thread
+        int wakePipe[2];
+};
+
+#endif
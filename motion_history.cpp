@@ -0,0 +1,88 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Motion cycle instrumentation.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "motion_history.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+MotionHistory::Record MotionHistory::makeRecord(const Cycle &cycle, Outcome outcome, time_t requestTime)
+{
+    Record record;
+    record.time      = static_cast<uint32_t>(requestTime);
+    record.direction = static_cast<int8_t>(cycle.direction);
+    record.outcome   = static_cast<uint8_t>(outcome);
+    record.version   = RECORD_VERSION;
+
+    for (int i = 0; i < PHASE_COUNT - 1; i++)
+    {
+        uint64_t start = cycle.timestamps[i], end = cycle.timestamps[i + 1];
+        if (start == 0 || end == 0 || end < start)
+            record.phases[i] = PHASE_MISSING;
+        else
+        {
+            uint64_t us = (end - start) / 1000;
+            record.phases[i] = (us >= PHASE_MISSING) ? PHASE_MISSING - 1 : static_cast<uint32_t>(us);
+        }
+    }
+
+    return record;
+}
+
+const char *MotionHistory::getOutcomeName(Outcome outcome)
+{
+    switch (outcome)
+    {
+        case OUTCOME_COMPLETED: return "completed";
+        case OUTCOME_ABORTED:   return "aborted";
+        case OUTCOME_FAILED:    return "failed";
+        case OUTCOME_OVERRUN:   return "overrun";
+    }
+    return "unknown";
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+bool MotionHistory::open(const char *path)
+{
+    close();
+    fd = ::open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    return fd >= 0;
+}
+
+void MotionHistory::close()
+{
+    if (fd >= 0)
+        ::close(fd);
+    fd = -1;
+}
+
+bool MotionHistory::append(const Record &record)
+{
+    if (fd < 0)
+        return false;
+    return write(fd, &record, sizeof(record)) == static_cast<ssize_t>(sizeof(record));
+}
@@ -0,0 +1,104 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Motion cycle instrumentation. Every open or close is timestamped on the
+ monotonic clock at each step from the request to the acknowledged STOP, and
+ the resulting phase durations are appended to a compact binary history file
+ for long term trend analysis of the relay and the roof mechanics.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef MOTIONHISTORY_H
+#define MOTIONHISTORY_H
+
+#include <stdint.h>
+#include <time.h>
+
+class MotionHistory
+{
+    public:
+
+        enum Phase
+        {
+            // Park, UnPark or motion requested by the client
+            PHASE_REQUEST,
+            // Relay command went out on the wire
+            PHASE_COMMAND_SENT,
+            // Relay answered, motor is running
+            PHASE_RELAY_RESPONSE,
+            // First raw edge of the target limit switch
+            PHASE_FIRST_EDGE,
+            // Target limit switch accepted by the debounce filter
+            PHASE_LIMIT,
+            // Relay acknowledged STOP
+            PHASE_STOP_ACK,
+            PHASE_COUNT
+        };
+
+        enum Outcome
+        {
+            OUTCOME_COMPLETED,
+            OUTCOME_ABORTED,
+            OUTCOME_FAILED,
+            // Limit switch never triggered, the travel watchdog cut the relay
+            OUTCOME_OVERRUN
+        };
+
+        struct Cycle
+        {
+            // Monotonic nanoseconds per phase, 0 if the phase was not reached
+            uint64_t timestamps[PHASE_COUNT];
+            // +1 opening, -1 closing
+            int direction;
+        };
+
+        static const uint16_t RECORD_VERSION = 1;
+        static const uint32_t PHASE_MISSING  = 0xFFFFFFFF;
+
+        // On-disk record, 28 bytes in native byte order. phases[i] is the time from phase i to phase i + 1.
+        struct Record
+        {
+            // Unix time of the request
+            uint32_t time;
+            int8_t direction;
+            uint8_t outcome;
+            uint16_t version;
+            // Microseconds, PHASE_MISSING if either end was not reached
+            uint32_t phases[PHASE_COUNT - 1];
+        };
+
+        static Record makeRecord(const Cycle &cycle, Outcome outcome, time_t requestTime);
+        static const char *getOutcomeName(Outcome outcome);
+
+        MotionHistory() : fd(-1) {}
+        ~MotionHistory() { close(); }
+
+        bool open(const char *path);
+        void close();
+        bool isOpen() const { return fd >= 0; }
+
+        // Each record is written with a single append so a crash never leaves a partial one behind.
+        bool append(const Record &record);
+
+    private:
+        int fd;
+};
+
+static_assert(sizeof(MotionHistory::Record) == 28, "Motion history record layout changed");
+
+#endif
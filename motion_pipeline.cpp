@@ -0,0 +1,183 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Staged motion start.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "motion_pipeline.h"
+
+MotionPipeline::MotionPipeline(RoofClock *clock) : clock(clock), active(false), beginTime(0), endTime(0), dispatching(false),
+    rerun(false), generation(0)
+{
+    for (int i = 0; i < MAX_STAGES; i++)
+    {
+        stages[i].state    = STAGE_IDLE;
+        stages[i].after    = 0;
+        stages[i].started  = 0;
+        stages[i].finished = 0;
+    }
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+void MotionPipeline::begin(const Finished &callback)
+{
+    for (int i = 0; i < MAX_STAGES; i++)
+    {
+        stages[i].state    = STAGE_IDLE;
+        stages[i].after    = 0;
+        stages[i].action   = nullptr;
+        stages[i].started  = 0;
+        stages[i].finished = 0;
+    }
+
+    finished  = callback;
+    active    = true;
+    beginTime = clock->now();
+    endTime   = 0;
+    generation++;
+}
+
+void MotionPipeline::add(int stage, uint32_t after, const Action &action)
+{
+    stages[stage].state  = STAGE_WAITING;
+    stages[stage].after  = after;
+    stages[stage].action = action;
+}
+
+void MotionPipeline::cancel()
+{
+    active = false;
+    finished = nullptr;
+    generation++;
+}
+
+/************************************************************************************
+ * Stages are started in index order within a round. An action that completes its
+ * stage at once, or a complete() from a callback it triggered, only flags another
+ * round, so dependents start from here rather than from deep inside the action.
+* ***********************************************************************************/
+void MotionPipeline::run()
+{
+    if (dispatching)
+    {
+        rerun = true;
+        return;
+    }
+
+    dispatching = true;
+    uint32_t current = generation;
+    do
+    {
+        rerun = false;
+
+        uint32_t done = 0;
+        for (int i = 0; i < MAX_STAGES; i++)
+        {
+            if (stages[i].state == STAGE_DONE || stages[i].state == STAGE_SKIPPED)
+                done |= 1U << i;
+        }
+
+        for (int i = 0; i < MAX_STAGES && active && generation == current; i++)
+        {
+            if (stages[i].state != STAGE_WAITING || (stages[i].after & done) != stages[i].after)
+                continue;
+
+            stages[i].state   = STAGE_RUNNING;
+            stages[i].started = clock->now();
+            if (stages[i].action() == false && generation == current && stages[i].state == STAGE_RUNNING)
+                complete(i, false);
+        }
+    }
+    while (rerun && active && generation == current);
+    dispatching = false;
+
+    if (active == false || generation != current)
+        return;
+
+    for (int i = 0; i < MAX_STAGES; i++)
+    {
+        if (stages[i].state == STAGE_WAITING || stages[i].state == STAGE_RUNNING)
+            return;
+    }
+    finish(true);
+}
+
+void MotionPipeline::complete(int stage, bool success)
+{
+    if (active == false || stages[stage].state != STAGE_RUNNING)
+        return;
+
+    stages[stage].finished = clock->now();
+    stages[stage].state    = success ? STAGE_DONE : STAGE_FAILED;
+
+    if (success)
+        run();
+    else
+        finish(false);
+}
+
+void MotionPipeline::skip(int stage)
+{
+    if (active == false || stages[stage].state != STAGE_RUNNING)
+        return;
+
+    stages[stage].finished = stages[stage].started;
+    stages[stage].state    = STAGE_SKIPPED;
+    run();
+}
+
+void MotionPipeline::finish(bool success)
+{
+    // Waiting stages never start once a stage failed.
+    active  = false;
+    endTime = clock->now();
+
+    Finished callback;
+    callback.swap(finished);
+    if (callback)
+        callback(success);
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+double MotionPipeline::getDuration(int stage) const
+{
+    const Stage &s = stages[stage];
+    if (s.state != STAGE_DONE && s.state != STAGE_FAILED)
+        return 0;
+    return (s.finished - s.started) / 1e6;
+}
+
+double MotionPipeline::getElapsed() const
+{
+    if (active)
+        return (clock->now() - beginTime) / 1e6;
+    return endTime ? (endTime - beginTime) / 1e6 : 0;
+}
+
+double MotionPipeline::getSequential() const
+{
+    double sum = 0;
+    for (int i = 0; i < MAX_STAGES; i++)
+        sum += getDuration(i);
+    return sum;
+}
@@ -0,0 +1,135 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Staged motion start. Park and UnPark are split into stages (pre-checks, relay
+ warm-up, AC switching, relay command) and each stage names the stages it has
+ to wait for. Every stage whose dependencies are done is started in the same
+ pass, so independent stages overlap instead of queueing behind each other.
+ Stages that wait on the relay complete later from its callback, on the INDI
+ thread like everything else here.
+
+ Each stage is timed on the roof clock, so the time from the request to the
+ motor running can be broken down by stage.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef MOTIONPIPELINE_H
+#define MOTIONPIPELINE_H
+
+#include <stdint.h>
+
+#include <functional>
+
+#include "roof_clock.h"
+
+class MotionPipeline
+{
+    public:
+
+        static const int MAX_STAGES = 8;
+
+        enum StageState
+        {
+            // Not part of the current pipeline
+            STAGE_IDLE,
+            // Waiting for its dependencies
+            STAGE_WAITING,
+            // Started, completes through complete()
+            STAGE_RUNNING,
+            STAGE_DONE,
+            // Nothing to do, counts as done
+            STAGE_SKIPPED,
+            STAGE_FAILED
+        };
+
+        /**
+         * @brief Action Starts a stage. Returns false if it failed right away. Otherwise the
+         * stage completes through complete() or skip(), from within the action or later.
+         */
+        typedef std::function<bool()> Action;
+
+        // Called once all stages are done, or on the first failure
+        typedef std::function<void(bool success)> Finished;
+
+        explicit MotionPipeline(RoofClock *clock);
+
+        /**
+         * @brief begin Start assembling a new pipeline, dropping the current one.
+         */
+        void begin(const Finished &finished);
+
+        /**
+         * @brief add Add a stage.
+         * @param after bit mask of the stages that must be done or skipped before it starts.
+         */
+        void add(int stage, uint32_t after, const Action &action);
+
+        /**
+         * @brief run Start every stage whose dependencies are done. Called once after the
+         * stages were added, and again by complete().
+         */
+        void run();
+
+        void complete(int stage, bool success);
+        void skip(int stage);
+
+        /**
+         * @brief cancel Drop the pipeline without calling finished. Stages still running
+         * are ignored when they complete.
+         */
+        void cancel();
+
+        bool isActive() const { return active; }
+        // Changes with every begin() and cancel(), for callbacks that may outlive their pipeline
+        uint32_t getID() const { return generation; }
+        StageState getState(int stage) const { return stages[stage].state; }
+
+        // Milliseconds the stage took, 0 unless it completed
+        double getDuration(int stage) const;
+        // Milliseconds from begin() to the end of the last stage, or to now while active
+        double getElapsed() const;
+        // Sum of the stage durations, what running them one after the other would have taken
+        double getSequential() const;
+
+    private:
+
+        struct Stage
+        {
+            StageState state;
+            uint32_t after;
+            Action action;
+            uint64_t started;
+            uint64_t finished;
+        };
+
+        void finish(bool success);
+
+        RoofClock *clock;
+        Stage stages[MAX_STAGES];
+        Finished finished;
+        bool active;
+        uint64_t beginTime;
+        uint64_t endTime;
+        // run() is on the stack, stages completing meanwhile are picked up by its next round
+        bool dispatching;
+        bool rerun;
+        // Bumped by begin() and cancel(), so a pipeline cancelled from an action is left alone
+        uint32_t generation;
+};
+
+#endif
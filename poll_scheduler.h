@@ -0,0 +1,109 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Motion aware poll scheduler. Picks the consistency timer interval and the limit
+ switch sample rate from what the roof is doing: a parked roof is checked rarely,
+ a moving roof often, and more often still as the elapsed travel time approaches
+ the expected travel duration.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef POLLSCHEDULER_H
+#define POLLSCHEDULER_H
+
+#include <stdint.h>
+
+class PollScheduler
+{
+    public:
+
+        struct Settings
+        {
+            // Timer interval while the roof is idle
+            int idleIntervalMs;
+            // Timer interval at the start of a motion
+            int motionIntervalMs;
+            // Timer interval once the roof is due at its limit
+            int finalIntervalMs;
+            // Fraction of the learned travel time after which the interval starts to shrink
+            double approachFraction;
+            // Limit switch sample rate while idle, and during motion
+            int idleSampleRate;
+            int motionSampleRate;
+        };
+
+        PollScheduler() : motionStart(0), moving(false), travelEstimate(0)
+        {
+            settings.idleIntervalMs   = 30000;
+            settings.motionIntervalMs = 1000;
+            settings.finalIntervalMs  = 100;
+            settings.approachFraction = 0.7;
+            settings.idleSampleRate   = 20;
+            settings.motionSampleRate = 200;
+        }
+
+        void configure(const Settings &newSettings) { settings = newSettings; }
+        const Settings &getSettings() const { return settings; }
+
+        void beginMotion(uint64_t now)
+        {
+            motionStart = now;
+            moving      = true;
+        }
+
+        void endMotion() { moving = false; }
+        bool isMoving() const { return moving; }
+
+        // Expected seconds from the start of this motion to the limit, 0 if unknown.
+        void setTravelEstimate(double seconds) { travelEstimate = seconds; }
+        double getTravelEstimate() const { return travelEstimate; }
+
+        /**
+         * @brief getTimerInterval Interval until the next consistency check.
+         * Shrinks linearly from the motion interval to the final interval between
+         * approachFraction and all of the learned travel time, and stays there on overrun.
+         */
+        int getTimerInterval(uint64_t now) const
+        {
+            if (moving == false)
+                return settings.idleIntervalMs;
+
+            if (travelEstimate <= 0)
+                return settings.motionIntervalMs;
+
+            double progress = (now - motionStart) / (travelEstimate * 1e9);
+            if (progress <= settings.approachFraction)
+                return settings.motionIntervalMs;
+            if (progress >= 1)
+                return settings.finalIntervalMs;
+
+            double t = (progress - settings.approachFraction) / (1 - settings.approachFraction);
+            return static_cast<int>(settings.motionIntervalMs + t * (settings.finalIntervalMs - settings.motionIntervalMs));
+        }
+
+        // The debounce window is counted in samples, so motion always samples at the full rate.
+        int getSampleRate() const { return moving ? settings.motionSampleRate : settings.idleSampleRate; }
+
+    private:
+        Settings settings;
+        uint64_t motionStart;
+        bool moving;
+        double travelEstimate;
+};
+
+#endif
@@ -0,0 +1,241 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Delta-only property updates.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "property_publisher.h"
+
+#include <indicom.h>
+#include <indidevapi.h>
+
+PropertyPublisher::PropertyPublisher() : flushTimerID(-1), sentCounter(nullptr), suppressedCounter(nullptr)
+{
+}
+
+PropertyPublisher::~PropertyPublisher()
+{
+    if (flushTimerID >= 0)
+        IERmTimer(flushTimerID);
+}
+
+void PropertyPublisher::setCounters(std::atomic<uint64_t> *sent, std::atomic<uint64_t> *suppressed)
+{
+    sentCounter       = sent;
+    suppressedCounter = suppressed;
+}
+
+void PropertyPublisher::publish(ISwitchVectorProperty *svp)
+{
+    queue(svp, KIND_SWITCH);
+}
+
+void PropertyPublisher::publish(INumberVectorProperty *nvp)
+{
+    queue(nvp, KIND_NUMBER);
+}
+
+void PropertyPublisher::publish(ILightVectorProperty *lvp)
+{
+    queue(lvp, KIND_LIGHT);
+}
+
+void PropertyPublisher::publish(ITextVectorProperty *tvp)
+{
+    queue(tvp, KIND_TEXT);
+}
+
+void PropertyPublisher::send(ISwitchVectorProperty *svp)
+{
+    Entry &entry = find(svp, KIND_SWITCH);
+    entry.queued = false;
+    snapshot(entry, entry.last);
+    sendEntry(entry);
+}
+
+/************************************************************************************
+ * A zero delay timer runs on the next pass of the event loop, after the callback
+ * that queued the first update has returned.
+* ***********************************************************************************/
+void PropertyPublisher::queue(const void *vector, Kind kind)
+{
+    Entry &entry = find(vector, kind);
+    if (entry.queued)
+    {
+        count(suppressedCounter);
+        return;
+    }
+
+    entry.queued = true;
+    if (flushTimerID < 0)
+        flushTimerID = IEAddTimer(0, flushHelper, this);
+}
+
+void PropertyPublisher::flushHelper(void *context)
+{
+    PropertyPublisher *publisher = static_cast<PropertyPublisher *>(context);
+    publisher->flushTimerID = -1;
+    publisher->flush();
+}
+
+void PropertyPublisher::flush()
+{
+    if (flushTimerID >= 0)
+    {
+        IERmTimer(flushTimerID);
+        flushTimerID = -1;
+    }
+
+    for (Entry &entry : entries)
+    {
+        if (entry.queued == false)
+            continue;
+
+        entry.queued = false;
+        if (changed(entry))
+            sendEntry(entry);
+        else
+            count(suppressedCounter);
+    }
+}
+
+void PropertyPublisher::reset()
+{
+    if (flushTimerID >= 0)
+    {
+        IERmTimer(flushTimerID);
+        flushTimerID = -1;
+    }
+    entries.clear();
+}
+
+PropertyPublisher::Entry &PropertyPublisher::find(const void *vector, Kind kind)
+{
+    for (Entry &entry : entries)
+    {
+        if (entry.vector == vector)
+            return entry;
+    }
+
+    Entry entry;
+    entry.vector = vector;
+    entry.kind   = kind;
+    entry.queued = false;
+    entry.sent   = false;
+    entries.push_back(entry);
+    return entries.back();
+}
+
+/************************************************************************************
+ * Compares the vector with what was last sent and remembers it if it changed.
+* ***********************************************************************************/
+bool PropertyPublisher::changed(Entry &entry)
+{
+    snapshot(entry, scratch);
+    if (entry.sent && scratch == entry.last)
+        return false;
+
+    entry.last.swap(scratch);
+    return true;
+}
+
+void PropertyPublisher::sendEntry(Entry &entry)
+{
+    switch (entry.kind)
+    {
+        case KIND_SWITCH:
+            IDSetSwitch(static_cast<const ISwitchVectorProperty *>(entry.vector), NULL);
+            break;
+        case KIND_NUMBER:
+            IDSetNumber(static_cast<const INumberVectorProperty *>(entry.vector), NULL);
+            break;
+        case KIND_LIGHT:
+            IDSetLight(static_cast<const ILightVectorProperty *>(entry.vector), NULL);
+            break;
+        case KIND_TEXT:
+            IDSetText(static_cast<const ITextVectorProperty *>(entry.vector), NULL);
+            break;
+    }
+
+    entry.sent = true;
+    count(sentCounter);
+}
+
+void PropertyPublisher::count(std::atomic<uint64_t> *counter)
+{
+    if (counter)
+        counter->fetch_add(1, std::memory_order_relaxed);
+}
+
+/************************************************************************************
+ * Everything a client sees of the vector: its state, then each member's state, text
+ * or number as printed with the member's format.
+* ***********************************************************************************/
+void PropertyPublisher::snapshot(const Entry &entry, std::string &out)
+{
+    out.clear();
+
+    switch (entry.kind)
+    {
+        case KIND_SWITCH:
+        {
+            const ISwitchVectorProperty *svp = static_cast<const ISwitchVectorProperty *>(entry.vector);
+            out += static_cast<char>('0' + svp->s);
+            for (int i = 0; i < svp->nsp; i++)
+                out += static_cast<char>('0' + svp->sp[i].s);
+            break;
+        }
+
+        case KIND_NUMBER:
+        {
+            const INumberVectorProperty *nvp = static_cast<const INumberVectorProperty *>(entry.vector);
+            out += static_cast<char>('0' + nvp->s);
+            char value[MAXINDIFORMAT * 2];
+            for (int i = 0; i < nvp->nnp; i++)
+            {
+                numberFormat(value, nvp->np[i].format, nvp->np[i].value);
+                out += value;
+                out += '\n';
+            }
+            break;
+        }
+
+        case KIND_LIGHT:
+        {
+            const ILightVectorProperty *lvp = static_cast<const ILightVectorProperty *>(entry.vector);
+            out += static_cast<char>('0' + lvp->s);
+            for (int i = 0; i < lvp->nlp; i++)
+                out += static_cast<char>('0' + lvp->lp[i].s);
+            break;
+        }
+
+        case KIND_TEXT:
+        {
+            const ITextVectorProperty *tvp = static_cast<const ITextVectorProperty *>(entry.vector);
+            out += static_cast<char>('0' + tvp->s);
+            for (int i = 0; i < tvp->ntp; i++)
+            {
+                if (tvp->tp[i].text)
+                    out += tvp->tp[i].text;
+                out += '\0';
+            }
+            break;
+        }
+    }
+}
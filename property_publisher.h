@@ -0,0 +1,105 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Delta-only property updates. indiserver forwards every IDSet* to every
+ client, so a status property that is re-sent unchanged on each poll or relay
+ response costs one XML message per client for nothing.
+
+ Status vectors are queued here instead of being sent. The queue is flushed
+ once the current event loop callback returns, so the changes one callback
+ makes to a vector go out as one message, and a vector is only sent if it
+ differs from what was last sent for it: its state, switch and light states,
+ texts, or numbers as printed with their own format. Only vectors the driver
+ alone updates belong here. INDI::Dome sends its own vectors directly, and
+ replies to client requests must always be sent.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef PROPERTYPUBLISHER_H
+#define PROPERTYPUBLISHER_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <indiapi.h>
+
+class PropertyPublisher
+{
+    public:
+
+        PropertyPublisher();
+        ~PropertyPublisher();
+
+        /**
+         * @brief publish Queue the vector for the end of the current event loop callback.
+         * It is sent then if it differs from what was last sent for it.
+         */
+        void publish(ISwitchVectorProperty *svp);
+        void publish(INumberVectorProperty *nvp);
+        void publish(ILightVectorProperty *lvp);
+        void publish(ITextVectorProperty *tvp);
+
+        // Send right away even if unchanged, e.g. to answer a client. Drops a queued update.
+        void send(ISwitchVectorProperty *svp);
+
+        // Send everything queued now.
+        void flush();
+
+        /**
+         * @brief reset Forget what was sent and drop queued updates, when the vectors are
+         * deleted or defined again.
+         */
+        void reset();
+
+        // Updates sent, and updates suppressed as unchanged or merged into another
+        void setCounters(std::atomic<uint64_t> *sent, std::atomic<uint64_t> *suppressed);
+
+    private:
+
+        enum Kind { KIND_SWITCH, KIND_NUMBER, KIND_LIGHT, KIND_TEXT };
+
+        struct Entry
+        {
+            const void *vector;
+            Kind kind;
+            bool queued;
+            bool sent;
+            // What was last sent, see snapshot()
+            std::string last;
+        };
+
+        Entry &find(const void *vector, Kind kind);
+        void queue(const void *vector, Kind kind);
+        bool changed(Entry &entry);
+        void sendEntry(Entry &entry);
+        void count(std::atomic<uint64_t> *counter);
+        static void snapshot(const Entry &entry, std::string &out);
+        static void flushHelper(void *context);
+
+        // A handful of vectors per driver, searched linearly
+        std::vector<Entry> entries;
+        int flushTimerID;
+        std::string scratch;
+        std::atomic<uint64_t> *sentCounter;
+        std::atomic<uint64_t> *suppressedCounter;
+};
+
+#endif
@@ -0,0 +1,954 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Asynchronous DIN relay command executor.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "relay_executor.h"
+#include "relay_outlets.h"
+#include "roof_clock.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+static std::once_flag curlInitFlag;
+static MonotonicClock monotonic;
+
+/************************************************************************************
+ * Response arena: keep what fits, the relay status we need is near the top of the page.
+* ***********************************************************************************/
+size_t RelayExecutor::writeCallback(void *contents, size_t size, size_t nmemb, void *userp)
+{
+    Command *command = static_cast<Command *>(userp);
+    size_t length    = size * nmemb;
+    size_t room      = RESPONSE_SIZE - 1 - command->responseLength;
+    size_t copy      = (length < room) ? length : room;
+
+    memcpy(command->response + command->responseLength, contents, copy);
+    command->responseLength += copy;
+    command->response[command->responseLength] = 0;
+    return length;
+}
+
+void RelayExecutor::CommandList::pushBack(Command *command)
+{
+    command->next = nullptr;
+    if (tail)
+        tail->next = command;
+    else
+        head = command;
+    tail = command;
+}
+
+void RelayExecutor::CommandList::insertAfter(Command *position, Command *command)
+{
+    if (position == nullptr)
+    {
+        command->next = head;
+        head = command;
+        if (tail == nullptr)
+            tail = command;
+        return;
+    }
+
+    command->next  = position->next;
+    position->next = command;
+    if (tail == position)
+        tail = command;
+}
+
+RelayExecutor::Command *RelayExecutor::CommandList::popFront()
+{
+    Command *command = head;
+    if (command)
+    {
+        head = command->next;
+        if (head == nullptr)
+            tail = nullptr;
+        command->next = nullptr;
+    }
+    return command;
+}
+
+bool RelayExecutor::CommandList::remove(Command *command)
+{
+    Command *previous = nullptr;
+    for (Command *it = head; it; previous = it, it = it->next)
+    {
+        if (it != command)
+            continue;
+
+        if (previous)
+            previous->next = it->next;
+        else
+            head = it->next;
+        if (tail == it)
+            tail = previous;
+        it->next = nullptr;
+        return true;
+    }
+    return false;
+}
+
+void RelayExecutor::CommandList::append(CommandList &other)
+{
+    if (other.head == nullptr)
+        return;
+    if (tail)
+        tail->next = other.head;
+    else
+        head = other.head;
+    tail = other.tail;
+    other.head = other.tail = nullptr;
+}
+
+RelayExecutor::RelayExecutor() : multi(nullptr), running(false), nextID(1)
+{
+    eventPipe[0] = eventPipe[1] = -1;
+
+    for (int i = 0; i < POOL_SIZE; i++)
+    {
+        pool[i].hedgeHandle    = nullptr;
+        pool[i].hedgeTransport = nullptr;
+        freeList.pushBack(&pool[i]);
+    }
+
+    // curl_global_init is not thread safe, so do it once before any worker exists.
+    std::call_once(curlInitFlag, []() { curl_global_init(CURL_GLOBAL_ALL); });
+}
+
+RelayExecutor::~RelayExecutor()
+{
+    stop();
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+bool RelayExecutor::start()
+{
+    if (running)
+        return true;
+
+    if (pipe2(eventPipe, O_NONBLOCK | O_CLOEXEC) != 0)
+        return false;
+
+    multi = curl_multi_init();
+    if (multi == nullptr)
+    {
+        close(eventPipe[0]);
+        close(eventPipe[1]);
+        eventPipe[0] = eventPipe[1] = -1;
+        return false;
+    }
+
+    // One connection per relay is all we ever need.
+    curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, static_cast<long>(MAX_ENDPOINTS));
+
+    running = true;
+    worker = std::thread(&RelayExecutor::workerLoop, this);
+    return true;
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+void RelayExecutor::stop()
+{
+    if (running == false)
+        return;
+
+    running = false;
+    curl_multi_wakeup(multi);
+    worker.join();
+
+    // Anything left over is dropped. The INDI callback is gone by now so there is nobody
+    // to deliver completions to.
+    releaseAll();
+
+    curl_multi_cleanup(multi);
+    multi = nullptr;
+
+    close(eventPipe[0]);
+    close(eventPipe[1]);
+    eventPipe[0] = eventPipe[1] = -1;
+}
+
+void RelayExecutor::releaseAll()
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    for (int i = 0; i < MAX_ENDPOINTS; i++)
+    {
+        Session &session = sessions[i];
+        if (session.open == false)
+            continue;
+
+        if (session.active)
+        {
+            if (session.transport == nullptr)
+                curl_multi_remove_handle(multi, session.handle);
+            freeList.pushBack(session.active);
+            session.active = nullptr;
+        }
+        freeList.append(session.queue);
+        dropHedges(session);
+        cleanupSession(session);
+    }
+    freeList.append(completed);
+
+    for (int i = 0; i < POOL_SIZE; i++)
+        pool[i].callback = nullptr;
+
+    sessionClosed.notify_all();
+}
+
+void RelayExecutor::cleanupSession(Session &session)
+{
+    curl_easy_cleanup(session.handle);
+    session.handle = nullptr;
+    // Closes its connection, a command still in flight is abandoned.
+    delete session.transport;
+    session.transport = nullptr;
+    curl_slist_free_all(session.resolveList);
+    session.resolveList = nullptr;
+    session.observer    = nullptr;
+    session.open        = false;
+    session.closing     = false;
+}
+
+/************************************************************************************
+ * Lock held, worker thread or stopped executor.
+* ***********************************************************************************/
+void RelayExecutor::dropHedges(Session &session)
+{
+    while (Command *command = session.hedging.popFront())
+    {
+        if (command->hedgeHandle)
+        {
+            curl_multi_remove_handle(multi, command->hedgeHandle);
+            curl_easy_cleanup(command->hedgeHandle);
+        }
+        delete command->hedgeTransport;
+        command->hedgeHandle    = nullptr;
+        command->hedgeTransport = nullptr;
+        command->callback       = nullptr;
+        freeList.pushBack(command);
+    }
+    freeList.append(session.hedgeQueue);
+}
+
+void RelayExecutor::release(CommandList &commands)
+{
+    for (Command *command = commands.head; command; command = command->next)
+        command->callback = nullptr;
+
+    std::lock_guard<std::mutex> guard(lock);
+    freeList.append(commands);
+}
+
+/************************************************************************************
+ * The handle is set up here on the caller's thread, the worker only sees it once
+ * the session is marked open.
+* ***********************************************************************************/
+int RelayExecutor::openEndpoint(const Endpoint &endpoint)
+{
+    if (running == false)
+        return -1;
+
+    int index = -1;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (int i = 0; i < MAX_ENDPOINTS && index < 0; i++)
+        {
+            if (sessions[i].open == false && sessions[i].handle == nullptr && sessions[i].transport == nullptr)
+                index = i;
+        }
+    }
+    if (index < 0)
+        return -1;
+
+    Session &session = sessions[index];
+    session.timeoutMs.store(endpoint.timeoutMs);
+
+    if (endpoint.transport != RelayTransport::TRANSPORT_HTTP)
+    {
+        RelayTransport *transport = RelayTransport::create(endpoint.transport);
+        if (transport == nullptr)
+            return -1;
+        transport->setAddress(endpoint.host, endpoint.pinnedIP);
+        // Commands keep their bare path
+        session.baseURL.clear();
+
+        std::lock_guard<std::mutex> guard(lock);
+        session.transport = transport;
+        session.open      = true;
+        return index;
+    }
+
+    CURL *handle = curl_easy_init();
+    if (handle == nullptr)
+        return -1;
+
+    session.baseURL = "http://" + endpoint.host;
+
+    curl_easy_setopt(handle, CURLOPT_PRIVATE, &session);
+    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, writeCallback);
+    curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(handle, CURLOPT_TCP_NODELAY, 1L);
+    curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(handle, CURLOPT_TCP_KEEPIDLE, 30L);
+    curl_easy_setopt(handle, CURLOPT_TCP_KEEPINTVL, 15L);
+    // Relay address does not change while we are connected, cache it forever.
+    curl_easy_setopt(handle, CURLOPT_DNS_CACHE_TIMEOUT, -1L);
+
+    if (endpoint.username.empty() == false)
+    {
+        curl_easy_setopt(handle, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
+        curl_easy_setopt(handle, CURLOPT_USERNAME, endpoint.username.c_str());
+        curl_easy_setopt(handle, CURLOPT_PASSWORD, endpoint.password.c_str());
+    }
+
+    if (endpoint.pinnedIP.empty() == false)
+    {
+        std::string host = endpoint.host, port = "80";
+        size_t colon = host.find(':');
+        if (colon != std::string::npos)
+        {
+            port = host.substr(colon + 1);
+            host = host.substr(0, colon);
+        }
+        std::string entry = host + ":" + port + ":" + endpoint.pinnedIP;
+        session.resolveList = curl_slist_append(nullptr, entry.c_str());
+        curl_easy_setopt(handle, CURLOPT_RESOLVE, session.resolveList);
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    session.handle = handle;
+    session.open   = true;
+    return index;
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+void RelayExecutor::closeEndpoint(int endpoint)
+{
+    if (endpoint < 0 || endpoint >= MAX_ENDPOINTS)
+        return;
+
+    Session &session = sessions[endpoint];
+    CommandList dropped, kept;
+
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        if (session.open == false || session.closing)
+            return;
+
+        dropped.append(session.queue);
+        dropped.append(session.hedgeQueue);
+
+        // Completions not dispatched yet belong to a roof that is going away.
+        while (Command *command = completed.popFront())
+        {
+            if (command->endpoint == endpoint)
+                dropped.pushBack(command);
+            else
+                kept.pushBack(command);
+        }
+        completed.append(kept);
+
+        // The worker owns the handle while a request is in flight.
+        session.closing = true;
+        curl_multi_wakeup(multi);
+        sessionClosed.wait(guard, [&session]() { return session.open == false; });
+    }
+
+    release(dropped);
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+void RelayExecutor::setObserver(int endpoint, const Callback &callback)
+{
+    if (endpoint < 0 || endpoint >= MAX_ENDPOINTS)
+        return;
+
+    std::lock_guard<std::mutex> guard(lock);
+    sessions[endpoint].observer = callback;
+}
+
+void RelayExecutor::setTimeout(int endpoint, long timeoutMs)
+{
+    if (endpoint >= 0 && endpoint < MAX_ENDPOINTS)
+        sessions[endpoint].timeoutMs.store(timeoutMs);
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+uint32_t RelayExecutor::submit(int endpoint, const char *path, Priority priority, const Callback &callback, uint32_t tag)
+{
+    if (running == false || endpoint < 0 || endpoint >= MAX_ENDPOINTS)
+        return 0;
+
+    Session &session = sessions[endpoint];
+    Command *command = nullptr;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (session.open == false || session.closing)
+            return 0;
+        command = freeList.popFront();
+        if (command == nullptr)
+            return 0;
+        command->id = nextID++;
+        if (nextID == 0)
+            nextID = 1;
+    }
+
+    command->endpoint       = endpoint;
+    command->priority       = priority;
+    command->tag            = tag;
+    command->callback       = callback;
+    command->responseLength = 0;
+    command->response[0]    = 0;
+    command->sent           = 0;
+    command->hedgeHandle    = nullptr;
+    command->hedgeTransport = nullptr;
+    command->submitted      = std::chrono::steady_clock::now();
+    snprintf(command->url, URL_SIZE, "%s%s", session.baseURL.c_str(), path);
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        if (priority == PRIORITY_HEDGE)
+            session.hedgeQueue.pushBack(command);
+        else if (priority == PRIORITY_URGENT)
+        {
+            // Urgent commands keep FIFO order among themselves but go before any normal command.
+            Command *position = nullptr;
+            for (Command *it = session.queue.head; it && it->priority == PRIORITY_URGENT; it = it->next)
+                position = it;
+            session.queue.insertAfter(position, command);
+        }
+        else
+            session.queue.pushBack(command);
+    }
+
+    uint32_t id = command->id;
+    curl_multi_wakeup(multi);
+    return id;
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+int RelayExecutor::cancelPending(int endpoint)
+{
+    if (endpoint < 0 || endpoint >= MAX_ENDPOINTS)
+        return 0;
+
+    CommandList dropped;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        dropped.append(sessions[endpoint].queue);
+    }
+
+    int count = 0;
+    while (Command *command = dropped.popFront())
+    {
+        postCompletion(command, CURLE_OK, true, "cancelled");
+        count++;
+    }
+
+    return count;
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+uint32_t RelayExecutor::warmUp(int endpoint, const Callback &callback)
+{
+    return submit(endpoint, "/", PRIORITY_NORMAL, callback);
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+void RelayExecutor::dispatchCompletions()
+{
+    char drain[64];
+    while (read(eventPipe[0], drain, sizeof(drain)) > 0)
+        ;
+
+    CommandList ready;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        ready.append(completed);
+        // cleanupSession() and setObserver() change the observer under the lock, so take a copy here.
+        for (Command *command = ready.head; command; command = command->next)
+            command->observer = sessions[command->endpoint].observer;
+    }
+
+    for (Command *command = ready.head; command; command = command->next)
+    {
+        if (command->observer)
+            command->observer(command->result);
+        if (command->callback)
+            command->callback(command->result);
+        command->observer = nullptr;
+        command->callback = nullptr;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    freeList.append(ready);
+}
+
+/************************************************************************************
+ * Worker thread. Only one command per relay is in flight at a time: each relay must
+ * see OPEN/CLOSE and STOP in the order we decided them.
+* ***********************************************************************************/
+void RelayExecutor::workerLoop()
+{
+    while (running)
+    {
+        Command *starting[MAX_ENDPOINTS];
+        int startCount = 0;
+        CommandList hedges;
+        bool closed = false;
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            for (int i = 0; i < MAX_ENDPOINTS; i++)
+            {
+                Session &session = sessions[i];
+                if (session.open == false)
+                    continue;
+
+                if (session.closing)
+                {
+                    if (session.active)
+                    {
+                        if (session.transport == nullptr)
+                            curl_multi_remove_handle(multi, session.handle);
+                        session.active->callback = nullptr;
+                        freeList.pushBack(session.active);
+                        session.active = nullptr;
+                    }
+                    dropHedges(session);
+                    cleanupSession(session);
+                    closed = true;
+                    continue;
+                }
+
+                if (session.active == nullptr && session.queue.empty() == false)
+                {
+                    session.active = session.queue.popFront();
+                    starting[startCount++] = session.active;
+                }
+
+                hedges.append(session.hedgeQueue);
+            }
+        }
+
+        if (closed)
+            sessionClosed.notify_all();
+
+        for (int i = 0; i < startCount; i++)
+        {
+            Command *next = starting[i];
+            if (startCommand(next))
+                continue;
+
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                sessions[next->endpoint].active = nullptr;
+            }
+
+            next->sent = 0;
+            postCompletion(next, CURLE_FAILED_INIT, false, "Failed to queue relay request");
+        }
+
+        while (Command *hedge = hedges.popFront())
+        {
+            if (startHedge(hedge))
+                continue;
+
+            hedge->sent = 0;
+            postCompletion(hedge, CURLE_FAILED_INIT, false, "Failed to queue relay request");
+        }
+
+        int stillRunning = 0;
+        curl_multi_perform(multi, &stillRunning);
+
+        bool finished = false;
+        CURLMsg *msg = nullptr;
+        int msgsLeft = 0;
+        while ((msg = curl_multi_info_read(multi, &msgsLeft)))
+        {
+            if (msg->msg == CURLMSG_DONE)
+            {
+                Session *session = nullptr;
+                curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, reinterpret_cast<char **>(&session));
+                if (msg->easy_handle == session->handle)
+                    finishCommand(session, msg->data.result);
+                else
+                    finishHedge(session, msg->easy_handle, msg->data.result);
+                finished = true;
+            }
+        }
+
+        struct curl_waitfd waits[MAX_ENDPOINTS + POOL_SIZE];
+        int waitCount = 0, timeoutMs = 1000;
+        if (driveTransfers(waits, waitCount, timeoutMs))
+            finished = true;
+
+        // Go straight to the next queued command instead of sleeping in poll
+        if (finished)
+            continue;
+
+        curl_multi_poll(multi, waits, waitCount, timeoutMs, nullptr);
+    }
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+bool RelayExecutor::startCommand(Command *command)
+{
+    Session &session = sessions[command->endpoint];
+    if (session.transport)
+    {
+        command->sent = monotonic.now();
+        beginTransfer(command, session.transport);
+        return true;
+    }
+
+    CURL *handle = session.handle;
+    curl_easy_setopt(handle, CURLOPT_URL, command->url);
+    curl_easy_setopt(handle, CURLOPT_WRITEDATA, command);
+    curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS, session.timeoutMs.load());
+    command->sent = monotonic.now();
+    return (curl_multi_add_handle(multi, handle) == CURLM_OK);
+}
+
+/************************************************************************************
+ * A copy of the session handle with its address, credentials and deadline, forced
+ * onto a new connection: the session's own may be the one that hangs.
+* ***********************************************************************************/
+bool RelayExecutor::startHedge(Command *command)
+{
+    Session &session = sessions[command->endpoint];
+    if (session.transport)
+    {
+        RelayTransport *transport = RelayTransport::create(session.transport->getType());
+        if (transport == nullptr)
+            return false;
+        transport->setAddress(*session.transport);
+
+        command->hedgeTransport = transport;
+        command->sent = monotonic.now();
+        beginTransfer(command, transport);
+
+        std::lock_guard<std::mutex> guard(lock);
+        session.hedging.pushBack(command);
+        return true;
+    }
+
+    CURL *handle = curl_easy_duphandle(session.handle);
+    if (handle == nullptr)
+        return false;
+
+    curl_easy_setopt(handle, CURLOPT_URL, command->url);
+    curl_easy_setopt(handle, CURLOPT_WRITEDATA, command);
+    curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS, session.timeoutMs.load());
+    curl_easy_setopt(handle, CURLOPT_FRESH_CONNECT, 1L);
+    curl_easy_setopt(handle, CURLOPT_FORBID_REUSE, 1L);
+    command->sent = monotonic.now();
+
+    if (curl_multi_add_handle(multi, handle) != CURLM_OK)
+    {
+        curl_easy_cleanup(handle);
+        return false;
+    }
+
+    command->hedgeHandle = handle;
+    std::lock_guard<std::mutex> guard(lock);
+    session.hedging.pushBack(command);
+    return true;
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+void RelayExecutor::finishCommand(Session *session, CURLcode code)
+{
+    Command *command = nullptr;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        command = session->active;
+        session->active = nullptr;
+    }
+
+    if (command == nullptr)
+        return;
+
+    fillTiming(command, session->handle);
+
+    // The connection stays in the multi connection cache for the next command.
+    curl_multi_remove_handle(multi, session->handle);
+
+    code = checkStatus(code, command->result.httpCode);
+    postCompletion(command, code, false, (code == CURLE_OK) ? "" : curl_easy_strerror(code));
+}
+
+void RelayExecutor::finishHedge(Session *session, CURL *handle, CURLcode code)
+{
+    Command *command = nullptr;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (Command *it = session->hedging.head; it && command == nullptr; it = it->next)
+            if (it->hedgeHandle == handle)
+                command = it;
+        if (command)
+            session->hedging.remove(command);
+    }
+
+    curl_multi_remove_handle(multi, handle);
+    if (command == nullptr)
+    {
+        curl_easy_cleanup(handle);
+        return;
+    }
+
+    fillTiming(command, handle);
+    curl_easy_cleanup(handle);
+    command->hedgeHandle = nullptr;
+
+    code = checkStatus(code, command->result.httpCode);
+    postCompletion(command, code, false, (code == CURLE_OK) ? "" : curl_easy_strerror(code));
+}
+
+/************************************************************************************
+ * A relay that answers with an error status (bad credentials, a busy or broken relay)
+ * switched nothing. Only a 2xx confirms an HTTP command.
+* ***********************************************************************************/
+CURLcode RelayExecutor::checkStatus(CURLcode code, long httpCode)
+{
+    if (code == CURLE_OK && (httpCode < 200 || httpCode >= 300))
+        return CURLE_HTTP_RETURNED_ERROR;
+    return code;
+}
+
+/************************************************************************************
+ * Transports take the outlet changes of an /outlet query, anything else reads the state.
+* ***********************************************************************************/
+void RelayExecutor::beginTransfer(Command *command, RelayTransport *transport)
+{
+    uint8_t setMask = 0, clearMask = 0;
+    if (strncmp(command->url, "/outlet?", 8) == 0)
+        RelayOutlets::parseQuery(command->url + 8, setMask, clearMask);
+    transport->begin(setMask, clearMask);
+}
+
+/************************************************************************************
+ * Advance every transport command in flight, complete the finished and expired ones,
+ * and list the sockets the others wait on for the next poll.
+* ***********************************************************************************/
+bool RelayExecutor::driveTransfers(struct curl_waitfd *waits, int &waitCount, int &timeoutMs)
+{
+    struct Transfer
+    {
+        Session *session;
+        Command *command;
+        RelayTransport *transport;
+    };
+    Transfer transfers[MAX_ENDPOINTS + POOL_SIZE];
+    int count = 0;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (int i = 0; i < MAX_ENDPOINTS; i++)
+        {
+            Session &session = sessions[i];
+            if (session.open == false || session.closing || session.transport == nullptr)
+                continue;
+
+            if (session.active)
+                transfers[count++] = { &session, session.active, session.transport };
+            for (Command *it = session.hedging.head; it; it = it->next)
+                transfers[count++] = { &session, it, it->hedgeTransport };
+        }
+    }
+
+    bool finished = false;
+    uint64_t now = monotonic.now();
+
+    for (int i = 0; i < count; i++)
+    {
+        Transfer &transfer = transfers[i];
+        RelayTransport::Status status = transfer.transport->advance();
+
+        bool timedOut = false;
+        long deadline = transfer.session->timeoutMs.load();
+        if (status == RelayTransport::STATUS_PENDING && deadline > 0)
+        {
+            uint64_t due = transfer.command->sent + deadline * 1000000ULL;
+            if (now >= due)
+            {
+                // A late reply must not be taken for the next command.
+                transfer.transport->disconnect();
+                status   = RelayTransport::STATUS_FAILED;
+                timedOut = true;
+            }
+            else
+                timeoutMs = std::min(timeoutMs, static_cast<int>((due - now) / 1000000) + 1);
+        }
+
+        if (status == RelayTransport::STATUS_PENDING)
+        {
+            waits[waitCount].fd      = transfer.transport->getFD();
+            waits[waitCount].events  = (transfer.transport->getEvents() & POLLOUT) ? CURL_WAIT_POLLOUT : CURL_WAIT_POLLIN;
+            waits[waitCount].revents = 0;
+            waitCount++;
+            continue;
+        }
+
+        finishTransfer(transfer.session, transfer.command, transfer.transport, status, timedOut);
+        finished = true;
+    }
+
+    return finished;
+}
+
+void RelayExecutor::finishTransfer(Session *session, Command *command, RelayTransport *transport, RelayTransport::Status status,
+                                   bool timedOut)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (command == session->active)
+            session->active = nullptr;
+        else
+            session->hedging.remove(command);
+    }
+
+    fillTiming(command, nullptr);
+
+    CURLcode code = CURLE_OK;
+    const char *error = "";
+    if (status == RelayTransport::STATUS_DONE)
+        command->responseLength = snprintf(command->response, RESPONSE_SIZE, "%s", transport->getResponse());
+    else if (timedOut)
+    {
+        code  = CURLE_OPERATION_TIMEDOUT;
+        error = "Timeout was reached";
+    }
+    else
+    {
+        code  = static_cast<CURLcode>(transport->getErrorCode());
+        error = transport->getError();
+    }
+
+    // Hedges never reuse their connection.
+    if (command->hedgeTransport)
+    {
+        delete command->hedgeTransport;
+        command->hedgeTransport = nullptr;
+    }
+
+    postCompletion(command, code, false, error);
+}
+
+/************************************************************************************
+ * Without a curl handle the round trip is taken from the send time.
+* ***********************************************************************************/
+void RelayExecutor::fillTiming(Command *command, CURL *handle)
+{
+    Result &result = command->result;
+    result.responseTime = monotonic.now();
+    result.sentTime  = command->sent;
+    result.latency   = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - command->submitted).count();
+    result.rtt       = (result.responseTime - command->sent) / 1e6;
+    result.httpCode  = 0;
+    if (handle == nullptr)
+        return;
+
+    curl_off_t totalTime = 0;
+    curl_easy_getinfo(handle, CURLINFO_TOTAL_TIME_T, &totalTime);
+    result.rtt = totalTime / 1000.0;
+    curl_easy_getinfo(handle, CURLINFO_RESPONSE_CODE, &result.httpCode);
+}
+
+/************************************************************************************
+ * Fill in the common result fields and hand the command to the INDI thread.
+* ***********************************************************************************/
+void RelayExecutor::postCompletion(Command *command, CURLcode code, bool cancelled, const char *error)
+{
+    bool success = (code == CURLE_OK && cancelled == false);
+
+    Result &result = command->result;
+    result.id             = command->id;
+    result.success        = success;
+    result.cancelled      = cancelled;
+    result.tag            = command->tag;
+    result.response       = command->response;
+    result.responseLength = command->responseLength;
+    result.error          = error;
+    result.errorCode      = code;
+
+    if (success == false)
+    {
+        // An error status is kept for the black box.
+        if (code != CURLE_HTTP_RETURNED_ERROR)
+            result.httpCode = 0;
+        if (command->sent == 0)
+        {
+            result.latency  = 0;
+            result.rtt      = 0;
+            result.sentTime = result.responseTime = 0;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        // Finished while its endpoint was being closed, nobody is waiting for it any more.
+        const Session &session = sessions[command->endpoint];
+        if (session.open == false || session.closing)
+        {
+            command->callback = nullptr;
+            freeList.pushBack(command);
+            return;
+        }
+
+        completed.pushBack(command);
+    }
+
+    if (write(eventPipe[1], "x", 1) < 0)
+    {
+        // Pipe full means the INDI thread has not drained it yet and will pick this up anyway.
+    }
+}
@@ -0,0 +1,287 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Asynchronous DIN relay command executor. Relay commands are queued and
+ executed on a dedicated worker thread using the curl multi interface so
+ that a slow or hung relay never blocks the INDI event loop. Completions
+ are handed back to the INDI thread through a notification pipe.
+
+ One executor serves every roof of the process. Each relay is an endpoint with
+ its own long-lived curl handle and command queue, and all of them are driven
+ by the same worker thread and curl multi handle. Commands to one relay run
+ strictly in order, different relays run concurrently. Connections are kept
+ alive, DNS is resolved once (or pinned to a fixed IP) and each session is
+ warmed up at connect so the first STOP does not pay for a TCP handshake.
+ Every command has a deadline, so a dead relay fails it instead of holding up
+ the session for the OS TCP timeout. Hedge commands bypass the session queue
+ on a connection of their own, so a duplicate STOP is not stuck behind the one
+ it duplicates.
+
+ Relays that speak Modbus-TCP or the line protocol are driven through a
+ RelayTransport instead of curl, on the same worker: their sockets are polled
+ together with curl's, and the queueing, deadlines and hedging are the same.
+
+ Commands live in a fixed pool with their URL and response buffers, and are
+ moved between the free, queued and completed lists without allocating.
+ Callbacks stay allocation-free as long as their captures fit in two pointers.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef RELAYEXECUTOR_H
+#define RELAYEXECUTOR_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <curl/curl.h>
+
+#include "relay_transport.h"
+
+class RelayExecutor
+{
+    public:
+
+        enum Priority
+        {
+            // Executed in submission order
+            PRIORITY_NORMAL,
+            // Jumps ahead of all queued normal commands (e.g. STOP)
+            PRIORITY_URGENT,
+            // Sent at once on a fresh connection of its own, alongside whatever the session
+            // is busy with. For duplicate STOPs when the session does not answer.
+            PRIORITY_HEDGE
+        };
+
+        struct Endpoint
+        {
+            // Protocol spoken by the relay
+            RelayTransport::Type transport = RelayTransport::TRANSPORT_HTTP;
+            // Host name or IP address of the relay, optionally with :port
+            std::string host;
+            std::string username;
+            std::string password;
+            // If set, host is resolved to this address without any DNS lookup
+            std::string pinnedIP;
+            // Deadline of every command from send to response in ms, resolving and connecting
+            // included. 0 waits as long as the OS does.
+            long timeoutMs = 0;
+        };
+
+        struct Result
+        {
+            uint32_t id;
+            // Transfer completed and, over HTTP, the relay answered with a 2xx status
+            bool success;
+            // Command was dropped from the queue before it was sent
+            bool cancelled;
+            long httpCode;
+            // Submission to completion in milliseconds
+            double latency;
+            // Request round-trip on the wire in milliseconds
+            double rtt;
+            // Monotonic nanoseconds when the request went out and when the response arrived, 0 if never sent
+            uint64_t sentTime;
+            uint64_t responseTime;
+            // Value passed to submit()
+            uint32_t tag;
+            // Response body, truncated to RESPONSE_SIZE. Only valid during the callback.
+            const char *response;
+            size_t responseLength;
+            // Static error description, empty on success
+            const char *error;
+            // CURLcode of the failed transfer, CURLE_OK on success or if it was never sent.
+            // CURLE_HTTP_RETURNED_ERROR for a non-2xx status, which is kept in httpCode.
+            // Other transports report the nearest CURLcode, and httpCode 0.
+            int errorCode;
+        };
+
+        // Invoked on the INDI thread from dispatchCompletions()
+        typedef std::function<void(const Result &)> Callback;
+
+        static const int MAX_ENDPOINTS = 8;
+        // Shared by all endpoints
+        static const int POOL_SIZE     = 32;
+        static const int URL_SIZE      = 256;
+        static const int RESPONSE_SIZE = 16384;
+
+        RelayExecutor();
+        ~RelayExecutor();
+
+        /**
+         * @brief start Start the worker thread. Relays are added with openEndpoint().
+         */
+        bool start();
+        /**
+         * @brief stop Stop the worker and close all endpoints. Undelivered completions are dropped.
+         */
+        void stop();
+        bool isRunning() const { return running; }
+
+        /**
+         * @brief openEndpoint Open a session to a relay.
+         * @param endpoint relay address and credentials, fixed for the life of the session.
+         * @return endpoint handle, -1 if all MAX_ENDPOINTS are in use.
+         */
+        int openEndpoint(const Endpoint &endpoint);
+
+        /**
+         * @brief closeEndpoint Close a relay session. Queued and undelivered commands are
+         * dropped without invoking their callbacks. Waits for an in-flight request to be removed.
+         */
+        void closeEndpoint(int endpoint);
+
+        /**
+         * @brief submit Queue an HTTP GET to a relay.
+         * @param path request path including query, e.g. /outlet?a=OFF. Other transports send
+         * the outlet changes of an /outlet query and read the outlet state for any other path.
+         * @param tag returned in the result for the observer.
+         * @return command id, or 0 if the endpoint is not open or all POOL_SIZE commands are in use.
+         */
+        uint32_t submit(int endpoint, const char *path, Priority priority, const Callback &callback, uint32_t tag = 0);
+
+        /**
+         * @brief setObserver Invoked for every completed command of the endpoint before its own callback.
+         */
+        void setObserver(int endpoint, const Callback &callback);
+
+        /**
+         * @brief setTimeout Change the command deadline of an endpoint. Applies to commands sent from now on.
+         */
+        void setTimeout(int endpoint, long timeoutMs);
+
+        /**
+         * @brief warmUp Fetch the relay root page to resolve the host, open the
+         * keep-alive connection and authenticate ahead of the first real command.
+         */
+        uint32_t warmUp(int endpoint, const Callback &callback);
+
+        /**
+         * @brief cancelPending Drop all queued commands of the endpoint that were not sent
+         * yet. Their callbacks are invoked with cancelled set.
+         * @return number of dropped commands.
+         */
+        int cancelPending(int endpoint);
+
+        /**
+         * @brief getEventFD File descriptor that becomes readable when completions are
+         * ready. Register it with IEAddCallback and call dispatchCompletions() from there.
+         */
+        int getEventFD() const { return eventPipe[0]; }
+
+        void dispatchCompletions();
+
+    private:
+
+        struct Command
+        {
+            uint32_t id;
+            int endpoint;
+            Priority priority;
+            uint32_t tag;
+            char url[URL_SIZE];
+            Callback callback;
+            // Session observer copied when the command is dispatched
+            Callback observer;
+            char response[RESPONSE_SIZE];
+            size_t responseLength;
+            std::chrono::steady_clock::time_point submitted;
+            uint64_t sent;
+            // Own handle or transport of a hedge command while it is in flight
+            CURL *hedgeHandle;
+            RelayTransport *hedgeTransport;
+            Result result;
+            // Intrusive link in the free, queued or completed list
+            Command *next;
+        };
+
+        struct CommandList
+        {
+            Command *head = nullptr;
+            Command *tail = nullptr;
+
+            bool empty() const { return head == nullptr; }
+            void pushBack(Command *command);
+            void insertAfter(Command *position, Command *command);
+            Command *popFront();
+            void append(CommandList &other);
+            bool remove(Command *command);
+        };
+
+        struct Session
+        {
+            bool open = false;
+            // closeEndpoint() is waiting for the worker to remove the handle
+            bool closing = false;
+            // Reused for every command so connection and DNS state survive between commands
+            CURL *handle = nullptr;
+            // Instead of handle for relays that do not speak HTTP
+            RelayTransport *transport = nullptr;
+            struct curl_slist *resolveList = nullptr;
+            std::string baseURL;
+            CommandList queue;
+            Command *active = nullptr;
+            // Hedge commands waiting for the worker, and in flight on their own handles
+            CommandList hedgeQueue;
+            CommandList hedging;
+            Callback observer;
+            std::atomic<long> timeoutMs { 0 };
+        };
+
+        static size_t writeCallback(void *contents, size_t size, size_t nmemb, void *userp);
+
+        void workerLoop();
+        bool startCommand(Command *command);
+        bool startHedge(Command *command);
+        void finishCommand(Session *session, CURLcode code);
+        void finishHedge(Session *session, CURL *handle, CURLcode code);
+        void beginTransfer(Command *command, RelayTransport *transport);
+        bool driveTransfers(struct curl_waitfd *waits, int &waitCount, int &timeoutMs);
+        void finishTransfer(Session *session, Command *command, RelayTransport *transport, RelayTransport::Status status,
+                            bool timedOut);
+        void fillTiming(Command *command, CURL *handle);
+        static CURLcode checkStatus(CURLcode code, long httpCode);
+        void dropHedges(Session &session);
+        void postCompletion(Command *command, CURLcode code, bool cancelled, const char *error);
+        void cleanupSession(Session &session);
+        void release(CommandList &commands);
+        void releaseAll();
+
+        CURLM *multi;
+        std::thread worker;
+        std::atomic<bool> running;
+
+        // Guards the lists and the open, closing and active fields of the sessions
+        std::mutex lock;
+        std::condition_variable sessionClosed;
+        Session sessions[MAX_ENDPOINTS];
+        Command pool[POOL_SIZE];
+        CommandList freeList;
+        CommandList completed;
+
+        uint32_t nextID;
+        int eventPipe[2];
+};
+
+#endif
@@ -0,0 +1,86 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Relay reachability.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "relay_health.h"
+
+RelayHealth::RelayHealth(int failureLimit) : failureLimit(failureLimit > 0 ? failureLimit : 1)
+{
+    reset();
+}
+
+void RelayHealth::setFailureLimit(int failures)
+{
+    failureLimit = failures > 0 ? failures : 1;
+
+    // Takes effect on the current streak as well.
+    if (this->failures >= failureLimit)
+        setState(STATE_UNREACHABLE);
+    else if (this->failures > 0)
+        setState(STATE_DEGRADED);
+}
+
+void RelayHealth::reset()
+{
+    state        = STATE_UNKNOWN;
+    failures     = 0;
+    lastSuccess  = 0;
+    lastActivity = 0;
+}
+
+bool RelayHealth::success(uint64_t now)
+{
+    failures     = 0;
+    lastSuccess  = now;
+    lastActivity = now;
+    return setState(STATE_READY);
+}
+
+bool RelayHealth::failure(uint64_t now)
+{
+    failures++;
+    lastActivity = now;
+    return setState(failures >= failureLimit ? STATE_UNREACHABLE : STATE_DEGRADED);
+}
+
+bool RelayHealth::setState(State next)
+{
+    if (next == state)
+        return false;
+    state = next;
+    return true;
+}
+
+const char *RelayHealth::getStateName(State state)
+{
+    switch (state)
+    {
+        case STATE_UNKNOWN:
+            return "unknown";
+        case STATE_READY:
+            return "ready";
+        case STATE_DEGRADED:
+            return "degraded";
+        case STATE_UNREACHABLE:
+            return "unreachable";
+    }
+    return "invalid";
+}
@@ -0,0 +1,82 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Relay reachability. Every completed relay command, whether it moved the roof,
+ refreshed the outlets or only probed an idle relay, tells whether the relay
+ answers. The verdict is cached here so a motion request can be refused at
+ once when the relay is known to be gone, instead of finding out from a
+ command deadline while the weather turns.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef RELAYHEALTH_H
+#define RELAYHEALTH_H
+
+#include <stdint.h>
+
+class RelayHealth
+{
+    public:
+
+        enum State
+        {
+            // Nothing completed since the last reset
+            STATE_UNKNOWN,
+            STATE_READY,
+            // The last command failed, fewer than the failure limit in a row
+            STATE_DEGRADED,
+            STATE_UNREACHABLE
+        };
+
+        explicit RelayHealth(int failureLimit = 2);
+
+        // Failures in a row that make the relay unreachable
+        void setFailureLimit(int failures);
+
+        void reset();
+
+        /**
+         * @brief success/failure Record the outcome of a relay command completed at now.
+         * @return true if the state changed.
+         */
+        bool success(uint64_t now);
+        bool failure(uint64_t now);
+
+        State getState() const { return state; }
+        // A motion command is worth sending
+        bool isReady() const { return state == STATE_READY || state == STATE_DEGRADED; }
+
+        int getFailures() const { return failures; }
+        // Monotonic ns of the last answer, 0 if none
+        uint64_t getLastSuccess() const { return lastSuccess; }
+        // Monotonic ns of the last completed command, answered or not
+        uint64_t getLastActivity() const { return lastActivity; }
+
+        static const char *getStateName(State state);
+
+    private:
+        bool setState(State next);
+
+        State state;
+        int failures;
+        int failureLimit;
+        uint64_t lastSuccess;
+        uint64_t lastActivity;
+};
+
+#endif
@@ -0,0 +1,174 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Modbus-TCP relay transport.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "relay_transport.h"
+
+#ifdef HAVE_MODBUS
+
+#include <errno.h>
+#include <stdio.h>
+
+#include <curl/curl.h>
+#include <modbus.h>
+
+#define MODBUS_UNIT              1
+#define READ_COILS               0x01
+#define WRITE_MULTIPLE_COILS     0x0F
+#define EXCEPTION_FLAG           0x80
+// Only bounds reading the rest of a reply that already started to arrive
+#define REPLY_TIMEOUT_US         200000
+
+ModbusTransport::ModbusTransport() : RelayTransport(TRANSPORT_MODBUS, SOCK_STREAM), remaining(0), function(0)
+{
+    // The context never connects by itself, it is handed our socket once connected.
+    context = modbus_new_tcp(nullptr, getDefaultPort(TRANSPORT_MODBUS));
+    if (context == nullptr)
+        return;
+
+    modbus_set_slave(context, MODBUS_UNIT);
+#if LIBMODBUS_VERSION_CHECK(3, 1, 0)
+    modbus_set_response_timeout(context, 0, REPLY_TIMEOUT_US);
+    modbus_set_byte_timeout(context, 0, REPLY_TIMEOUT_US);
+#else
+    struct timeval timeout;
+    timeout.tv_sec  = 0;
+    timeout.tv_usec = REPLY_TIMEOUT_US;
+    modbus_set_response_timeout(context, &timeout);
+    modbus_set_byte_timeout(context, &timeout);
+#endif
+}
+
+ModbusTransport::~ModbusTransport()
+{
+    if (context)
+    {
+        modbus_set_socket(context, -1);
+        modbus_free(context);
+    }
+}
+
+void ModbusTransport::connected()
+{
+    if (context)
+        modbus_set_socket(context, fd);
+}
+
+void ModbusTransport::disconnecting()
+{
+    if (context)
+        modbus_set_socket(context, -1);
+}
+
+/************************************************************************************
+ * Both masks empty reads coils 0-7, otherwise the changed outlets are written one
+ * contiguous run at a time, each run in one Write Multiple Coils.
+* ***********************************************************************************/
+bool ModbusTransport::sendRequest()
+{
+    if (context == nullptr)
+        return false;
+
+    remaining = setMask | clearMask;
+    return sendNext();
+}
+
+bool ModbusTransport::sendNext()
+{
+    uint8_t request[8];
+    int length = 0;
+
+    if (remaining == 0)
+    {
+        function   = READ_COILS;
+        request[0] = MODBUS_UNIT;
+        request[1] = READ_COILS;
+        request[2] = 0;
+        request[3] = 0;
+        request[4] = 0;
+        request[5] = 8;
+        length     = 6;
+    }
+    else
+    {
+        int first = 0;
+        while ((remaining & (1 << first)) == 0)
+            first++;
+        int count = 0;
+        while (first + count < 8 && (remaining & (1 << (first + count))))
+            count++;
+
+        uint8_t run = static_cast<uint8_t>(((1 << count) - 1) << first);
+        remaining &= ~run;
+
+        function   = WRITE_MULTIPLE_COILS;
+        request[0] = MODBUS_UNIT;
+        request[1] = WRITE_MULTIPLE_COILS;
+        request[2] = 0;
+        request[3] = static_cast<uint8_t>(first);
+        request[4] = 0;
+        request[5] = static_cast<uint8_t>(count);
+        request[6] = 1;
+        request[7] = static_cast<uint8_t>((setMask & run) >> first);
+        length     = 8;
+    }
+
+    return modbus_send_raw_request(context, request, length) > 0;
+}
+
+RelayTransport::Status ModbusTransport::receiveResponse()
+{
+    uint8_t reply[MODBUS_TCP_MAX_ADU_LENGTH];
+    int length = modbus_receive_confirmation(context, reply);
+
+    if (length < 0)
+    {
+        if (errno == ECONNRESET)
+            return fail(CURLE_GOT_NOTHING, "Relay closed the connection");
+        return fail(CURLE_RECV_ERROR, "Failed to receive the Modbus reply");
+    }
+
+    int offset = modbus_get_header_length(context);
+    if (length < offset + 2)
+        return fail(CURLE_WEIRD_SERVER_REPLY, "Malformed Modbus reply");
+    if (reply[offset] & EXCEPTION_FLAG)
+        return fail(CURLE_HTTP_RETURNED_ERROR, "Relay answered with a Modbus exception");
+    if (reply[offset] != function)
+        return fail(CURLE_WEIRD_SERVER_REPLY, "Unexpected Modbus reply");
+
+    if (function == READ_COILS)
+    {
+        if (length < offset + 3)
+            return fail(CURLE_WEIRD_SERVER_REPLY, "Malformed Modbus reply");
+        snprintf(response, RESPONSE_SIZE, "state=%02x", reply[offset + 2]);
+        return STATUS_DONE;
+    }
+
+    if (remaining == 0)
+        return STATUS_DONE;
+
+    // Next run of outlets
+    if (sendNext() == false)
+        return fail(CURLE_SEND_ERROR, "Failed to send the relay command");
+    return STATUS_PENDING;
+}
+
+#endif
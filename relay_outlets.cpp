@@ -0,0 +1,117 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Cached DIN relay outlet state.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "relay_outlets.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+bool RelayOutlets::update(const char *page, uint64_t now)
+{
+    const char *position = page ? strstr(page, "state=") : nullptr;
+    if (position == nullptr)
+        return false;
+
+    char *end = nullptr;
+    const char *digits = position + 6;
+    unsigned long value = strtoul(digits, &end, 16);
+    if (end == digits || value > 0xFF)
+        return false;
+
+    state   = static_cast<uint8_t>(value);
+    known   = true;
+    updated = now;
+    return true;
+}
+
+void RelayOutlets::apply(uint8_t setMask, uint8_t clearMask, uint64_t now)
+{
+    // Outlets outside the masks are only known if they were known before.
+    if (known == false && (setMask | clearMask) != 0xFF)
+        return;
+
+    state   = (state | setMask) & ~clearMask;
+    known   = true;
+    updated = now;
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+size_t RelayOutlets::buildQuery(uint8_t target, uint8_t mask, uint64_t now, char *query, size_t size) const
+{
+    uint8_t changes = mask;
+    if (isFresh(now))
+        changes = (state ^ target) & mask;
+
+    query[0] = 0;
+    if (changes == 0)
+        return 0;
+
+    // All outlets to the same level in one word
+    if (changes == 0xFF && (target == 0 || target == 0xFF))
+        return snprintf(query, size, "%s", target ? "a=ON" : "a=OFF");
+
+    // The relay switches in query order. Every OFF goes first, so on a reversal the old
+    // direction is cut before the new one is switched on.
+    size_t length = 0;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        uint8_t level = pass ? target : ~target;
+        for (int i = 0; i < OUTLET_COUNT && length < size; i++)
+        {
+            if ((changes & level & (1 << i)) == 0)
+                continue;
+            length += snprintf(query + length, size - length, "%s%d=%s", length ? "&" : "", i + 1, pass ? "ON" : "OFF");
+        }
+    }
+    return (length < size) ? length : size - 1;
+}
+
+void RelayOutlets::parseQuery(const char *query, uint8_t &setMask, uint8_t &clearMask)
+{
+    setMask = clearMask = 0;
+
+    const char *p = query;
+    while (*p)
+    {
+        const char *eq = strchr(p, '=');
+        if (eq == nullptr)
+            break;
+
+        int outlet = atoi(p);
+        uint8_t mask = (*p == 'a') ? 0xFF : (outlet >= 1 && outlet <= OUTLET_COUNT) ? static_cast<uint8_t>(1 << (outlet - 1)) : 0;
+        if (!strncmp(eq + 1, "ON", 2))
+            setMask |= mask;
+        else
+            clearMask |= mask;
+
+        const char *amp = strchr(eq, '&');
+        if (amp == nullptr)
+            break;
+        p = amp + 1;
+    }
+}
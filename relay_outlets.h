@@ -0,0 +1,80 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Cached DIN relay outlet state. The relay reports all outlets in its status
+ page, which it returns for every request. The cache is filled from those pages
+ and trusted for a limited time, so motion commands can be sent as the minimal
+ set of outlet changes and commands that change nothing are not sent at all.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef RELAYOUTLETS_H
+#define RELAYOUTLETS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+class RelayOutlets
+{
+    public:
+
+        static const int OUTLET_COUNT = 8;
+
+        explicit RelayOutlets(uint64_t ttl = 60000000000ULL) : state(0), known(false), updated(0), ttl(ttl) {}
+
+        // How long a cached state is trusted, in ns
+        void setTTL(uint64_t ns) { ttl = ns; }
+
+        /**
+         * @brief update Read the outlet state from a status page ("state=XX" comment, bit 0 is outlet 1).
+         * @return false if the page carries no state. The cache is left untouched.
+         */
+        bool update(const char *page, uint64_t now);
+
+        // Record outlet changes the relay acknowledged without a status page.
+        void apply(uint8_t setMask, uint8_t clearMask, uint64_t now);
+
+        void invalidate() { known = false; }
+
+        bool isKnown() const { return known; }
+        bool isFresh(uint64_t now) const { return known && now - updated < ttl; }
+        uint8_t getState() const { return state; }
+
+        /**
+         * @brief buildQuery Outlet query that brings the outlets in mask to target, e.g. 2=OFF&1=ON.
+         * Lists only the outlets that differ from a fresh cache, every outlet in mask if the cache is stale.
+         * Outlets switched off come before those switched on, in outlet order within each.
+         * @param query receives the nul terminated query, 48 bytes are always enough.
+         * @return query length, 0 if nothing needs to change.
+         */
+        size_t buildQuery(uint8_t target, uint8_t mask, uint64_t now, char *query, size_t size) const;
+
+        /**
+         * @brief parseQuery Outlet changes of a query built by buildQuery(), the inverse of it.
+         * Pairs of <outlet>=<ON|OFF> separated by &, outlet "a" means all.
+         */
+        static void parseQuery(const char *query, uint8_t &setMask, uint8_t &clearMask);
+
+    private:
+        uint8_t state;
+        bool known;
+        uint64_t updated;
+        uint64_t ttl;
+};
+
+#endif
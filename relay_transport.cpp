@@ -0,0 +1,482 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Relay transports other than HTTP.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "relay_transport.h"
+#include "roof_clock.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <curl/curl.h>
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+RelayTransport *RelayTransport::create(Type type)
+{
+    switch (type)
+    {
+#ifdef HAVE_MODBUS
+        case TRANSPORT_MODBUS:
+            return new ModbusTransport();
+#endif
+        case TRANSPORT_TCP:
+        case TRANSPORT_UDP:
+            return new LineTransport(type);
+        default:
+            return nullptr;
+    }
+}
+
+const char *RelayTransport::getTypeName(Type type)
+{
+    switch (type)
+    {
+        case TRANSPORT_HTTP:
+            return "HTTP";
+        case TRANSPORT_MODBUS:
+            return "Modbus-TCP";
+        case TRANSPORT_TCP:
+            return "TCP";
+        case TRANSPORT_UDP:
+            return "UDP";
+        default:
+            return "Unknown";
+    }
+}
+
+bool RelayTransport::isAvailable(Type type)
+{
+    switch (type)
+    {
+#ifdef HAVE_MODBUS
+        case TRANSPORT_MODBUS:
+            return true;
+#endif
+        case TRANSPORT_HTTP:
+        case TRANSPORT_TCP:
+        case TRANSPORT_UDP:
+            return true;
+        default:
+            return false;
+    }
+}
+
+int RelayTransport::getDefaultPort(Type type)
+{
+    switch (type)
+    {
+        case TRANSPORT_MODBUS:
+            return 502;
+        case TRANSPORT_TCP:
+        case TRANSPORT_UDP:
+            return 4242;
+        default:
+            return 80;
+    }
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+RelayTransport::RelayTransport(Type type, int socketType) : type(type), fd(-1), setMask(0), clearMask(0),
+    socketType(socketType), addressLength(0), phase(PHASE_IDLE), reused(false), errorCode(0), error("")
+{
+    response[0] = 0;
+}
+
+RelayTransport::~RelayTransport()
+{
+    // Derived parts are gone by now, so no disconnecting() here. They close their own state.
+    if (fd >= 0)
+        close(fd);
+}
+
+void RelayTransport::setAddress(const std::string &relayHost, const std::string &relayPinnedIP)
+{
+    disconnect();
+
+    host     = relayHost;
+    port     = std::to_string(getDefaultPort(type));
+    pinnedIP = relayPinnedIP;
+
+    size_t colon = host.find(':');
+    if (colon != std::string::npos)
+    {
+        port = host.substr(colon + 1);
+        host = host.substr(0, colon);
+    }
+    addressLength = 0;
+}
+
+void RelayTransport::setAddress(const RelayTransport &other)
+{
+    disconnect();
+
+    host          = other.host;
+    port          = other.port;
+    pinnedIP      = other.pinnedIP;
+    address       = other.address;
+    addressLength = other.addressLength;
+}
+
+short RelayTransport::getEvents() const
+{
+    switch (phase)
+    {
+        case PHASE_CONNECTING:
+            return POLLOUT;
+        case PHASE_WAITING:
+            return POLLIN;
+        default:
+            return 0;
+    }
+}
+
+RelayTransport::Status RelayTransport::fail(int code, const char *message)
+{
+    errorCode = code;
+    error     = message;
+    return STATUS_FAILED;
+}
+
+/************************************************************************************
+ * Resolved once, the relay address does not change while we are connected.
+* ***********************************************************************************/
+bool RelayTransport::resolve()
+{
+    if (addressLength > 0)
+        return true;
+
+    struct addrinfo hints, *addresses = nullptr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = socketType;
+
+    const char *node = pinnedIP.empty() ? host.c_str() : pinnedIP.c_str();
+    if (getaddrinfo(node, port.c_str(), &hints, &addresses) != 0 || addresses == nullptr)
+        return false;
+
+    memcpy(&address, addresses->ai_addr, addresses->ai_addrlen);
+    addressLength = addresses->ai_addrlen;
+    freeaddrinfo(addresses);
+    return true;
+}
+
+bool RelayTransport::connect()
+{
+    fd = socket(address.ss_family, socketType | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return false;
+
+    if (socketType == SOCK_STREAM)
+    {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+    }
+
+    if (::connect(fd, reinterpret_cast<struct sockaddr *>(&address), addressLength) != 0 && errno != EINPROGRESS)
+    {
+        close(fd);
+        fd = -1;
+        return false;
+    }
+
+    phase = PHASE_CONNECTING;
+    return true;
+}
+
+void RelayTransport::disconnect()
+{
+    if (fd >= 0)
+    {
+        disconnecting();
+        close(fd);
+        fd = -1;
+    }
+    phase = PHASE_IDLE;
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+void RelayTransport::begin(uint8_t set, uint8_t clear)
+{
+    setMask     = set;
+    clearMask   = clear;
+    response[0] = 0;
+    errorCode   = 0;
+    error       = "";
+    reused      = false;
+
+    if (fd >= 0)
+    {
+        // Nothing is expected while idle: a readable stream was closed by the relay, or carries
+        // leftovers of an abandoned command. Either way start over on a new connection.
+        struct pollfd pfd;
+        pfd.fd     = fd;
+        pfd.events = POLLIN | POLLRDHUP;
+        if (socketType == SOCK_STREAM && poll(&pfd, 1, 0) > 0)
+            disconnect();
+        else
+        {
+            reused = (socketType == SOCK_STREAM);
+            phase  = PHASE_WAITING;
+            if (send() == STATUS_FAILED)
+                phase = PHASE_FAILED;
+            return;
+        }
+    }
+
+    if (resolve() == false)
+    {
+        fail(CURLE_COULDNT_RESOLVE_HOST, "Could not resolve the relay host");
+        phase = PHASE_FAILED;
+    }
+    else if (connect() == false)
+    {
+        fail(CURLE_COULDNT_CONNECT, "Failed to connect to the relay");
+        phase = PHASE_FAILED;
+    }
+}
+
+RelayTransport::Status RelayTransport::send()
+{
+    if (sendRequest())
+    {
+        phase = PHASE_WAITING;
+        return STATUS_PENDING;
+    }
+
+    disconnect();
+    if (reused)
+    {
+        reused = false;
+        if (connect())
+            return STATUS_PENDING;
+    }
+    return fail(CURLE_SEND_ERROR, "Failed to send the relay command");
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+RelayTransport::Status RelayTransport::advance()
+{
+    struct pollfd pfd;
+    pfd.fd      = fd;
+    pfd.events  = getEvents();
+    pfd.revents = 0;
+
+    switch (phase)
+    {
+        case PHASE_IDLE:
+            return fail(CURLE_FAILED_INIT, "No relay command");
+
+        case PHASE_FAILED:
+            phase = PHASE_IDLE;
+            return STATUS_FAILED;
+
+        case PHASE_CONNECTING:
+        {
+            if (poll(&pfd, 1, 0) <= 0)
+                return STATUS_PENDING;
+
+            int socketError = 0;
+            socklen_t length = sizeof(socketError);
+            if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &socketError, &length) != 0 || socketError != 0)
+            {
+                disconnect();
+                return fail(CURLE_COULDNT_CONNECT, "Failed to connect to the relay");
+            }
+
+            connected();
+            return send();
+        }
+
+        case PHASE_WAITING:
+        {
+            if (poll(&pfd, 1, 0) <= 0)
+                return STATUS_PENDING;
+
+            Status status = receiveResponse();
+            if (status == STATUS_PENDING)
+                return STATUS_PENDING;
+
+            if (status == STATUS_FAILED)
+            {
+                disconnect();
+                // The kept connection was dead before the relay ever saw the command.
+                if (reused && errorCode == CURLE_GOT_NOTHING)
+                {
+                    reused = false;
+                    errorCode = 0;
+                    error     = "";
+                    if (connect() == false)
+                        return fail(CURLE_COULDNT_CONNECT, "Failed to connect to the relay");
+                    return advance();
+                }
+                return STATUS_FAILED;
+            }
+
+            phase = PHASE_IDLE;
+            return STATUS_DONE;
+        }
+    }
+
+    return STATUS_FAILED;
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+bool RelayTransport::execute(uint8_t set, uint8_t clear, int timeoutMs)
+{
+    MonotonicClock clock;
+    uint64_t deadline = clock.now() + timeoutMs * 1000000ULL;
+
+    begin(set, clear);
+    while (true)
+    {
+        Status status = advance();
+        if (status != STATUS_PENDING)
+            return status == STATUS_DONE;
+
+        uint64_t now = clock.now();
+        if (now >= deadline)
+            break;
+
+        struct pollfd pfd;
+        pfd.fd     = fd;
+        pfd.events = getEvents();
+        poll(&pfd, 1, static_cast<int>((deadline - now) / 1000000) + 1);
+    }
+
+    disconnect();
+    fail(CURLE_OPERATION_TIMEDOUT, "Timeout was reached");
+    return false;
+}
+
+/************************************************************************************
+ * Line protocol
+* ***********************************************************************************/
+LineTransport::LineTransport(Type type) : RelayTransport(type, (type == TRANSPORT_UDP) ? SOCK_DGRAM : SOCK_STREAM),
+    sequence(0), length(0)
+{
+    buffer[0] = 0;
+}
+
+void LineTransport::connected()
+{
+    length = 0;
+}
+
+bool LineTransport::sendRequest()
+{
+    char request[32];
+    int size = snprintf(request, sizeof(request), "%u %02x %02x\n", ++sequence, setMask, clearMask);
+    return ::send(fd, request, size, MSG_NOSIGNAL) == size;
+}
+
+RelayTransport::Status LineTransport::receiveResponse()
+{
+    if (type == TRANSPORT_UDP)
+    {
+        // One datagram per reply, whatever is left of a stale one is not ours.
+        ssize_t n = recv(fd, buffer, sizeof(buffer) - 1, 0);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return STATUS_PENDING;
+            if (errno == ECONNREFUSED)
+                return fail(CURLE_COULDNT_CONNECT, "Relay refused the datagram");
+            return fail(CURLE_RECV_ERROR, "Failed to receive the relay reply");
+        }
+        buffer[n] = 0;
+        char *newline = strchr(buffer, '\n');
+        if (newline)
+            *newline = 0;
+        return parseReply(buffer);
+    }
+
+    ssize_t n = recv(fd, buffer + length, sizeof(buffer) - 1 - length, 0);
+    if (n == 0)
+        return fail(length ? CURLE_RECV_ERROR : CURLE_GOT_NOTHING, "Relay closed the connection");
+    if (n < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return STATUS_PENDING;
+        return fail(CURLE_RECV_ERROR, "Failed to receive the relay reply");
+    }
+    length += n;
+    buffer[length] = 0;
+
+    char *newline;
+    while ((newline = static_cast<char *>(memchr(buffer, '\n', length))) != nullptr)
+    {
+        *newline = 0;
+        Status status = parseReply(buffer);
+
+        size_t consumed = newline + 1 - buffer;
+        memmove(buffer, newline + 1, length - consumed);
+        length -= consumed;
+        buffer[length] = 0;
+
+        if (status != STATUS_PENDING)
+            return status;
+    }
+
+    if (length == sizeof(buffer) - 1)
+        return fail(CURLE_WEIRD_SERVER_REPLY, "Relay reply is too long");
+    return STATUS_PENDING;
+}
+
+RelayTransport::Status LineTransport::parseReply(const char *line)
+{
+    char *end = nullptr;
+    unsigned long replySequence = strtoul(line, &end, 10);
+    if (end == line)
+        return fail(CURLE_WEIRD_SERVER_REPLY, "Malformed relay reply");
+
+    // Reply to an abandoned command
+    if (replySequence != sequence)
+        return STATUS_PENDING;
+
+    while (*end == ' ')
+        end++;
+    if (strncmp(end, "OK", 2) != 0)
+        return fail(CURLE_HTTP_RETURNED_ERROR, "Relay rejected the command");
+
+    end += 2;
+    while (*end == ' ')
+        end++;
+    snprintf(response, RESPONSE_SIZE, "%s", end);
+    return STATUS_DONE;
+}
@@ -0,0 +1,228 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Relay transports other than HTTP. The DIN relay web API costs a full HTTP
+ request with basic auth per command; relays and bridges that also speak
+ Modbus-TCP or a plain line protocol can take the same outlet changes in a
+ few bytes on a persistent connection.
+
+ A transport runs one command at a time on its own socket and never blocks:
+ the relay executor calls advance() whenever the socket is ready, and enforces
+ the command deadline itself. Outlet n is Modbus coil n - 1 on unit 1. The line
+ protocol, over TCP or one datagram each way over UDP, is
+
+   <seq> <set> <clear>\n          e.g. "17 01 06", both masks 00 reads the state
+   <seq> OK [state=<outlets>]\n   or "<seq> ERR ..." on failure
+
+ with the outlet masks and state in hex, bit 0 being outlet 1. Replies to
+ other sequence numbers are stale and skipped.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef RELAYTRANSPORT_H
+#define RELAYTRANSPORT_H
+
+#include <stdint.h>
+
+#include <string>
+
+#include <sys/socket.h>
+
+#include "config.h"
+
+class RelayTransport
+{
+    public:
+
+        enum Type
+        {
+            // Served by curl in the relay executor, there is no RelayTransport for it
+            TRANSPORT_HTTP,
+            TRANSPORT_MODBUS,
+            TRANSPORT_TCP,
+            TRANSPORT_UDP,
+            TRANSPORT_COUNT
+        };
+
+        enum Status
+        {
+            STATUS_PENDING,
+            STATUS_DONE,
+            STATUS_FAILED
+        };
+
+        static const int RESPONSE_SIZE = 64;
+
+        /**
+         * @brief create Instantiate a transport.
+         * @return nullptr for HTTP and for transports that were not compiled in.
+         */
+        static RelayTransport *create(Type type);
+        static const char *getTypeName(Type type);
+        static bool isAvailable(Type type);
+        // Port used when the host has none
+        static int getDefaultPort(Type type);
+
+        virtual ~RelayTransport();
+
+        Type getType() const { return type; }
+
+        /**
+         * @brief setAddress Relay to talk to, resolved on the first connect and kept.
+         * @param host host name or IP address, optionally with :port.
+         * @param pinnedIP if set, used instead of resolving host.
+         */
+        void setAddress(const std::string &host, const std::string &pinnedIP);
+        // Same relay as other, without resolving it again
+        void setAddress(const RelayTransport &other);
+
+        /**
+         * @brief begin Start a command, connecting first if there is no usable connection.
+         * Both masks empty reads the outlet state.
+         */
+        void begin(uint8_t setMask, uint8_t clearMask);
+
+        /**
+         * @brief advance Make progress on the command without blocking.
+         * @return STATUS_PENDING while waiting for getFD() to become ready for getEvents().
+         */
+        Status advance();
+
+        // Socket and poll events the pending command waits for
+        int getFD() const { return fd; }
+        short getEvents() const;
+
+        // After STATUS_DONE, "state=XX" if the relay reported its outlets, empty otherwise
+        const char *getResponse() const { return response; }
+        // After STATUS_FAILED, the nearest CURLcode and a static description
+        int getErrorCode() const { return errorCode; }
+        const char *getError() const { return error; }
+
+        /**
+         * @brief disconnect Close the connection, e.g. after a missed deadline. A pending
+         * command is abandoned and a late reply can never be mistaken for the next one.
+         */
+        void disconnect();
+
+        /**
+         * @brief execute Run a command to completion on the calling thread.
+         * @return true if the relay acknowledged it within timeoutMs.
+         */
+        bool execute(uint8_t setMask, uint8_t clearMask, int timeoutMs);
+
+    protected:
+
+        RelayTransport(Type type, int socketType);
+
+        // The socket is connected and writable: send the request of the current command.
+        virtual bool sendRequest() = 0;
+        // The socket is readable. STATUS_PENDING if more is expected.
+        virtual Status receiveResponse() = 0;
+        virtual void connected() {}
+        virtual void disconnecting() {}
+
+        Status fail(int code, const char *message);
+
+        Type type;
+        int fd;
+        uint8_t setMask;
+        uint8_t clearMask;
+        char response[RESPONSE_SIZE];
+
+    private:
+
+        enum Phase
+        {
+            PHASE_IDLE,
+            PHASE_CONNECTING,
+            PHASE_WAITING,
+            // Failed before anything could be waited for, reported by the next advance()
+            PHASE_FAILED
+        };
+
+        bool resolve();
+        bool connect();
+        Status send();
+
+        int socketType;
+        std::string host;
+        std::string port;
+        std::string pinnedIP;
+        struct sockaddr_storage address;
+        socklen_t addressLength;
+
+        Phase phase;
+        // The command went out on a connection kept from an earlier one, which the relay
+        // may have dropped meanwhile. Such a command is sent once more on a new connection.
+        bool reused;
+        int errorCode;
+        const char *error;
+};
+
+/************************************************************************************
+ * Line protocol over a kept TCP connection or UDP datagrams
+* ***********************************************************************************/
+class LineTransport : public RelayTransport
+{
+    public:
+        explicit LineTransport(Type type);
+
+    protected:
+        bool sendRequest() override;
+        Status receiveResponse() override;
+        void connected() override;
+
+    private:
+        Status parseReply(const char *line);
+
+        uint32_t sequence;
+        char buffer[RESPONSE_SIZE * 2];
+        size_t length;
+};
+
+#ifdef HAVE_MODBUS
+
+typedef struct _modbus modbus_t;
+
+/************************************************************************************
+ * Modbus-TCP coils through libmodbus, on a socket connected without blocking
+* ***********************************************************************************/
+class ModbusTransport : public RelayTransport
+{
+    public:
+        ModbusTransport();
+        ~ModbusTransport();
+
+    protected:
+        bool sendRequest() override;
+        Status receiveResponse() override;
+        void connected() override;
+        void disconnecting() override;
+
+    private:
+        bool sendNext();
+
+        modbus_t *context;
+        // Outlets still to be written. Each contiguous run is one Write Multiple Coils.
+        uint8_t remaining;
+        int function;
+};
+
+#endif
+
+#endif
@@ -0,0 +1,74 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Injectable time source. Everything that models or measures roof timing reads
+ time through RoofClock so the same code can run on the real monotonic clock
+ or on a virtual clock that a simulation advances as fast as it likes.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef ROOFCLOCK_H
+#define ROOFCLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include <atomic>
+
+class RoofClock
+{
+    public:
+        virtual ~RoofClock() {}
+
+        // Nanoseconds on a monotonic time line
+        virtual uint64_t now() const = 0;
+};
+
+class MonotonicClock : public RoofClock
+{
+    public:
+        uint64_t now() const override
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        }
+};
+
+class VirtualClock : public RoofClock
+{
+    public:
+        VirtualClock() : current(0) {}
+
+        uint64_t now() const override { return current.load(std::memory_order_acquire); }
+
+        void advance(uint64_t ns) { current.fetch_add(ns, std::memory_order_acq_rel); }
+
+        // Time never goes backwards, earlier targets are ignored.
+        void advanceTo(uint64_t ns)
+        {
+            uint64_t previous = current.load(std::memory_order_acquire);
+            while (ns > previous && !current.compare_exchange_weak(previous, ns, std::memory_order_acq_rel))
+                ;
+        }
+
+    private:
+        std::atomic<uint64_t> current;
+};
+
+#endif
@@ -0,0 +1,452 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Shared I/O of all roofs driven by one driver process.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "roof_hub.h"
+
+#include <stdlib.h>
+
+#include <indidevapi.h>
+
+// Black box file of all roofs, empty to disable. Defaults to ~/.indi/IkarusRoof_blackbox.dat.
+#define BLACKBOX_ENV "IKARUSROOF_BLACKBOX"
+// [host:]port of the Prometheus metrics endpoint, unset to disable. Host defaults to 127.0.0.1.
+#define METRICS_ENV "IKARUSROOF_METRICS"
+
+RoofHub::RoofHub() : roofCount(0), openCount(0), conflictPin(-1), backendType(GPIOBackend::BACKEND_COUNT),
+    samplerCallbackID(-1), counterCallbackID(-1), relayCallbackID(-1)
+{
+    if (getenv(BLACKBOX_ENV))
+        blackBoxPath = getenv(BLACKBOX_ENV);
+    else if (getenv("HOME"))
+        blackBoxPath = std::string(getenv("HOME")) + "/.indi/IkarusRoof_blackbox.dat";
+
+    if (getenv(METRICS_ENV))
+        metricsAddress = getenv(METRICS_ENV);
+}
+
+RoofHub::~RoofHub()
+{
+    // The server thread reads the roofs until it is joined.
+    metricsServer.stop();
+    close();
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+int RoofHub::attach(Listener *listener, const char *name)
+{
+    if (roofCount >= MAX_ROOFS)
+        return -1;
+
+    roofs[roofCount].listener = listener;
+    roofs[roofCount].name     = name;
+    return roofCount++;
+}
+
+void RoofHub::configure(int slot, const Pins &pins)
+{
+    roofs[slot].pins = pins;
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+RoofHub::Status RoofHub::acquire(int slot, GPIOBackend::Type type, const char *chipName)
+{
+    Roof &roof = roofs[slot];
+    if (roof.connected)
+        return STATUS_OK;
+
+    if (openCount == 0)
+    {
+        Status status = open(type, chipName);
+        if (status != STATUS_OK)
+            return status;
+    }
+    else
+    {
+        if (type != backendType || chip != chipName)
+            return STATUS_BACKEND_MISMATCH;
+
+        // Opening the GPIO again would disturb the roofs that are connected.
+        const Pins &pins = roof.pins, &claimed = roof.claimed;
+        if (pins.fullOpen != claimed.fullOpen || pins.fullClosed != claimed.fullClosed || pins.ac != claimed.ac ||
+                pins.window != claimed.window || pins.encoderA != claimed.encoderA || pins.encoderB != claimed.encoderB)
+            return STATUS_PINS_CHANGED;
+    }
+
+    roof.connected = true;
+    roof.rate      = 0;
+    openCount++;
+    return STATUS_OK;
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+void RoofHub::release(int slot)
+{
+    Roof &roof = roofs[slot];
+    if (roof.connected == false)
+        return;
+
+    disarmStop(slot);
+    roof.connected = false;
+    roof.rate      = 0;
+
+    if (--openCount == 0)
+        close();
+    else
+        applySampleRate();
+}
+
+/************************************************************************************
+ * Claim the pins of every attached roof, so roofs connecting later need no reopen.
+* ***********************************************************************************/
+RoofHub::Status RoofHub::open(GPIOBackend::Type type, const char *chipName)
+{
+    int inputs[GPIOBackend::MAX_PINS], outputs[GPIOBackend::MAX_PINS], counters[GPIOBackend::MAX_PINS];
+    int inputCount = 0, outputCount = 0, counterCount = 0;
+    EncoderCounter::Channel channels[MAX_ROOFS];
+
+    conflictPin = -1;
+    for (int i = 0; i < roofCount; i++)
+    {
+        const Pins &pins = roofs[i].pins;
+        inputs[inputCount++]   = pins.fullOpen;
+        inputs[inputCount++]   = pins.fullClosed;
+        outputs[outputCount++] = pins.ac;
+
+        channels[i].inputA = channels[i].inputB = -1;
+        if (pins.encoderA >= 0 && counterCount + 2 <= GPIOBackend::MAX_PINS)
+        {
+            channels[i].inputA = counterCount;
+            counters[counterCount++] = pins.encoderA;
+            if (pins.encoderB >= 0)
+            {
+                channels[i].inputB = counterCount;
+                counters[counterCount++] = pins.encoderB;
+            }
+        }
+    }
+
+    int used[3 * GPIOBackend::MAX_PINS], usedCount = 0;
+    for (int i = 0; i < inputCount; i++)
+        used[usedCount++] = inputs[i];
+    for (int i = 0; i < outputCount; i++)
+        used[usedCount++] = outputs[i];
+    for (int i = 0; i < counterCount; i++)
+        used[usedCount++] = counters[i];
+
+    for (int i = 0; i < usedCount && conflictPin < 0; i++)
+    {
+        for (int j = i + 1; j < usedCount; j++)
+        {
+            if (used[i] == used[j])
+            {
+                conflictPin = used[i];
+                break;
+            }
+        }
+    }
+    if (conflictPin >= 0)
+        return STATUS_PIN_CONFLICT;
+
+    gpio.reset(GPIOBackend::create(type));
+    if (!gpio)
+        return STATUS_NO_BACKEND;
+
+    if (gpio->open(chipName) == false)
+    {
+        gpio.reset();
+        return STATUS_OPEN_FAILED;
+    }
+
+    // Ask for edge events on the limit switches. Backends that cannot deliver them are polled.
+    if (gpio->setupInputs(inputs, inputCount, true) == false || gpio->setupOutputs(outputs, outputCount) == false)
+    {
+        gpio->close();
+        gpio.reset();
+        return STATUS_SETUP_FAILED;
+    }
+
+    if (counterCount > 0 && (gpio->setupCounters(counters, counterCount) == false ||
+                             counter.start(gpio.get(), channels, roofCount) == false))
+    {
+        gpio->close();
+        gpio.reset();
+        return STATUS_COUNTER_FAILED;
+    }
+    if (counter.isRunning())
+        counterCallbackID = IEAddCallback(counter.getEventFD(), counterEventHelper, this);
+
+    if (relayExecutor.start() == false)
+    {
+        if (counterCallbackID >= 0)
+        {
+            IERmCallback(counterCallbackID);
+            counterCallbackID = -1;
+        }
+        counter.stop();
+        gpio->close();
+        gpio.reset();
+        return STATUS_RELAY_FAILED;
+    }
+    relayCallbackID = IEAddCallback(relayExecutor.getEventFD(), relayEventHelper, this);
+
+    // Recording is best effort, the roofs work without it.
+    if (blackBoxPath.empty() == false)
+        blackBox.open(blackBoxPath.c_str());
+
+    // So is the metrics endpoint. It outlives close() and is only started once.
+    if (metricsAddress.empty() == false && metricsServer.isRunning() == false)
+        metricsServer.start(metricsAddress.c_str(), [this](std::string &out) { renderMetrics(out); });
+
+    for (int i = 0; i < roofCount; i++)
+        roofs[i].claimed = roofs[i].pins;
+    backendType = type;
+    chip        = chipName;
+    return STATUS_OK;
+}
+
+void RoofHub::close()
+{
+    if (samplerCallbackID >= 0)
+    {
+        IERmCallback(samplerCallbackID);
+        samplerCallbackID = -1;
+    }
+    sampler.stop();
+
+    if (counterCallbackID >= 0)
+    {
+        IERmCallback(counterCallbackID);
+        counterCallbackID = -1;
+    }
+    counter.stop();
+
+    if (relayCallbackID >= 0)
+    {
+        IERmCallback(relayCallbackID);
+        relayCallbackID = -1;
+    }
+    relayExecutor.stop();
+
+    // Only once the sampler thread is gone
+    blackBox.close();
+
+    if (gpio)
+    {
+        gpio->close();
+        gpio.reset();
+    }
+    backendType = GPIOBackend::BACKEND_COUNT;
+    chip.clear();
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+bool RoofHub::startSampler(int rate)
+{
+    if (sampler.isRunning())
+        return true;
+    if (!gpio)
+        return false;
+
+    int windows[GPIOBackend::MAX_PINS];
+    for (int i = 0; i < roofCount; i++)
+        windows[2 * i + INPUT_FULL_OPEN] = windows[2 * i + INPUT_FULL_CLOSED] = roofs[i].claimed.window;
+
+    sampler.setRecorder(blackBox.isOpen() ? &blackBox : nullptr);
+    if (sampler.start(gpio.get(), roofCount * INPUTS_PER_ROOF, rate, windows) == false)
+        return false;
+
+    samplerCallbackID = IEAddCallback(sampler.getEventFD(), samplerEventHelper, this);
+    return true;
+}
+
+/************************************************************************************
+ * Route transitions to their roofs. Each roof hears once per batch that its switches changed.
+* ***********************************************************************************/
+void RoofHub::samplerEventHelper(int fd, void *context)
+{
+    INDI_UNUSED(fd);
+    RoofHub *hub = static_cast<RoofHub *>(context);
+
+    bool changed[MAX_ROOFS] = { false };
+    LimitSwitchSampler::Transition transition;
+    while (hub->sampler.popTransition(transition))
+    {
+        int slot = transition.input / INPUTS_PER_ROOF;
+        Roof &roof = hub->roofs[slot];
+        if (roof.connected == false)
+            continue;
+
+        transition.input %= INPUTS_PER_ROOF;
+        roof.listener->limitSwitchTransition(transition);
+        changed[slot] = true;
+    }
+
+    bool overflow = hub->sampler.checkOverflow();
+    for (int i = 0; i < hub->roofCount; i++)
+    {
+        if (hub->roofs[i].connected && (changed[i] || overflow))
+            hub->roofs[i].listener->limitSwitchesChanged(overflow);
+    }
+}
+
+void RoofHub::counterEventHelper(int fd, void *context)
+{
+    INDI_UNUSED(fd);
+    RoofHub *hub = static_cast<RoofHub *>(context);
+
+    EncoderCounter::Reached reached;
+    while (hub->counter.popReached(reached))
+    {
+        Roof &roof = hub->roofs[reached.channel];
+        if (roof.connected)
+            roof.listener->encoderTargetReached(reached);
+    }
+}
+
+void RoofHub::relayEventHelper(int fd, void *context)
+{
+    INDI_UNUSED(fd);
+    static_cast<RoofHub *>(context)->relayExecutor.dispatchCompletions();
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+SimulatorBackend *RoofHub::getSimulator()
+{
+    if (!gpio || backendType != GPIOBackend::BACKEND_SIMULATOR)
+        return nullptr;
+    return static_cast<SimulatorBackend *>(gpio.get());
+}
+
+int RoofHub::getLevel(int slot, int input) const
+{
+    if (sampler.isRunning() == false)
+        return -1;
+    return sampler.getLevel(slot * INPUTS_PER_ROOF + input);
+}
+
+void RoofHub::setSampleRate(int slot, int rate)
+{
+    roofs[slot].rate = rate;
+    applySampleRate();
+}
+
+void RoofHub::applySampleRate()
+{
+    int rate = 0;
+    for (int i = 0; i < roofCount; i++)
+    {
+        if (roofs[i].connected && roofs[i].rate > rate)
+            rate = roofs[i].rate;
+    }
+
+    if (rate > 0)
+        sampler.setRate(rate);
+}
+
+void RoofHub::armStop(int slot, EmergencyStop *stop, int input, int level)
+{
+    sampler.armStop(stop, slot * INPUTS_PER_ROOF + input, level);
+}
+
+void RoofHub::disarmStop(int slot)
+{
+    for (int i = 0; i < INPUTS_PER_ROOF; i++)
+        sampler.disarmStop(slot * INPUTS_PER_ROOF + i);
+    counter.disarmStop(slot);
+}
+
+bool RoofHub::hasEncoder(int slot) const
+{
+    return counter.isRunning() && roofs[slot].claimed.encoderA >= 0;
+}
+
+int64_t RoofHub::getEncoderCount(int slot) const
+{
+    return hasEncoder(slot) ? counter.getCount(slot) : 0;
+}
+
+uint64_t RoofHub::getEncoderErrors(int slot) const
+{
+    return counter.getErrors(slot);
+}
+
+void RoofHub::setEncoderDirection(int slot, int direction)
+{
+    counter.setDirection(slot, direction);
+}
+
+void RoofHub::armEncoderStop(int slot, EmergencyStop *stop, int64_t target, int direction)
+{
+    counter.armStop(slot, stop, target, direction);
+}
+
+bool RoofHub::writeOutput(int slot, int value)
+{
+    return gpio && gpio->writeOutput(slot, value);
+}
+
+bool RoofHub::readOutput(int slot, int *value)
+{
+    return gpio && gpio->readOutput(slot, value);
+}
+
+/************************************************************************************
+ * Only atomics are read, plus the names and roof count that are fixed once roofs attached.
+* ***********************************************************************************/
+void RoofHub::renderMetrics(std::string &out) const
+{
+    const RoofMetrics *metrics[MAX_ROOFS];
+    const char *names[MAX_ROOFS];
+    for (int i = 0; i < roofCount; i++)
+    {
+        metrics[i] = &roofs[i].metrics;
+        names[i]   = roofs[i].name.c_str();
+    }
+    RoofMetrics::write(out, metrics, names, roofCount);
+
+    out += "# HELP ikarusroof_sampler_rate_hertz Limit switch sampling rate.\n"
+           "# TYPE ikarusroof_sampler_rate_hertz gauge\n";
+    out += "ikarusroof_sampler_rate_hertz " + std::to_string(sampler.isRunning() ? sampler.getRate() : 0) + "\n";
+    out += "# HELP ikarusroof_sampler_wakeups_total Limit switch sampler thread wakeups.\n"
+           "# TYPE ikarusroof_sampler_wakeups_total counter\n";
+    out += "ikarusroof_sampler_wakeups_total " + std::to_string(sampler.getWakeups()) + "\n";
+    out += "# HELP ikarusroof_debounce_rejections_total Raw limit switch changes rejected by the debounce filter.\n"
+           "# TYPE ikarusroof_debounce_rejections_total counter\n";
+    out += "ikarusroof_debounce_rejections_total " + std::to_string(sampler.getRejectedGlitches()) + "\n";
+
+    out += "# HELP ikarusroof_encoder_edges_total Encoder edges decoded.\n"
+           "# TYPE ikarusroof_encoder_edges_total counter\n";
+    out += "ikarusroof_encoder_edges_total " + std::to_string(counter.getEdges()) + "\n";
+    out += "# HELP ikarusroof_encoder_dropped_total Encoder edges dropped by the GPIO backend before they were read.\n"
+           "# TYPE ikarusroof_encoder_dropped_total counter\n";
+    out += "ikarusroof_encoder_dropped_total " + std::to_string(counter.getDropped()) + "\n";
+}
@@ -0,0 +1,242 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Shared I/O of all roofs driven by one driver process. The GPIO backend, the
+ limit switch sampler thread and the relay executor (one curl multi handle)
+ exist once no matter how many roofs there are. Each roof attaches to the hub
+ as a slot and owns inputs 2*slot (full open) and 2*slot+1 (full closed) and
+ output slot (AC) of the shared GPIO. Transitions are routed back to the roof
+ they belong to.
+
+ A roof may also have a shaft encoder on two more pins (or one for a step
+ encoder). Encoder pins are claimed as counter pins and decoded by one shared
+ counter thread, channel slot.
+
+ The GPIO is opened with the pins of every attached roof when the first roof
+ connects and closed when the last one disconnects, so roofs can come and go
+ without disturbing the others. The black box recorder is shared the same way.
+ The metrics endpoint, if enabled, starts with the first connection and keeps
+ serving until the driver exits so disconnected roofs still show up as such.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef ROOFHUB_H
+#define ROOFHUB_H
+
+#include <memory>
+#include <string>
+
+#include "blackbox.h"
+#include "emergency_stop.h"
+#include "encoder_counter.h"
+#include "gpio_backend.h"
+#include "limit_switch_sampler.h"
+#include "metrics.h"
+#include "relay_executor.h"
+
+class RoofHub
+{
+    public:
+
+        // Each roof uses two inputs and one output of the shared GPIO.
+        static const int MAX_ROOFS = GPIOBackend::MAX_PINS / 2;
+
+        // Limit switch inputs of a roof, in this order
+        enum { INPUT_FULL_OPEN, INPUT_FULL_CLOSED, INPUTS_PER_ROOF };
+
+        enum Status
+        {
+            STATUS_OK,
+            // Backend was not compiled in
+            STATUS_NO_BACKEND,
+            STATUS_OPEN_FAILED,
+            // Two roofs use the same pin
+            STATUS_PIN_CONFLICT,
+            STATUS_SETUP_FAILED,
+            // GPIO is already open with another backend or chip
+            STATUS_BACKEND_MISMATCH,
+            // Pins of this roof changed since the GPIO was opened by another roof
+            STATUS_PINS_CHANGED,
+            STATUS_RELAY_FAILED,
+            // Encoder pins need a backend with counter support
+            STATUS_COUNTER_FAILED
+        };
+
+        struct Pins
+        {
+            // BCM numbers of the limit switches and AC
+            int fullOpen;
+            int fullClosed;
+            int ac;
+            // Debounce window in samples
+            int window;
+            // Encoder channels, -1 if unused. encoderB -1 with encoderA set is a step encoder.
+            int encoderA;
+            int encoderB;
+        };
+
+        // Implemented by each roof. Called on the INDI thread while the roof is connected.
+        class Listener
+        {
+            public:
+                virtual ~Listener() {}
+
+                // One accepted transition, input is INPUT_FULL_OPEN or INPUT_FULL_CLOSED
+                virtual void limitSwitchTransition(const LimitSwitchSampler::Transition &transition) = 0;
+
+                /**
+                 * @brief limitSwitchesChanged After a batch of transitions of this roof.
+                 * @param overflow transitions were dropped, resynchronize from the current levels.
+                 */
+                virtual void limitSwitchesChanged(bool overflow) = 0;
+
+                // A target armed with armEncoderStop() was reached, the roof was stopped already
+                virtual void encoderTargetReached(const EncoderCounter::Reached &reached) = 0;
+        };
+
+        RoofHub();
+        ~RoofHub();
+
+        /**
+         * @brief attach Register a roof. Roofs attach at startup, before any of them connects.
+         * @param name device name, labels the metrics of the roof.
+         * @return slot of the roof, -1 if MAX_ROOFS are attached already.
+         */
+        int attach(Listener *listener, const char *name);
+
+        // Pins used by the roof the next time the GPIO is opened
+        void configure(int slot, const Pins &pins);
+
+        /**
+         * @brief acquire Connect a roof. The first one opens the GPIO with the pins of all
+         * attached roofs and starts the relay executor.
+         */
+        Status acquire(int slot, GPIOBackend::Type type, const char *chip);
+
+        /**
+         * @brief startSampler Start sampling once the limit switch levels are valid. Roofs
+         * connecting later join the running sampler.
+         */
+        bool startSampler(int rate);
+
+        /**
+         * @brief release Disconnect a roof. The last one stops sampling and closes the GPIO.
+         */
+        void release(int slot);
+
+        bool isOpen() const { return openCount > 0; }
+        // Pin used by two roofs after acquire() returned STATUS_PIN_CONFLICT
+        int getConflictPin() const { return conflictPin; }
+        GPIOBackend::Type getBackendType() const { return backendType; }
+        const char *getChip() const { return chip.c_str(); }
+
+        // Simulated GPIO, nullptr unless the simulator backend is open
+        SimulatorBackend *getSimulator();
+
+        RelayExecutor &getRelayExecutor() { return relayExecutor; }
+
+        // Records nothing unless a roof is connected and the file could be opened
+        BlackBox &getBlackBox() { return blackBox; }
+        // Black box file, empty if disabled
+        const char *getBlackBoxPath() const { return blackBoxPath.c_str(); }
+
+        // Counters of a roof. Slot -1 gets a block that is never exported.
+        RoofMetrics &getMetrics(int slot) { return slot >= 0 ? roofs[slot].metrics : spareMetrics; }
+        // [host:]port of the metrics endpoint, empty if disabled
+        const char *getMetricsAddress() const { return metricsAddress.c_str(); }
+        bool isServingMetrics() const { return metricsServer.isRunning(); }
+
+        // Debounced level of a roof input, -1 if not sampling
+        int getLevel(int slot, int input) const;
+
+        /**
+         * @brief setSampleRate Rate wanted by a roof. The sampler runs at the highest rate any
+         * connected roof asks for.
+         */
+        void setSampleRate(int slot, int rate);
+        int getSampleRate() const { return sampler.getRate(); }
+        uint64_t getSamplerWakeups() const { return sampler.getWakeups(); }
+        // Time the sampler took to settle the initial limit switch levels, in nanoseconds
+        uint64_t getSettleTime() const { return sampler.getSettleTime(); }
+
+        void armStop(int slot, EmergencyStop *stop, int input, int level);
+        // Disarms the encoder stop too
+        void disarmStop(int slot);
+
+        // The roof has an encoder and it is being counted
+        bool hasEncoder(int slot) const;
+        // Counts since the GPIO was opened, 0 without an encoder
+        int64_t getEncoderCount(int slot) const;
+        uint64_t getEncoderErrors(int slot) const;
+        void setEncoderDirection(int slot, int direction);
+        void armEncoderStop(int slot, EmergencyStop *stop, int64_t target, int direction);
+
+        bool writeOutput(int slot, int value);
+        bool readOutput(int slot, int *value);
+
+    private:
+
+        struct Roof
+        {
+            Listener *listener = nullptr;
+            Pins pins {};
+            // Pins the GPIO was opened with
+            Pins claimed {};
+            bool connected = false;
+            int rate = 0;
+            std::string name;
+            RoofMetrics metrics;
+        };
+
+        static void samplerEventHelper(int fd, void *context);
+        static void counterEventHelper(int fd, void *context);
+        static void relayEventHelper(int fd, void *context);
+
+        Status open(GPIOBackend::Type type, const char *chip);
+        void close();
+        void applySampleRate();
+        // Server thread
+        void renderMetrics(std::string &out) const;
+
+        Roof roofs[MAX_ROOFS];
+        int roofCount;
+        int openCount;
+        int conflictPin;
+
+        std::unique_ptr<GPIOBackend> gpio;
+        GPIOBackend::Type backendType;
+        std::string chip;
+
+        LimitSwitchSampler sampler;
+        int samplerCallbackID;
+
+        EncoderCounter counter;
+        int counterCallbackID;
+
+        RelayExecutor relayExecutor;
+        int relayCallbackID;
+
+        BlackBox blackBox;
+        std::string blackBoxPath;
+
+        MetricsServer metricsServer;
+        std::string metricsAddress;
+        RoofMetrics spareMetrics;
+};
+
+#endif
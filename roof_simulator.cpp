@@ -0,0 +1,704 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Roof simulator.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "roof_simulator.h"
+#include "relay_outlets.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <math.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <vector>
+
+#define NS_PER_SEC 1e9
+
+/************************************************************************************
+ * Roof Model
+* ***********************************************************************************/
+RoofModel::Parameters RoofModel::defaultParameters()
+{
+    Parameters p;
+    p.travelTime    = 20;
+    p.bounceTime    = 0.02;
+    p.bounceCount   = 4;
+    p.relayLatency  = 0.05;
+    p.fullOpenPin   = 19;
+    p.fullClosedPin = 12;
+    p.encoderPinA   = -1;
+    p.encoderPinB   = -1;
+    p.encoderCounts = 2000;
+    return p;
+}
+
+RoofModel::RoofModel(RoofClock *clock, SimulatorBackend *gpio) : clock(clock), gpio(gpio)
+{
+    reset(defaultParameters(), 0);
+}
+
+void RoofModel::reset(const Parameters &newParameters, double newPosition)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    parameters     = newParameters;
+    position       = newPosition;
+    manualVelocity = 0;
+    outlets        = 0;
+    stuck          = false;
+    lastUpdate     = clock->now();
+    endReached     = lastUpdate;
+    pending.clear();
+
+    openSwitch.pressed   = (position >= 1);
+    closedSwitch.pressed = (position <= 0);
+    // Start settled. Unsigned wrap-around keeps this valid even at time zero.
+    openSwitch.changeTime = closedSwitch.changeTime = lastUpdate - static_cast<uint64_t>(parameters.bounceTime * NS_PER_SEC);
+
+    gpio->setLevel(parameters.fullOpenPin, switchLevel(openSwitch, lastUpdate));
+    gpio->setLevel(parameters.fullClosedPin, switchLevel(closedSwitch, lastUpdate));
+
+    // The encoder starts at zero wherever the roof is, like a real one at power up.
+    encoderCount = llround(position * parameters.encoderCounts);
+    if (parameters.encoderPinA >= 0)
+        gpio->setLevel(parameters.encoderPinA, parameters.encoderPinB >= 0 && (encoderCount & 3) >= 2);
+    if (parameters.encoderPinB >= 0)
+        gpio->setLevel(parameters.encoderPinB, ((encoderCount + 1) & 3) >= 2);
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+uint64_t RoofModel::relayCommand(const char *query)
+{
+    uint8_t setMask, clearMask;
+    RelayOutlets::parseQuery(query, setMask, clearMask);
+    return relayCommand(setMask, clearMask);
+}
+
+uint64_t RoofModel::relayCommand(uint8_t setMask, uint8_t clearMask)
+{
+    PendingCommand command;
+    command.setMask   = setMask;
+    command.clearMask = clearMask;
+
+    std::lock_guard<std::mutex> guard(lock);
+    command.due = clock->now() + static_cast<uint64_t>(parameters.relayLatency * NS_PER_SEC);
+    // The relay processes commands in order
+    if (pending.empty() == false && pending.back().due > command.due)
+        command.due = pending.back().due;
+    pending.push_back(command);
+    return command.due;
+}
+
+/************************************************************************************
+ * +1 opening, -1 closing, 0 stopped
+* ***********************************************************************************/
+int RoofModel::motorDirection() const
+{
+    bool open  = (outlets & OUTLET_OPEN) != 0;
+    bool close = (outlets & OUTLET_CLOSE) == OUTLET_CLOSE;
+
+    int motor = 0;
+    // Energizing both directions jams the winch
+    if (open && !close)
+        motor = 1;
+    else if (close && !open)
+        motor = -1;
+
+    // The limit switches cut motor power at the ends.
+    if ((motor > 0 && position >= 1) || (motor < 0 && position <= 0))
+        motor = 0;
+
+    return motor;
+}
+
+/************************************************************************************
+ * Fraction of travel per nanosecond
+* ***********************************************************************************/
+double RoofModel::velocity() const
+{
+    double v = (motorDirection() + manualVelocity) / (parameters.travelTime * NS_PER_SEC);
+
+    // Nothing moves the roof past its ends.
+    if ((v > 0 && position >= 1) || (v < 0 && position <= 0))
+        return 0;
+    return v;
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+void RoofModel::advanceTo(uint64_t t)
+{
+    while (lastUpdate < t)
+    {
+        uint64_t next = t;
+        if (pending.empty() == false && pending.front().due < next)
+            next = pending.front().due;
+
+        double v = velocity();
+        if (v != 0)
+        {
+            // Stop exactly at the end to time the arrival
+            double target  = (v > 0) ? 1 : 0;
+            double arrival = lastUpdate + (target - position) / v;
+            if (arrival < next)
+            {
+                next = static_cast<uint64_t>(arrival);
+                if (next <= lastUpdate)
+                    next = lastUpdate + 1;
+            }
+
+            position += v * (next - lastUpdate);
+            if (position >= 1 || position <= 0)
+            {
+                position   = (position >= 1) ? 1 : 0;
+                endReached = next;
+            }
+        }
+
+        lastUpdate = next;
+
+        updateSwitch(openSwitch, position >= 1, lastUpdate);
+        updateSwitch(closedSwitch, position <= 0, lastUpdate);
+
+        while (pending.empty() == false && pending.front().due <= lastUpdate)
+        {
+            outlets |= pending.front().setMask;
+            outlets &= ~pending.front().clearMask;
+            pending.pop_front();
+        }
+    }
+}
+
+void RoofModel::updateSwitch(Switch &sw, bool pressed, uint64_t t)
+{
+    if (sw.pressed == pressed)
+        return;
+
+    sw.pressed    = pressed;
+    sw.changeTime = t;
+}
+
+/************************************************************************************
+ * Charger is off (LOW) while its limit switch is pressed. Right after a change the
+ * contact chatters between the old and new level.
+* ***********************************************************************************/
+int RoofModel::switchLevel(const Switch &sw, uint64_t t) const
+{
+    int newLevel = sw.pressed ? 0 : 1;
+
+    if (parameters.bounceCount <= 0)
+        return newLevel;
+
+    uint64_t bounceNs = static_cast<uint64_t>(parameters.bounceTime * NS_PER_SEC);
+    uint64_t elapsed  = t - sw.changeTime;
+    if (elapsed >= bounceNs)
+        return newLevel;
+
+    uint64_t phase = elapsed / (bounceNs / parameters.bounceCount);
+    return (phase % 2 == 0) ? newLevel : 1 - newLevel;
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+void RoofModel::update()
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    advanceTo(clock->now());
+
+    int openLevel   = stuck ? 0 : switchLevel(openSwitch, lastUpdate);
+    int closedLevel = stuck ? 0 : switchLevel(closedSwitch, lastUpdate);
+    gpio->setLevel(parameters.fullOpenPin, openLevel);
+    gpio->setLevel(parameters.fullClosedPin, closedLevel);
+
+    updateEncoder();
+}
+
+/************************************************************************************
+ * Step the encoder pins to the current position, one count at a time so every count
+ * is an edge. Quadrature counts up through A/B = 00, 01, 11, 10.
+* ***********************************************************************************/
+void RoofModel::updateEncoder()
+{
+    if (parameters.encoderPinA < 0)
+        return;
+
+    int64_t target = llround(position * parameters.encoderCounts);
+    while (encoderCount != target)
+    {
+        encoderCount += (target > encoderCount) ? 1 : -1;
+
+        if (parameters.encoderPinB < 0)
+        {
+            gpio->setLevel(parameters.encoderPinA, 1);
+            gpio->setLevel(parameters.encoderPinA, 0);
+        }
+        else
+        {
+            gpio->setLevel(parameters.encoderPinA, (encoderCount & 3) >= 2);
+            gpio->setLevel(parameters.encoderPinB, ((encoderCount + 1) & 3) >= 2);
+        }
+    }
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+uint64_t RoofModel::nextEventTime()
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    uint64_t next = UINT64_MAX;
+
+    if (pending.empty() == false)
+        next = pending.front().due;
+
+    double v = velocity();
+    if (v != 0)
+    {
+        double target  = (v > 0) ? 1 : 0;
+        uint64_t arrival = lastUpdate + static_cast<uint64_t>((target - position) / v) + 1;
+        if (arrival < next)
+            next = arrival;
+    }
+
+    // Next chatter edge of a bouncing switch
+    uint64_t bounceNs = static_cast<uint64_t>(parameters.bounceTime * NS_PER_SEC);
+    if (parameters.bounceCount > 0)
+    {
+        uint64_t step = bounceNs / parameters.bounceCount;
+        const Switch *switches[2] = { &openSwitch, &closedSwitch };
+        for (const Switch *sw : switches)
+        {
+            if (lastUpdate - sw->changeTime >= bounceNs)
+                continue;
+            uint64_t edge = sw->changeTime + ((lastUpdate - sw->changeTime) / step + 1) * step;
+            if (edge < next)
+                next = edge;
+        }
+    }
+
+    return next;
+}
+
+void RoofModel::setManualVelocity(double v)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    advanceTo(clock->now());
+    manualVelocity = v;
+}
+
+void RoofModel::setStuckSwitches(bool enable)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    stuck = enable;
+}
+
+double RoofModel::getPosition()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return position;
+}
+
+uint8_t RoofModel::getOutlets()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return outlets;
+}
+
+int RoofModel::getMotorDirection()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return motorDirection();
+}
+
+uint64_t RoofModel::getEndReachedTime()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return endReached;
+}
+
+std::string RoofModel::getStatusPage()
+{
+    char page[128];
+    snprintf(page, sizeof(page), "<html><!-- state=%02x lock=00 --></html>\r\n", getOutlets());
+    return page;
+}
+
+/************************************************************************************
+ * Relay Stand-In
+* ***********************************************************************************/
+RelayStandIn::RelayStandIn(RoofModel *model) : model(model), transport(RelayTransport::TRANSPORT_HTTP), listenFD(-1), port(0),
+    running(false)
+{
+}
+
+RelayStandIn::~RelayStandIn()
+{
+    stop();
+}
+
+bool RelayStandIn::start(RelayTransport::Type type)
+{
+    transport = type;
+    bool datagrams = (transport == RelayTransport::TRANSPORT_UDP);
+
+    listenFD = socket(AF_INET, (datagrams ? SOCK_DGRAM : SOCK_STREAM) | SOCK_CLOEXEC, 0);
+    if (listenFD < 0)
+        return false;
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family      = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port        = 0;
+
+    socklen_t length = sizeof(address);
+    if (bind(listenFD, reinterpret_cast<struct sockaddr *>(&address), sizeof(address)) < 0 ||
+            (datagrams == false && listen(listenFD, 4) < 0) ||
+            getsockname(listenFD, reinterpret_cast<struct sockaddr *>(&address), &length) < 0)
+    {
+        close(listenFD);
+        listenFD = -1;
+        return false;
+    }
+
+    port    = ntohs(address.sin_port);
+    running = true;
+    server  = std::thread(datagrams ? &RelayStandIn::datagramLoop : &RelayStandIn::serverLoop, this);
+    return true;
+}
+
+void RelayStandIn::stop()
+{
+    if (running == false)
+        return;
+
+    running = false;
+    server.join();
+    close(listenFD);
+    listenFD = -1;
+}
+
+/************************************************************************************
+ * Serves any number of keep-alive clients (relay executor and emergency stop), one
+ * request at a time like the real relay.
+* ***********************************************************************************/
+void RelayStandIn::serverLoop()
+{
+    std::vector<int> clients;
+    std::vector<std::string> buffers;
+
+    while (running)
+    {
+        std::vector<struct pollfd> pfds(clients.size() + 1);
+        pfds[0].fd     = listenFD;
+        pfds[0].events = POLLIN;
+        for (size_t i = 0; i < clients.size(); i++)
+        {
+            pfds[i + 1].fd     = clients[i];
+            pfds[i + 1].events = POLLIN;
+        }
+
+        if (poll(pfds.data(), pfds.size(), 100) <= 0)
+            continue;
+
+        if (pfds[0].revents & POLLIN)
+        {
+            int client = accept4(listenFD, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client >= 0)
+            {
+                clients.push_back(client);
+                buffers.push_back(std::string());
+            }
+        }
+
+        for (size_t i = pfds.size() - 1; i > 0; i--)
+        {
+            if (pfds[i].revents == 0)
+                continue;
+
+            size_t index = i - 1;
+            bool keep = true;
+            char chunk[1024];
+            ssize_t n = read(clients[index], chunk, sizeof(chunk));
+            if (n <= 0)
+                keep = false;
+            else
+            {
+                buffers[index].append(chunk, n);
+                keep = handleRequests(clients[index], buffers[index]);
+            }
+
+            if (keep == false)
+            {
+                close(clients[index]);
+                clients.erase(clients.begin() + index);
+                buffers.erase(buffers.begin() + index);
+            }
+        }
+    }
+
+    for (int client : clients)
+        close(client);
+}
+
+/************************************************************************************
+ * One datagram per request and per reply
+* ***********************************************************************************/
+void RelayStandIn::datagramLoop()
+{
+    while (running)
+    {
+        struct pollfd pfd;
+        pfd.fd     = listenFD;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 100) <= 0)
+            continue;
+
+        char datagram[256];
+        struct sockaddr_storage peer;
+        socklen_t peerLength = sizeof(peer);
+        ssize_t n = recvfrom(listenFD, datagram, sizeof(datagram) - 1, 0, reinterpret_cast<struct sockaddr *>(&peer), &peerLength);
+        if (n <= 0)
+            continue;
+
+        std::string reply = handleLine(std::string(datagram, n));
+        sendto(listenFD, reply.data(), reply.size(), 0, reinterpret_cast<struct sockaddr *>(&peer), peerLength);
+    }
+}
+
+bool RelayStandIn::handleRequests(int fd, std::string &buffer)
+{
+    bool keep = true;
+
+    if (transport == RelayTransport::TRANSPORT_HTTP)
+    {
+        size_t end;
+        while (keep && (end = buffer.find("\r\n\r\n")) != std::string::npos)
+        {
+            std::string requestLine = buffer.substr(0, buffer.find("\r\n"));
+            buffer.erase(0, end + 4);
+            keep = handleRequest(fd, requestLine);
+        }
+        return keep;
+    }
+
+    while (keep)
+    {
+        std::string reply;
+        if (transport == RelayTransport::TRANSPORT_MODBUS)
+        {
+            // MBAP header: transaction, protocol, length of what follows it
+            if (buffer.size() < 7)
+                break;
+            size_t size = 6 + ((static_cast<uint8_t>(buffer[4]) << 8) | static_cast<uint8_t>(buffer[5]));
+            if (buffer.size() < size)
+                break;
+            reply = handleModbus(buffer.substr(0, size));
+            buffer.erase(0, size);
+        }
+        else
+        {
+            size_t end = buffer.find('\n');
+            if (end == std::string::npos)
+                break;
+            reply = handleLine(buffer.substr(0, end));
+            buffer.erase(0, end + 1);
+        }
+        keep = reply.empty() == false && write(fd, reply.data(), reply.size()) == static_cast<ssize_t>(reply.size());
+    }
+    return keep;
+}
+
+void RelayStandIn::switchOutlets(uint8_t setMask, uint8_t clearMask)
+{
+    // The real relay answers once the outlets switched.
+    uint64_t ack = model->relayCommand(setMask, clearMask);
+    uint64_t now = clock.now();
+    if (ack > now)
+        usleep((ack - now) / 1000);
+    model->update();
+}
+
+/************************************************************************************
+ * "<seq> <set> <clear>" to "<seq> OK state=<outlets>"
+* ***********************************************************************************/
+std::string RelayStandIn::handleLine(const std::string &line)
+{
+    unsigned int sequence = 0, setMask = 0, clearMask = 0;
+    char reply[64];
+
+    if (sscanf(line.c_str(), "%u %x %x", &sequence, &setMask, &clearMask) != 3 || setMask > 0xFF || clearMask > 0xFF)
+    {
+        snprintf(reply, sizeof(reply), "%u ERR malformed request\n", sequence);
+        return reply;
+    }
+
+    if (setMask | clearMask)
+        switchOutlets(setMask, clearMask);
+
+    snprintf(reply, sizeof(reply), "%u OK state=%02x\n", sequence, model->getOutlets());
+    return reply;
+}
+
+/************************************************************************************
+ * Read Coils and Write Multiple Coils on coils 0-7, anything else is an exception.
+* ***********************************************************************************/
+std::string RelayStandIn::handleModbus(const std::string &frame)
+{
+    const uint8_t *request = reinterpret_cast<const uint8_t *>(frame.data());
+    uint8_t function = (frame.size() > 7) ? request[7] : 0;
+    int address  = (frame.size() >= 12) ? (request[8] << 8 | request[9]) : 0;
+    int quantity = (frame.size() >= 12) ? (request[10] << 8 | request[11]) : 0;
+
+    // Transaction and protocol are echoed, length and unit follow
+    std::string reply = frame.substr(0, 4);
+    reply += '\0';
+
+    uint8_t exception = 0;
+    if (function != 0x01 && function != 0x0F)
+        exception = 0x01;
+    else if (frame.size() < 12 || quantity < 1 || address + quantity > RelayOutlets::OUTLET_COUNT)
+        exception = 0x02;
+    else if (function == 0x0F && (frame.size() < 14 || request[12] != 1))
+        exception = 0x03;
+
+    if (exception)
+    {
+        reply += '\3';
+        reply += static_cast<char>(request[6]);
+        reply += static_cast<char>(function | 0x80);
+        reply += static_cast<char>(exception);
+        return reply;
+    }
+
+    uint8_t mask = static_cast<uint8_t>(((1 << quantity) - 1) << address);
+    if (function == 0x01)
+    {
+        reply += '\4';
+        reply += frame.substr(6, 2);
+        reply += '\1';
+        reply += static_cast<char>((model->getOutlets() & mask) >> address);
+        return reply;
+    }
+
+    uint8_t values = static_cast<uint8_t>(request[13] << address);
+    switchOutlets(values & mask, ~values & mask);
+
+    reply += '\6';
+    reply += frame.substr(6, 6);
+    return reply;
+}
+
+bool RelayStandIn::handleRequest(int fd, const std::string &requestLine)
+{
+    // GET /outlet?1=ON HTTP/1.1
+    size_t pathStart = requestLine.find(' ');
+    size_t pathEnd   = requestLine.find(' ', pathStart + 1);
+    if (pathStart == std::string::npos || pathEnd == std::string::npos)
+        return false;
+    std::string path = requestLine.substr(pathStart + 1, pathEnd - pathStart - 1);
+
+    if (path.compare(0, 8, "/outlet?") == 0)
+    {
+        uint8_t setMask, clearMask;
+        RelayOutlets::parseQuery(path.c_str() + 8, setMask, clearMask);
+        switchOutlets(setMask, clearMask);
+    }
+
+    std::string body = model->getStatusPage();
+    char header[128];
+    snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nContent-Length: %zu\r\n\r\n", body.size());
+    std::string response = header + body;
+
+    return write(fd, response.data(), response.size()) == static_cast<ssize_t>(response.size());
+}
+
+/************************************************************************************
+ * Roof Simulator
+* ***********************************************************************************/
+RoofSimulator::RoofSimulator() : model(nullptr), relay(nullptr), running(false)
+{
+}
+
+RoofSimulator::~RoofSimulator()
+{
+    stop();
+}
+
+bool RoofSimulator::start(SimulatorBackend *gpio, const RoofModel::Parameters &parameters, RelayTransport::Type transport)
+{
+    stop();
+
+    model = new RoofModel(&clock, gpio);
+    model->reset(parameters, 0);
+
+    relay = new RelayStandIn(model);
+    if (relay->start(transport) == false)
+    {
+        delete relay;
+        delete model;
+        relay = nullptr;
+        model = nullptr;
+        return false;
+    }
+
+    running = true;
+    ticker  = std::thread(&RoofSimulator::tickLoop, this);
+    return true;
+}
+
+void RoofSimulator::stop()
+{
+    if (running)
+    {
+        running = false;
+        ticker.join();
+    }
+
+    delete relay;
+    delete model;
+    relay = nullptr;
+    model = nullptr;
+}
+
+std::string RoofSimulator::getRelayHost() const
+{
+    return "127.0.0.1:" + std::to_string(relay ? relay->getPort() : 0);
+}
+
+void RoofSimulator::tickLoop()
+{
+    while (running)
+    {
+        model->update();
+        usleep(1000);
+    }
+}
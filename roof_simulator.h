@@ -0,0 +1,217 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Roof simulator. RoofModel is a physical model of the roll-off roof: a winch
+ moving the roof end to end in a configurable travel time, limit switches that
+ bounce when they change, and DIN relay outlets that switch after a configurable
+ latency. It drives the limit switch pins of a SimulatorBackend and reads time
+ from an injectable RoofClock, so it can run in real time behind the driver or
+ in accelerated virtual time in a benchmark.
+
+ RelayStandIn is a local server that speaks the subset of the DIN relay web
+ API the driver uses, or one of the other relay transports, and applies the
+ commands to the model. RoofSimulator ties both together for the driver
+ simulation mode.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef ROOFSIMULATOR_H
+#define ROOFSIMULATOR_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "gpio_backend.h"
+#include "relay_transport.h"
+#include "roof_clock.h"
+
+class RoofModel
+{
+    public:
+
+        struct Parameters
+        {
+            // Seconds to travel from fully closed to fully open
+            double travelTime;
+            // Seconds a limit switch contact bounces after it changes
+            double bounceTime;
+            // Number of level changes during the bounce
+            int bounceCount;
+            // Seconds from relay command to the outlets switching
+            double relayLatency;
+            // BCM pins of the limit switches on the simulated GPIO
+            int fullOpenPin;
+            int fullClosedPin;
+            // Encoder pins, -1 for none. Without B the encoder pulses A once per count.
+            int encoderPinA;
+            int encoderPinB;
+            // Encoder counts from fully closed to fully open
+            int encoderCounts;
+        };
+
+        static Parameters defaultParameters();
+
+        // Outlet bits of the DIN relay used by the roof
+        enum
+        {
+            OUTLET_OPEN   = 0x01,
+            OUTLET_CLOSE  = 0x06
+        };
+
+        RoofModel(RoofClock *clock, SimulatorBackend *gpio);
+
+        /**
+         * @brief reset Restart the model at a position.
+         * @param position 0 is fully closed, 1 is fully open.
+         */
+        void reset(const Parameters &parameters, double position);
+
+        /**
+         * @brief relayCommand Apply a DIN relay outlet query such as "1=ON", "2=ON&3=ON" or "a=OFF".
+         * @return time at which the outlets switch, i.e. when the relay acknowledges the command.
+         */
+        uint64_t relayCommand(const char *query);
+        uint64_t relayCommand(uint8_t setMask, uint8_t clearMask);
+
+        // Advance the model to the current clock time and update the GPIO pins.
+        void update();
+
+        // Earliest future time at which anything in the model changes, UINT64_MAX if nothing will.
+        uint64_t nextEventTime();
+
+        /**
+         * @brief setManualVelocity Someone pushes the roof by hand.
+         * @param velocity fraction of the motor speed, positive opens. 0 stops pushing.
+         */
+        void setManualVelocity(double velocity);
+
+        // Fault injection: both limit switches read as pressed.
+        void setStuckSwitches(bool stuck);
+
+        double getPosition();
+        uint8_t getOutlets();
+        // +1 opening, -1 closing, 0 stopped
+        int getMotorDirection();
+        // When the roof last arrived at either end
+        uint64_t getEndReachedTime();
+
+        // DIN relay status page with the outlet state
+        std::string getStatusPage();
+
+    private:
+
+        struct Switch
+        {
+            bool pressed;
+            uint64_t changeTime;
+        };
+
+        struct PendingCommand
+        {
+            uint64_t due;
+            uint8_t setMask;
+            uint8_t clearMask;
+        };
+
+        int motorDirection() const;
+        double velocity() const;
+        void advanceTo(uint64_t t);
+        void updateSwitch(Switch &sw, bool pressed, uint64_t t);
+        int switchLevel(const Switch &sw, uint64_t t) const;
+        void updateEncoder();
+
+        RoofClock *clock;
+        SimulatorBackend *gpio;
+        Parameters parameters;
+
+        std::mutex lock;
+        double position;
+        double manualVelocity;
+        uint8_t outlets;
+        bool stuck;
+        uint64_t lastUpdate;
+        uint64_t endReached;
+        // Encoder count the pins show
+        int64_t encoderCount;
+        Switch openSwitch, closedSwitch;
+        std::deque<PendingCommand> pending;
+};
+
+class RelayStandIn
+{
+    public:
+        explicit RelayStandIn(RoofModel *model);
+        ~RelayStandIn();
+
+        // Listen on an ephemeral port on the loopback interface
+        bool start(RelayTransport::Type transport = RelayTransport::TRANSPORT_HTTP);
+        void stop();
+        int getPort() const { return port; }
+
+    private:
+        void serverLoop();
+        void datagramLoop();
+        // Answer and remove the complete requests at the front of buffer
+        bool handleRequests(int fd, std::string &buffer);
+        bool handleRequest(int fd, const std::string &requestLine);
+        std::string handleLine(const std::string &line);
+        std::string handleModbus(const std::string &frame);
+        // Apply an outlet change and return once the relay would acknowledge it
+        void switchOutlets(uint8_t setMask, uint8_t clearMask);
+
+        RoofModel *model;
+        MonotonicClock clock;
+        RelayTransport::Type transport;
+        int listenFD;
+        int port;
+        std::thread server;
+        std::atomic<bool> running;
+};
+
+class RoofSimulator
+{
+    public:
+        RoofSimulator();
+        ~RoofSimulator();
+
+        /**
+         * @brief start Run the model in real time on the given simulated GPIO and serve the relay.
+         */
+        bool start(SimulatorBackend *gpio, const RoofModel::Parameters &parameters,
+                   RelayTransport::Type transport = RelayTransport::TRANSPORT_HTTP);
+        void stop();
+
+        // host:port of the stand-in relay
+        std::string getRelayHost() const;
+
+    private:
+        void tickLoop();
+
+        MonotonicClock clock;
+        RoofModel *model;
+        RelayStandIn *relay;
+        std::thread ticker;
+        std::atomic<bool> running;
+};
+
+#endif
@@ -0,0 +1,217 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Roof state machine. The roof is in exactly one of a few states and moves
+ between them on limit switch readings, client requests, encoder targets and
+ relay or watchdog failures, following a transition table fixed at compile time.
+ Nothing here knows about INDI, the GPIO or the relay: the driver dispatches
+ events, carries out the returned action and updates its properties when the
+ state changes. ikarus_roof_replay runs the same machine on recorded traces.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef ROOFSTATEMACHINE_H
+#define ROOFSTATEMACHINE_H
+
+#include <stdint.h>
+
+namespace RoofStates
+{
+
+enum State
+{
+    STATE_CLOSED,
+    STATE_OPENING,
+    STATE_OPEN,
+    STATE_CLOSING,
+    // Idle between the limit switches, e.g. after Abort or a manual opening
+    STATE_UNKNOWN,
+    // Both limit switches pressed, or the roof did not reach its limit in time
+    STATE_FAULT,
+    STATE_COUNT,
+    // Only used in the table: back to the state the current motion started from
+    STATE_RESTING
+};
+
+enum Event
+{
+    // Debounced limit switches, dispatched on every poll and transition
+    EVENT_LIMITS_NONE,
+    EVENT_LIMIT_OPEN,
+    EVENT_LIMIT_CLOSED,
+    EVENT_LIMITS_BOTH,
+    // Client requests
+    EVENT_OPEN_REQUEST,
+    EVENT_CLOSE_REQUEST,
+    EVENT_ABORT,
+    // The relay did not take a START command, so the motor never ran
+    EVENT_RELAY_FAILED,
+    // Travel watchdog expired
+    EVENT_OVERRUN,
+    // The encoder reached the target of a partial move
+    EVENT_TARGET_REACHED,
+    EVENT_COUNT
+};
+
+enum Action
+{
+    ACTION_NONE,
+    ACTION_START_OPEN,
+    ACTION_START_CLOSE,
+    ACTION_STOP,
+    // Request makes no sense in this state (already open or closed)
+    ACTION_REFUSE
+};
+
+struct Transition
+{
+    State next;
+    Action action;
+};
+
+// One row per state, one column per event, in enum order.
+constexpr Transition TRANSITIONS[][EVENT_COUNT] =
+{
+    // STATE_CLOSED
+    {
+        { STATE_UNKNOWN, ACTION_NONE }, { STATE_OPEN, ACTION_NONE }, { STATE_CLOSED, ACTION_NONE }, { STATE_FAULT, ACTION_NONE },
+        { STATE_OPENING, ACTION_START_OPEN }, { STATE_CLOSED, ACTION_REFUSE }, { STATE_CLOSED, ACTION_STOP },
+        { STATE_CLOSED, ACTION_NONE }, { STATE_CLOSED, ACTION_NONE }, { STATE_CLOSED, ACTION_NONE }
+    },
+    // STATE_OPENING: moving off the closed limit switch is expected
+    {
+        { STATE_OPENING, ACTION_NONE }, { STATE_OPEN, ACTION_STOP }, { STATE_OPENING, ACTION_NONE }, { STATE_FAULT, ACTION_STOP },
+        { STATE_OPENING, ACTION_START_OPEN }, { STATE_CLOSING, ACTION_START_CLOSE }, { STATE_UNKNOWN, ACTION_STOP },
+        { STATE_RESTING, ACTION_NONE }, { STATE_FAULT, ACTION_STOP }, { STATE_UNKNOWN, ACTION_STOP }
+    },
+    // STATE_OPEN
+    {
+        { STATE_UNKNOWN, ACTION_NONE }, { STATE_OPEN, ACTION_NONE }, { STATE_CLOSED, ACTION_NONE }, { STATE_FAULT, ACTION_NONE },
+        { STATE_OPEN, ACTION_REFUSE }, { STATE_CLOSING, ACTION_START_CLOSE }, { STATE_OPEN, ACTION_STOP },
+        { STATE_OPEN, ACTION_NONE }, { STATE_OPEN, ACTION_NONE }, { STATE_OPEN, ACTION_NONE }
+    },
+    // STATE_CLOSING: moving off the open limit switch is expected
+    {
+        { STATE_CLOSING, ACTION_NONE }, { STATE_CLOSING, ACTION_NONE }, { STATE_CLOSED, ACTION_STOP }, { STATE_FAULT, ACTION_STOP },
+        { STATE_OPENING, ACTION_START_OPEN }, { STATE_CLOSING, ACTION_START_CLOSE }, { STATE_UNKNOWN, ACTION_STOP },
+        { STATE_RESTING, ACTION_NONE }, { STATE_FAULT, ACTION_STOP }, { STATE_UNKNOWN, ACTION_STOP }
+    },
+    // STATE_UNKNOWN
+    {
+        { STATE_UNKNOWN, ACTION_NONE }, { STATE_OPEN, ACTION_NONE }, { STATE_CLOSED, ACTION_NONE }, { STATE_FAULT, ACTION_NONE },
+        { STATE_OPENING, ACTION_START_OPEN }, { STATE_CLOSING, ACTION_START_CLOSE }, { STATE_UNKNOWN, ACTION_STOP },
+        { STATE_UNKNOWN, ACTION_NONE }, { STATE_UNKNOWN, ACTION_NONE }, { STATE_UNKNOWN, ACTION_NONE }
+    },
+    // STATE_FAULT: held until a single limit switch is reached. The operator may still move the roof.
+    {
+        { STATE_FAULT, ACTION_NONE }, { STATE_OPEN, ACTION_NONE }, { STATE_CLOSED, ACTION_NONE }, { STATE_FAULT, ACTION_NONE },
+        { STATE_OPENING, ACTION_START_OPEN }, { STATE_CLOSING, ACTION_START_CLOSE }, { STATE_FAULT, ACTION_STOP },
+        { STATE_FAULT, ACTION_NONE }, { STATE_FAULT, ACTION_NONE }, { STATE_FAULT, ACTION_NONE }
+    }
+};
+
+static_assert(sizeof(TRANSITIONS) / sizeof(TRANSITIONS[0]) == STATE_COUNT, "one transition row per state");
+
+constexpr Transition lookup(State state, Event event) { return TRANSITIONS[state][event]; }
+
+// A limit switch always stops the motion it was waiting for.
+static_assert(lookup(STATE_OPENING, EVENT_LIMIT_OPEN).next == STATE_OPEN && lookup(STATE_OPENING, EVENT_LIMIT_OPEN).action == ACTION_STOP,
+              "opening roof stops at the open limit");
+static_assert(lookup(STATE_CLOSING, EVENT_LIMIT_CLOSED).next == STATE_CLOSED && lookup(STATE_CLOSING, EVENT_LIMIT_CLOSED).action == ACTION_STOP,
+              "closing roof stops at the closed limit");
+static_assert(lookup(STATE_OPENING, EVENT_LIMITS_BOTH).action == ACTION_STOP && lookup(STATE_CLOSING, EVENT_LIMITS_BOTH).action == ACTION_STOP,
+              "a moving roof stops on a limit switch fault");
+static_assert(lookup(STATE_OPENING, EVENT_TARGET_REACHED).action == ACTION_STOP && lookup(STATE_CLOSING, EVENT_TARGET_REACHED).action == ACTION_STOP,
+              "a partial move stops at its target");
+// A START the relay never took left the roof where it was.
+static_assert(lookup(STATE_OPENING, EVENT_RELAY_FAILED).next == STATE_RESTING && lookup(STATE_CLOSING, EVENT_RELAY_FAILED).next == STATE_RESTING,
+              "a failed start returns to the resting state");
+
+// Limit switch event seen while the roof rests in state
+constexpr Event restingLimits(State state)
+{
+    return state == STATE_CLOSED ? EVENT_LIMIT_CLOSED : state == STATE_OPEN ? EVENT_LIMIT_OPEN :
+           state == STATE_FAULT ? EVENT_LIMITS_BOTH : EVENT_LIMITS_NONE;
+}
+
+}
+
+class RoofStateMachine
+{
+    public:
+
+        RoofStateMachine() : state(RoofStates::STATE_UNKNOWN), resting(RoofStates::STATE_UNKNOWN) {}
+
+        // Limit switch is pressed when its charger is off (LOW)
+        static bool isPressed(int level) { return level == 0; }
+
+        static RoofStates::Event limitEvent(bool fullOpen, bool fullClosed)
+        {
+            return static_cast<RoofStates::Event>(RoofStates::EVENT_LIMITS_NONE + (fullOpen ? 1 : 0) + (fullClosed ? 2 : 0));
+        }
+
+        static const char *getStateName(RoofStates::State state)
+        {
+            static const char *names[RoofStates::STATE_COUNT] = { "closed", "opening", "open", "closing", "unknown", "fault" };
+            return state < RoofStates::STATE_COUNT ? names[state] : "?";
+        }
+
+        RoofStates::State getState() const { return state; }
+        // State the current motion started from, unknown once the roof may have left it
+        RoofStates::State getResting() const { return resting; }
+
+        void reset(RoofStates::State initial = RoofStates::STATE_UNKNOWN)
+        {
+            state = initial;
+            if (isMoving(initial) == false)
+                resting = initial;
+        }
+
+        static bool isMoving(RoofStates::State state) { return state == RoofStates::STATE_OPENING || state == RoofStates::STATE_CLOSING; }
+        bool isMoving() const { return isMoving(state); }
+
+        /**
+         * @brief dispatch Apply an event.
+         * @return the transition taken. The caller carries out its action and compares next to
+         * the previous state to decide whether anything needs to be published.
+         */
+        RoofStates::Transition dispatch(RoofStates::Event event)
+        {
+            RoofStates::Transition transition = RoofStates::lookup(state, event);
+            if (transition.next == RoofStates::STATE_RESTING)
+                transition.next = resting;
+
+            if (isMoving(transition.next))
+            {
+                // A reversal, or a limit switch other than the one it rested on, means the roof may have moved.
+                if (isMoving() == false)
+                    resting = state;
+                else if (event != RoofStates::restingLimits(resting))
+                    resting = RoofStates::STATE_UNKNOWN;
+            }
+
+            state = transition.next;
+            return transition;
+        }
+
+    private:
+        RoofStates::State state;
+        RoofStates::State resting;
+};
+
+#endif
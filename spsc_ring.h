@@ -0,0 +1,85 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Bounded lock-free single-producer single-consumer ring buffer. One thread
+ may push and one other thread may pop concurrently without any locking.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef SPSCRING_H
+#define SPSCRING_H
+
+#include <stddef.h>
+
+#include <atomic>
+
+template <typename T, size_t N>
+class SPSCRing
+{
+        static_assert(N >= 2 && (N & (N - 1)) == 0, "SPSCRing size must be a power of two");
+
+    public:
+
+        SPSCRing() : head(0), tail(0) {}
+
+        /**
+         * @brief push Producer side.
+         * @return false if the ring is full, item is not stored.
+         */
+        bool push(const T &item)
+        {
+            size_t h = head.load(std::memory_order_relaxed);
+            if (h - tail.load(std::memory_order_acquire) == N)
+                return false;
+
+            items[h & (N - 1)] = item;
+            head.store(h + 1, std::memory_order_release);
+            return true;
+        }
+
+        /**
+         * @brief pop Consumer side.
+         * @return false if the ring is empty.
+         */
+        bool pop(T &item)
+        {
+            size_t t = tail.load(std::memory_order_relaxed);
+            if (t == head.load(std::memory_order_acquire))
+                return false;
+
+            item = items[t & (N - 1)];
+            tail.store(t + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool empty() const
+        {
+            return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+        }
+
+    private:
+
+        T items[N];
+        // Keep producer and consumer indices on separate cache lines. Padding rather than
+        // alignas, so owners do not become over-aligned types that plain new cannot allocate.
+        std::atomic<size_t> head;
+        char padding[64 - sizeof(std::atomic<size_t>)];
+        std::atomic<size_t> tail;
+};
+
+#endif
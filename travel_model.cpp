@@ -0,0 +1,129 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Learned roof travel time.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "travel_model.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+
+static const char *directionNames[TravelModel::DIRECTION_COUNT] = { "open", "close" };
+
+void TravelModel::reset()
+{
+    for (int i = 0; i < DIRECTION_COUNT; i++)
+    {
+        statistics[i].count    = 0;
+        statistics[i].mean     = 0;
+        statistics[i].variance = 0;
+        statistics[i].min      = 0;
+        statistics[i].max      = 0;
+    }
+}
+
+/************************************************************************************
+ * Running mean and variance, turning into an exponential average after WINDOW cycles.
+* ***********************************************************************************/
+void TravelModel::learn(Direction direction, double seconds)
+{
+    if (seconds <= 0)
+        return;
+
+    Statistics &s = statistics[direction];
+
+    if (s.count == 0)
+    {
+        s.min = s.max = seconds;
+    }
+    else
+    {
+        s.min = fmin(s.min, seconds);
+        s.max = fmax(s.max, seconds);
+    }
+
+    if (s.count < WINDOW)
+        s.count++;
+
+    double n     = (s.count < WINDOW) ? s.count : WINDOW;
+    double delta = seconds - s.mean;
+    s.mean      += delta / n;
+    s.variance   = (1 - 1 / n) * (s.variance + delta * delta / n);
+}
+
+double TravelModel::expected(Direction direction, double fraction) const
+{
+    if (fraction < 0)
+        fraction = 0;
+    else if (fraction > 1)
+        fraction = 1;
+    return statistics[direction].mean * fraction;
+}
+
+double TravelModel::stddev(Direction direction) const
+{
+    return sqrt(statistics[direction].variance);
+}
+
+/************************************************************************************
+ *
+* ***********************************************************************************/
+bool TravelModel::load(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == nullptr)
+        return false;
+
+    TravelModel loaded;
+    char name[16];
+    Statistics s;
+    while (fscanf(fp, "%15s %u %lf %lf %lf %lf", name, &s.count, &s.mean, &s.variance, &s.min, &s.max) == 6)
+    {
+        for (int i = 0; i < DIRECTION_COUNT; i++)
+        {
+            if (!strcmp(name, directionNames[i]))
+                loaded.statistics[i] = s;
+        }
+    }
+
+    fclose(fp);
+    *this = loaded;
+    return true;
+}
+
+bool TravelModel::save(const char *path) const
+{
+    std::string temporary = std::string(path) + ".tmp";
+    FILE *fp = fopen(temporary.c_str(), "w");
+    if (fp == nullptr)
+        return false;
+
+    for (int i = 0; i < DIRECTION_COUNT; i++)
+    {
+        const Statistics &s = statistics[i];
+        fprintf(fp, "%s %u %.6f %.6f %.6f %.6f\n", directionNames[i], s.count, s.mean, s.variance, s.min, s.max);
+    }
+
+    bool ok = (fclose(fp) == 0);
+    return ok && rename(temporary.c_str(), path) == 0;
+}
@@ -0,0 +1,80 @@
+/*
+ INDI Ikarus Roof driver.
+
+ Learned roof travel time. Open and close durations of completed full-travel
+ cycles are averaged per direction and kept on disk, so the driver can estimate
+ where the roof is during motion and tell a failed limit switch from a slow roof.
+
+ Copyright (C) 2015-2020 Jasem Mutlaq (mutlaqja@ikarustech.com)
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; either
+ version 2.1 of the License, or (at your option) any later version.
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef TRAVELMODEL_H
+#define TRAVELMODEL_H
+
+#include <stdint.h>
+
+class TravelModel
+{
+    public:
+
+        enum Direction
+        {
+            DIRECTION_OPEN,
+            DIRECTION_CLOSE,
+            DIRECTION_COUNT
+        };
+
+        // Older cycles fade out once this many were seen, so the model follows a wearing mechanism.
+        static const uint32_t WINDOW = 50;
+
+        struct Statistics
+        {
+            uint32_t count;
+            // Seconds of motor run time from fully closed to fully open or back
+            double mean;
+            double variance;
+            double min;
+            double max;
+        };
+
+        TravelModel() { reset(); }
+
+        void reset();
+
+        void learn(Direction direction, double seconds);
+
+        const Statistics &get(Direction direction) const { return statistics[direction]; }
+        bool isTrained(Direction direction) const { return statistics[direction].count > 0; }
+
+        /**
+         * @brief expected Expected seconds to travel part of the way.
+         * @param fraction 0 to 1 of the full travel.
+         * @return 0 if the direction was never learned.
+         */
+        double expected(Direction direction, double fraction) const;
+
+        double stddev(Direction direction) const;
+
+        // Plain text, one line per direction. save() replaces the file atomically.
+        bool load(const char *path);
+        bool save(const char *path) const;
+
+    private:
+        Statistics statistics[DIRECTION_COUNT];
+};
+
+#endif